@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+
+/* Batched leap methods. BATCH_LANES trajectories share every loop of a step,
+ * with the lane index innermost and a fixed trip count so that the compiler
+ * vectorises the propensities of mass action reactions, the stoichiometry
+ * products and the state updates across lanes. Rows are accumulated in local
+ * arrays, which cannot alias the workspace, and stored once.
+ * Lane l draws the same random numbers in the same order as the scalar step
+ * would on its own stream, and does the same floating point operations, so a
+ * batched trajectory is the scalar one (bit for bit, unless the compiler
+ * fuses multiply-adds differently in both).
+ */
+
+Batch_t * batch_new(Model_t * m, int compact){
+    int l;
+    int nreactions, nspecies;
+    Batch_t * b;
+
+    if(m->nevents > 0){
+        report_error("Models with events cannot be batched\n");
+        exit(1);
+    }
+    b = (Batch_t *) malloc(sizeof(Batch_t));
+    if (!b) {
+        report_error("allocation failure in batch_new()");
+        exit(1);
+    }
+    nreactions = m->Nreactions;
+    nspecies = m->nspecies;
+    b->m = m;
+    b->nlanes = 0;
+    b->compact = compact;
+    b->promoted = 0;
+    b->npromoted = 0;
+    b->params = (m->ninputs > 0) ? model_params_copy(m) : m->params;
+    b->x = dvector(nspecies * BATCH_LANES);
+    b->y = dvector(nspecies * BATCH_LANES);
+    b->d = dvector(nspecies * BATCH_LANES);
+    b->rates = dzeros(nreactions * BATCH_LANES);
+    b->L = dzeros(nreactions * BATCH_LANES);
+    b->scratch = dvector(nspecies);
+    b->xc = NULL;
+    b->fr = NULL;
+    b->k = NULL;
+    b->acc = NULL;
+    if(compact){
+        b->xc = (int32_t *) malloc(nspecies * BATCH_LANES * sizeof(int32_t));
+        b->fr = (float *) malloc(nreactions * BATCH_LANES * sizeof(float));
+        b->k = (unsigned int *) malloc(nreactions * BATCH_LANES * sizeof(unsigned int));
+        b->acc = (int64_t *) malloc(nspecies * BATCH_LANES * sizeof(int64_t));
+        if (!b->xc || !b->fr || !b->k || !b->acc) {
+            report_error("allocation failure in batch_new()");
+            exit(1);
+        }
+    }
+    for(l=0; l<BATCH_LANES; l++){
+        b->r[l] = rng_new(0);
+        b->s[l].r = b->r[l];
+        b->s[l].inverse = 0;
+        b->s[l].antithetic = 0;
+        b->s[l].u = NULL;
+    }
+    return b;
+}
+
+void free_batch(Batch_t * b){
+    int l;
+
+    if(b->params != b->m->params) free_params(b->m, b->params);
+    free_dvector(b->x);
+    free_dvector(b->y);
+    free_dvector(b->d);
+    free_dvector(b->rates);
+    free_dvector(b->L);
+    free_dvector(b->scratch);
+    if(b->compact){
+        free((char *) b->xc);
+        free((char *) b->fr);
+        free((char *) b->k);
+        free((char *) b->acc);
+    }
+    for(l=0; l<BATCH_LANES; l++) gsl_rng_free(b->r[l]);
+    free((char *) b);
+}
+
+void batch_start(Batch_t * b, unsigned long first, int nlanes){
+    /* Trajectories first, ..., first + nlanes - 1, on the streams of the same
+     * number. The idle lanes also start from the initial condition, which is
+     * promoted from the start if it does not fit in 32 bits. */
+    int i, l;
+    Model_t * m;
+
+    m = b->m;
+    b->nlanes = nlanes;
+    b->promoted = 0;
+    for(i=0; i<m->nspecies; i++){
+        if(m->istate[i] > INT32_MAX || m->istate[i] < INT32_MIN) b->promoted = 1;
+    }
+    for(i=0; i<m->nspecies; i++){
+        for(l=0; l<BATCH_LANES; l++){
+            if(b->compact && !b->promoted) b->xc[i*BATCH_LANES + l] = (int32_t) m->istate[i];
+            else b->x[i*BATCH_LANES + l] = (double) m->istate[i];
+        }
+    }
+    if(b->compact && b->promoted) b->npromoted++;
+    if(b->params != m->params) model_params_reset(m, b->params);
+    for(l=0; l<nlanes; l++) gsl_rng_set(b->r[l], first + l);
+}
+
+void batch_advance(Batch_t * b, batchStepFunc step, double t, double tend){
+    /* Single step from t to tend, parameters frozen at t as in leap_advance.
+     * Compact batches take the compact tau-leap step. */
+    if(b->m->ninputs > 0) model_set_inputs(b->m, b->params, t);
+    if(b->compact && !b->promoted) tleap_batch_step_compact(b, tend - t);
+    else step(b, b->x, tend - t);
+}
+
+void batch_state(Batch_t * b, int lane, double * state){
+    /* Copies the state of lane, whatever its storage */
+    int i;
+
+    for(i=0; i<b->m->nspecies; i++){
+        if(b->compact && !b->promoted) state[i] = b->xc[i*BATCH_LANES + lane];
+        else state[i] = b->x[i*BATCH_LANES + lane];
+    }
+}
+
+void batch_promote(Batch_t * b){
+    /* Moves the counts of a compact batch to double precision, for the rest
+     * of its trajectories */
+    int i;
+
+    for(i=0; i<b->m->nspecies * BATCH_LANES; i++) b->x[i] = b->xc[i];
+    b->promoted = 1;
+    b->npromoted++;
+}
+
+static void batch_choose_high(double * restrict v, const double * restrict n, int c){
+    /* v = binomial(n, c) lane by lane for c > 3, as ma_choose() in model.c:
+     * the falling factorial over c! up to the limit of model_ma_factorial(),
+     * the scalar law (log factorials) for the lanes beyond. Lanes with n < c
+     * are left to the caller */
+    int l, q, limit;
+    double fact;
+
+    model_ma_factorial(c, &fact, &limit);
+    for(l=0; l<BATCH_LANES; l++) v[l] = n[l];
+    for(q=1; q<c; q++){
+        for(l=0; l<BATCH_LANES; l++) v[l] *= n[l] - q;
+    }
+    for(l=0; l<BATCH_LANES; l++) v[l] /= fact;
+    for(l=0; l<BATCH_LANES; l++){
+        if(n[l] >= c && n[l] > limit) v[l] = model_ma_choose((int) n[l], c);
+    }
+}
+
+__attribute__((noinline))
+static void batch_binomial(double * restrict p, const double * restrict x, int c){
+    /* p *= model_ma_choose(x, c) lane by lane, by the same operations, so that
+     * the rates are those of prop_MA. The binomial coefficients are computed
+     * for every lane and then selected, branches would stop the vectoriser,
+     * and so would inlining (gcc unrolls the lane loops first). */
+    int l;
+    double n[BATCH_LANES], v[BATCH_LANES];
+
+    for(l=0; l<BATCH_LANES; l++) n[l] = (int) x[l];
+    if(c == 1){
+        for(l=0; l<BATCH_LANES; l++) v[l] = n[l];
+    } else if(c == 2){
+        for(l=0; l<BATCH_LANES; l++) v[l] = (n[l] - 1) * n[l] / 2;
+    } else if(c == 3){
+        for(l=0; l<BATCH_LANES; l++) v[l] = (n[l] - 2) * (n[l] - 1) / 2 * n[l] / 3;
+    } else {
+        batch_choose_high(v, n, c);
+    }
+    for(l=0; l<BATCH_LANES; l++) p[l] *= (n[l] >= c) ? v[l] : 0;
+}
+
+void batch_propensities(Batch_t * b, double * x){
+    /* rates = propensities of every lane of x */
+    int i, j, k, l, nspecies;
+    double * a;
+    Model_t * m;
+
+    m = b->m;
+    nspecies = m->nspecies;
+    for(j=0; j<m->Nreactions; j++){
+        a = b->rates + j * BATCH_LANES;
+        if(m->prop[j] == prop_MA){
+            /* prop_MA across lanes */
+            for(l=0; l<BATCH_LANES; l++) a[l] = b->params[j][0];
+            for(k=0; k<m->nreactants[j]; k++){
+                i = m->reactants[j][2*k];
+                batch_binomial(a, x + i*BATCH_LANES, m->reactants[j][2*k+1]);
+            }
+        } else {
+            /* Other rate laws, one lane at a time */
+            for(l=0; l<BATCH_LANES; l++){
+                for(i=0; i<nspecies; i++) b->scratch[i] = x[i*BATCH_LANES + l];
+                a[l] = m->prop[j](b->scratch, m->nreactants[j], m->reactants[j], b->params[j], m->acting_species[j]);
+            }
+        }
+    }
+}
+
+__attribute__((noinline))
+static void batch_binomial_compact(float * restrict p, const int32_t * restrict x, int c){
+    /* batch_binomial in single precision on 32 bit counts. Orders above 3
+     * are computed in double, the falling factorial would overflow a float */
+    int l;
+    float n[BATCH_LANES], v[BATCH_LANES];
+    double nd[BATCH_LANES], vd[BATCH_LANES];
+
+    for(l=0; l<BATCH_LANES; l++) n[l] = x[l];
+    if(c == 1){
+        for(l=0; l<BATCH_LANES; l++) v[l] = n[l];
+    } else if(c == 2){
+        for(l=0; l<BATCH_LANES; l++) v[l] = (n[l] - 1) * n[l] / 2;
+    } else if(c == 3){
+        for(l=0; l<BATCH_LANES; l++) v[l] = (n[l] - 2) * (n[l] - 1) / 2 * n[l] / 3;
+    } else {
+        for(l=0; l<BATCH_LANES; l++) nd[l] = x[l];
+        batch_choose_high(vd, nd, c);
+        for(l=0; l<BATCH_LANES; l++) v[l] = (float) vd[l];
+    }
+    for(l=0; l<BATCH_LANES; l++) p[l] *= (n[l] >= c) ? v[l] : 0;
+}
+
+void batch_propensities_compact(Batch_t * b){
+    /* fr = propensities of every lane of xc, in single precision */
+    int i, j, k, l, nspecies;
+    float * a;
+    Model_t * m;
+
+    m = b->m;
+    nspecies = m->nspecies;
+    for(j=0; j<m->Nreactions; j++){
+        a = b->fr + j * BATCH_LANES;
+        if(m->prop[j] == prop_MA){
+            for(l=0; l<BATCH_LANES; l++) a[l] = (float) b->params[j][0];
+            for(k=0; k<m->nreactants[j]; k++){
+                i = m->reactants[j][2*k];
+                batch_binomial_compact(a, b->xc + i*BATCH_LANES, m->reactants[j][2*k+1]);
+            }
+        } else {
+            for(l=0; l<BATCH_LANES; l++){
+                for(i=0; i<nspecies; i++) b->scratch[i] = b->xc[i*BATCH_LANES + l];
+                a[l] = (float) m->prop[j](b->scratch, m->nreactants[j], m->reactants[j], b->params[j], m->acting_species[j]);
+            }
+        }
+    }
+}
+
+static void batch_nrk_stage(Batch_t * b, const double * restrict v, const double * x,
+        const double * restrict d, double c, double tau, double * y){
+    /* nrk_stage lane by lane, v is [reaction][lane]. y may be x */
+    int i, j, k, l, s;
+    double acc[BATCH_LANES];
+
+    for(i=0; i<b->m->nspecies; i++){
+        for(l=0; l<BATCH_LANES; l++) acc[l] = 0;
+        for(k=b->m->sptr[i]; k<b->m->sptr[i+1]; k++){
+            j = b->m->sreaction[k];
+            s = b->m->sdelta[k];
+            for(l=0; l<BATCH_LANES; l++) acc[l] += s * v[j*BATCH_LANES + l];
+        }
+        for(l=0; l<BATCH_LANES; l++){
+            y[i*BATCH_LANES + l] = x[i*BATCH_LANES + l] + c * (tau * acc[l] + d[i*BATCH_LANES + l]);
+        }
+    }
+}
+
+void batch_nrk_step(Batch_t * b, double * x, double tau, const Nrk_t * scheme){
+    /* nrk_step across the lanes of b */
+    int i, j, k, l, s, nspecies, nreactions;
+    double *L, *d, *y, *rates;
+    double accd[BATCH_LANES], accf[BATCH_LANES];
+
+    nspecies = b->m->nspecies;
+    nreactions = b->m->Nreactions;
+    L = b->L;
+    d = b->d;
+    y = b->y;
+    rates = b->rates;
+
+    batch_propensities(b, x);
+    for(j=0; j<nreactions; j++){
+        for(l=0; l<b->nlanes; l++){
+            L[j*BATCH_LANES + l] = stream_poisson(b->s + l, tau * rates[j*BATCH_LANES + l]) - tau * rates[j*BATCH_LANES + l];
+        }
+        for(; l<BATCH_LANES; l++) L[j*BATCH_LANES + l] = 0;
+    }
+    /* d = S L and the first stage, in a single pass */
+    for(i=0; i<nspecies; i++){
+        for(l=0; l<BATCH_LANES; l++){
+            accd[l] = 0;
+            accf[l] = 0;
+        }
+        for(k=b->m->sptr[i]; k<b->m->sptr[i+1]; k++){
+            j = b->m->sreaction[k];
+            s = b->m->sdelta[k];
+            for(l=0; l<BATCH_LANES; l++){
+                accd[l] += s * L[j*BATCH_LANES + l];
+                accf[l] += s * rates[j*BATCH_LANES + l];
+            }
+        }
+        for(l=0; l<BATCH_LANES; l++){
+            d[i*BATCH_LANES + l] = accd[l];
+            y[i*BATCH_LANES + l] = x[i*BATCH_LANES + l] + scheme->a[0] * (tau * accf[l] + accd[l]);
+        }
+    }
+    for(k=1; k<scheme->nstages; k++){
+        batch_propensities(b, y);
+        batch_nrk_stage(b, rates, x, d, scheme->a[k], tau, y);
+    }
+    batch_propensities(b, y);
+    batch_nrk_stage(b, rates, x, d, 1, tau, x);
+    for(i=0; i<nspecies * BATCH_LANES; i++){
+        if(x[i] < 0) x[i] = 0;
+    }
+}
+
+batchStepFunc batch_method(leapStepFunc step){
+    /* Batched version of a leap step, NULL if there is none */
+    if(step == tleap_step) return tleap_batch_step;
+    if(step == nrk_step) return nrk_batch_step;
+    return NULL;
+}
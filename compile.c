@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+#include <dlfcn.h>
+
+/* Compiled models. sim_compile() writes the network as C, with the species
+ * indices, the reactant products and the constant parameters inlined, and
+ * builds it into a shared object exporting
+ *      dssim_rates(x, params, rates)      every propensity, in one call
+ *      dssim_update(j, x, params, rates)  fires reaction j and recomputes the
+ *                                         propensities reading the species
+ *                                         it changes, and only those
+ *      dssim_signature                    model_signature() of the model
+ * model_load_compiled() loads it with dlopen, and model_rates() and
+ * model_update() then go through it. The rate laws are the ones of model.c,
+ * term by term. Parameters set by inputs or events are still read from
+ * params, so the object fits any run of the model it was compiled from, but
+ * not one changing other parameters (sweeps).
+ * The compiler is $CC (cc by default), with COMPILE_FLAGS followed by
+ * $CFLAGS, i.e. CFLAGS=-march=native to tune the object for this host.
+ */
+
+#define COMPILE_CC "cc"
+#define COMPILE_FLAGS "-O3 -fno-math-errno -fPIC -shared"
+
+typedef struct _Law_t {
+    propensityFunc prop;
+    char * name;
+    int nacting;
+} Law_t;
+
+static const Law_t compile_laws[] = {
+    {prop_MA, "MA", 0},
+    {prop_HA, "HA", 1},
+    {prop_HI, "HI", 1},
+    {prop_MAHI, "MAHI", 2},
+    {prop_CI, "CI", 2},
+    {prop_HIHA, "HIHA", 2},
+    {prop_HAHAC, "HAHAC", 2},
+    {prop_HAHAHIC, "HAHAHIC", 3},
+    {prop_TEST, "TEST", 0}
+};
+
+static int compile_law(Model_t * m, int j){
+    int l;
+
+    for(l=0; l<(int) (sizeof(compile_laws) / sizeof(Law_t)); l++){
+        if(m->prop[j] == compile_laws[l].prop) return l;
+    }
+    report_error("Reaction %d has a rate law that cannot be compiled\n", j);
+    exit(1);
+}
+
+static int compile_variable(Model_t * m, int j, int k){
+    /* Is params[j][k] set by an input or an event, or not a number? */
+    int i, a;
+
+    if(!isfinite(m->params[j][k])) return 1;
+    for(i=0; i<m->ninputs; i++){
+        if(m->inputs[i].reaction == j && m->inputs[i].param == k) return 1;
+    }
+    for(i=0; i<m->nevents; i++){
+        for(a=0; a<m->events[i].nactions; a++){
+            if(m->events[i].actions[a].type == ACTION_SET_PARAM
+                    && m->events[i].actions[a].reaction == j && m->events[i].actions[a].param == k) return 1;
+        }
+    }
+    return 0;
+}
+
+static void fnv_add(unsigned long * h, const void * data, size_t n){
+    size_t i;
+    const unsigned char * c = (const unsigned char *) data;
+
+    for(i=0; i<n; i++){
+        *h ^= c[i];
+        *h *= 1099511628211UL;
+    }
+}
+
+static unsigned long model_signature(Model_t * m){
+    /* FNV-1a hash of everything a compiled model inlines */
+    int j, k, l;
+    unsigned long h = 14695981039346656037UL;
+
+    fnv_add(&h, &m->nspecies, sizeof(int));
+    fnv_add(&h, &m->Nreactions, sizeof(int));
+    for(j=0; j<m->Nreactions; j++){
+        l = compile_law(m, j);
+        fnv_add(&h, &l, sizeof(int));
+        fnv_add(&h, m->rspecies + m->rptr[j], (m->rptr[j+1] - m->rptr[j]) * sizeof(int));
+        fnv_add(&h, m->rcoeff + m->rptr[j], (m->rptr[j+1] - m->rptr[j]) * sizeof(int));
+        fnv_add(&h, m->cspecies + m->cptr[j], (m->cptr[j+1] - m->cptr[j]) * sizeof(int));
+        fnv_add(&h, m->cdelta + m->cptr[j], (m->cptr[j+1] - m->cptr[j]) * sizeof(int));
+        if(compile_laws[l].nacting > 0) fnv_add(&h, m->acting_species[j], compile_laws[l].nacting * sizeof(int));
+        fnv_add(&h, &m->nparams[j], sizeof(int));
+        for(k=0; k<m->nparams[j]; k++){
+            if(!compile_variable(m, j, k)) fnv_add(&h, &m->params[j][k], sizeof(double));
+        }
+    }
+    return h;
+}
+
+static void emit_param(FILE * out, Model_t * m, int j, int k){
+    /* Literals are exact, and always doubles */
+    if(compile_variable(m, j, k)) fprintf(out, "params[%d][%d]", j, k);
+    else fprintf(out, "(%.17e)", m->params[j][k]);
+}
+
+static void emit_law(FILE * out, Model_t * m, int j){
+    /* Body of the propensity of reaction j, as in model.c */
+    int i, k, c, limit;
+    double fact;
+    int * as = m->acting_species[j];
+
+    switch(compile_law(m, j)){
+    case 0: /* MA, reactants in increasing species order */
+        fprintf(out, "    return ");
+        emit_param(out, m, j, 0);
+        for(k=0; k<m->nreactants[j]; k++){
+            i = m->reactants[j][2*k];
+            c = m->reactants[j][2*k+1];
+            if(c == 1) fprintf(out, " * choose1((int) x[%d])", i);
+            else if(c == 2) fprintf(out, " * choose2((int) x[%d])", i);
+            else if(c == 3) fprintf(out, " * choose3((int) x[%d])", i);
+            else {
+                model_ma_factorial(c, &fact, &limit);
+                fprintf(out, " * chooseh((int) x[%d], %d, %.17e, %d)", i, c, fact, limit);
+            }
+        }
+        fprintf(out, ";\n");
+        break;
+    case 1: /* HA */
+        fprintf(out, "    int y = x[%d];\n    return ", as[0]);
+        emit_param(out, m, j, 0); fprintf(out, " / (1 + pow("); emit_param(out, m, j, 1);
+        fprintf(out, " / y, "); emit_param(out, m, j, 2); fprintf(out, "));\n");
+        break;
+    case 2: /* HI */
+        fprintf(out, "    int y = x[%d];\n    return ", as[0]);
+        emit_param(out, m, j, 0); fprintf(out, " / (1 + pow(y / "); emit_param(out, m, j, 1);
+        fprintf(out, ", "); emit_param(out, m, j, 2); fprintf(out, "));\n");
+        break;
+    case 3: /* MAHI */
+        fprintf(out, "    int ym = x[%d], yi = x[%d];\n    return ", as[0], as[1]);
+        emit_param(out, m, j, 0); fprintf(out, " * ym / (1 + pow(yi / "); emit_param(out, m, j, 1);
+        fprintf(out, ", "); emit_param(out, m, j, 2); fprintf(out, "));\n");
+        break;
+    case 4: /* CI */
+        fprintf(out, "    int ya = x[%d], yi = x[%d];\n    if(ya == 0) return 0;\n    return ", as[0], as[1]);
+        emit_param(out, m, j, 0); fprintf(out, " * pow(ya, "); emit_param(out, m, j, 2);
+        fprintf(out, ") / (pow("); emit_param(out, m, j, 1); fprintf(out, ", "); emit_param(out, m, j, 2);
+        fprintf(out, ") + pow(ya, "); emit_param(out, m, j, 2); fprintf(out, ") + pow(");
+        emit_param(out, m, j, 3); fprintf(out, " * yi, "); emit_param(out, m, j, 4); fprintf(out, "));\n");
+        break;
+    case 5: /* HIHA */
+        fprintf(out, "    int yi = x[%d], ya = x[%d];\n    if(ya == 0) return 0;\n    return ", as[0], as[1]);
+        emit_param(out, m, j, 0); fprintf(out, " / (1 + pow(yi / "); emit_param(out, m, j, 1);
+        fprintf(out, ", "); emit_param(out, m, j, 2); fprintf(out, ")) / (1 + pow(");
+        emit_param(out, m, j, 3); fprintf(out, " / ya, "); emit_param(out, m, j, 4); fprintf(out, "));\n");
+        break;
+    case 6: /* HAHAC */
+    case 7: /* HAHAHIC */
+        fprintf(out, "    int ya1 = x[%d], ya2 = x[%d];\n", as[0], as[1]);
+        fprintf(out, "    double h1 = pow(ya1 / "); emit_param(out, m, j, 1);
+        fprintf(out, ", "); emit_param(out, m, j, 2); fprintf(out, ");\n");
+        fprintf(out, "    double h2 = pow(ya2 / "); emit_param(out, m, j, 4);
+        fprintf(out, ", "); emit_param(out, m, j, 5); fprintf(out, ");\n");
+        fprintf(out, "    return ("); emit_param(out, m, j, 0); fprintf(out, " * h1 + ");
+        emit_param(out, m, j, 3); fprintf(out, " * h2) / (1 + h1 + h2");
+        if(compile_law(m, j) == 7) {
+            fprintf(out, " + pow((int) x[%d] / ", as[2]); emit_param(out, m, j, 6);
+            fprintf(out, ", "); emit_param(out, m, j, 7); fprintf(out, ")");
+        }
+        fprintf(out, ");\n");
+        break;
+    default: /* TEST */
+        fprintf(out, "    return 42;\n");
+    }
+}
+
+static int compile_reads(Model_t * m, int j, int * species){
+    /* Species read by the propensity of reaction j, returns how many */
+    int k, l, n;
+
+    l = compile_law(m, j);
+    n = 0;
+    if(l == 0) {
+        for(k=m->rptr[j]; k<m->rptr[j+1]; k++) species[n++] = m->rspecies[k];
+    }
+    for(k=0; k<compile_laws[l].nacting; k++) species[n++] = m->acting_species[j][k];
+    return n;
+}
+
+static int * compile_readers(Model_t * m, int * ptr){
+    /* Reactions reading species i, at [ptr[i], ptr[i+1]) of the result */
+    int i, j, k, n, nmax;
+    int *species, *count, *reaction;
+
+    nmax = 3;
+    for(j=0; j<m->Nreactions; j++){
+        if(m->rptr[j+1] - m->rptr[j] > nmax) nmax = m->rptr[j+1] - m->rptr[j];
+    }
+    species = ivector(nmax);
+    count = izeros(m->nspecies + 1);
+    for(j=0; j<m->Nreactions; j++){
+        n = compile_reads(m, j, species);
+        for(k=0; k<n; k++) count[species[k] + 1]++;
+    }
+    for(i=0; i<m->nspecies; i++) count[i+1] += count[i];
+    memcpy(ptr, count, (m->nspecies + 1) * sizeof(int));
+    reaction = ivector(count[m->nspecies] + 1);
+    for(j=0; j<m->Nreactions; j++){
+        n = compile_reads(m, j, species);
+        for(k=0; k<n; k++) reaction[count[species[k]]++] = j;
+    }
+    free_ivector(species);
+    free_ivector(count);
+    return reaction;
+}
+
+static void emit_model(FILE * out, Model_t * m, char * fname){
+    int i, j, k, q, n;
+    int *ptr, *reaction, *mark, *dep;
+
+    fprintf(out, "/* %s, compiled by dssim */\n\n", fname);
+    fprintf(out, "#include <math.h>\n\n");
+    fprintf(out, "const unsigned long dssim_signature = %luUL;\n\n", model_signature(m));
+    /* Mass action binomials as in model.c, fact = k! and limit the largest
+     * count taking the falling factorial */
+    fprintf(out, "static inline double choose1(int n){\n    return (n > 0) ? n : 0;\n}\n\n");
+    fprintf(out, "static inline double choose2(int n){\n    return (n < 2) ? 0 : (double) (n-1) * n / 2;\n}\n\n");
+    fprintf(out, "static inline double choose3(int n){\n    return (n < 3) ? 0 : (double) (n-2) * (n-1) / 2 * n / 3;\n}\n\n");
+    fprintf(out, "static inline double chooseh(int n, int k, double fact, int limit){\n"
+            "    int i;\n    double p;\n"
+            "    if(n < k) return 0;\n"
+            "    if(n <= limit){\n"
+            "        p = n;\n        for(i=1; i<k; i++) p *= n - i;\n        return p / fact;\n    }\n"
+            "    return exp(lgamma(n + 1.0) - lgamma(k + 1.0) - lgamma(n - k + 1.0));\n}\n\n");
+    for(j=0; j<m->Nreactions; j++){
+        fprintf(out, "static inline double r%d(const double * x, double ** params){\n", j);
+        emit_law(out, m, j);
+        fprintf(out, "}\n\n");
+    }
+    fprintf(out, "void dssim_rates(double * x, double ** params, double * rates){\n");
+    for(j=0; j<m->Nreactions; j++) fprintf(out, "    rates[%d] = r%d(x, params);\n", j, j);
+    fprintf(out, "}\n\n");
+
+    /* Firing j, then the reactions reading a species j changes */
+    ptr = ivector(m->nspecies + 1);
+    reaction = compile_readers(m, ptr);
+    mark = ivector(m->Nreactions);
+    dep = ivector(m->Nreactions);
+    for(j=0; j<m->Nreactions; j++) mark[j] = -1;
+    fprintf(out, "void dssim_update(int j, double * x, double ** params, double * rates){\n");
+    fprintf(out, "    switch(j){\n");
+    for(j=0; j<m->Nreactions; j++){
+        fprintf(out, "    case %d:\n", j);
+        n = 0;
+        for(k=m->cptr[j]; k<m->cptr[j+1]; k++){
+            fprintf(out, "        x[%d] += %d;\n", m->cspecies[k], m->cdelta[k]);
+            i = m->cspecies[k];
+            for(q=ptr[i]; q<ptr[i+1]; q++){
+                if(mark[reaction[q]] == j) continue;
+                mark[reaction[q]] = j;
+                dep[n++] = reaction[q];
+            }
+        }
+        for(q=0; q<n; q++) fprintf(out, "        rates[%d] = r%d(x, params);\n", dep[q], dep[q]);
+        fprintf(out, "        break;\n");
+    }
+    fprintf(out, "    }\n}\n");
+    free_ivector(ptr);
+    free_ivector(reaction);
+    free_ivector(mark);
+    free_ivector(dep);
+}
+
+void sim_compile(Model_t * m, char * fname, char * lib){
+    /* Writes fname.c and builds it into lib */
+    int j;
+    char src[1100], cmd[3000];
+    char * cc, * flags;
+    FILE * out;
+
+    /* Unsupported laws fail here, before anything is written */
+    for(j=0; j<m->Nreactions; j++) compile_law(m, j);
+    snprintf(src, sizeof(src), "%s.c", fname);
+    out = fopen(src, "w");
+    if(out == NULL) {
+        report_error("Could not write '%s'\n", src);
+        exit(1);
+    }
+    emit_model(out, m, fname);
+    fclose(out);
+    cc = getenv("CC");
+    flags = getenv("CFLAGS");
+    snprintf(cmd, sizeof(cmd), "%s %s %s -o '%s' '%s' -lm", (cc != NULL) ? cc : COMPILE_CC, COMPILE_FLAGS,
+            (flags != NULL) ? flags : "", lib, src);
+    if(system(cmd) != 0) {
+        report_error("Could not build '%s': %s\n", lib, cmd);
+        exit(1);
+    }
+    printf("# %s built from %s\n", lib, src);
+}
+
+void model_load_compiled(Model_t * m, char * lib){
+    char path[1100];
+    const unsigned long * signature;
+
+    /* dlopen searches the library path for names without a slash */
+    snprintf(path, sizeof(path), "%s%s", (strchr(lib, '/') == NULL) ? "./" : "", lib);
+    m->lib = dlopen(path, RTLD_NOW);
+    if(m->lib == NULL) {
+        report_error("Could not load '%s': %s\n", lib, dlerror());
+        exit(1);
+    }
+    signature = (const unsigned long *) dlsym(m->lib, "dssim_signature");
+    m->rates = (ratesFunc) dlsym(m->lib, "dssim_rates");
+    m->update = (updateFunc) dlsym(m->lib, "dssim_update");
+    if(signature == NULL || m->rates == NULL || m->update == NULL || *signature != model_signature(m)) {
+        report_error("'%s' was not compiled from this model\n", lib);
+        exit(1);
+    }
+}
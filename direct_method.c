@@ -17,43 +17,33 @@
 
 
 #include "methods.h"
-#include "time.h"
-#include<unistd.h>
 
-clock_t start, end;
-
-void sim_direct_method(Model_t * m, double tt, double hurdle){
+void sim_direct_method(Model_t * m, double tt, double hurdle, Stop_t * stop){
     int i, j, step;
-    long seed;
     int nreactions, nspecies;
-    int **rs, **ps, **as;
+    int *armed;
     double *state;
-    propensityFunc * prop;
     double **params;
     int nsteps;
-    double t, tau, a0, r1, r2, runningSum, thr, nextHurdle;
+    double t, tau, a0, r1, r2, runningSum, thr, nextHurdle, tevent, tstop;
     double * rates;
-    const gsl_rng_type * type = gsl_rng_default;
+    stop_reason reason;
     gsl_rng * r;
 
     /* Get the pointers */
     nreactions = m->Nreactions;
     nspecies = m->nspecies;
-    prop = m->prop;
-    params = m->params;
+    /* Events may change the parameters: work on a private copy */
+    params = (m->nevents > 0) ? model_params_copy(m) : m->params;
+    armed = ivector(m->nevents);
+    events_reset(m, armed);
     state = dzeros(nspecies);
     rates = dvector(m->Nreactions);
     for(i=0; i<nspecies; i++) state[i] = (double) m->istate[i];
-    rs = m->rstoichiometry;
-    ps = m->pstoichiometry;
-    as = m->acting_species;
-
-    gsl_rng_env_setup();
-    r = gsl_rng_alloc (type);
-    seed = time(NULL) * getpid();
-    gsl_rng_set (r, seed);                  // set seed
+    r = rng_new(0);
 
     t = 0;
+    events_fire(m, armed, t, state, params);
 
     /* Header: column names */
     printf("#time ");
@@ -70,22 +60,42 @@ void sim_direct_method(Model_t * m, double tt, double hurdle){
         nsteps = (int) ceil(tt / hurdle);
         step = 0;
         nextHurdle = hurdle;
+        reason = STOP_NONE;
+        tstop = 0;
+        if(stop != NULL) stop_reset(stop);
         //while(t < time){
-        start = clock();
+        model_rates(m, state, params, rates);
         while(step < nsteps){
-            for(i=0; i< nreactions; i++){
-                rates[i] = prop[i](state, nspecies, rs[i], params[i], as[i]);
-            }
             a0 = dsum(rates, nreactions);
 
             /* Sample tau and update time*/
             r1 = gsl_rng_uniform_pos (r);
-            if(a0 > 0){
-                tau = (-1/a0) * log(r1);
-            } else {
+            tau = (a0 > 0) ? (-1/a0) * log(r1) : INFINITY;
+
+            /* A timed event comes first: by memorylessness the pending
+             * reaction is dropped and the step restarts at the event time. */
+            tevent = events_next_time(m, armed);
+            if(t + tau > tevent){
+                while(tevent > nextHurdle && step < nsteps && reason == STOP_NONE){
+                    step += 1;
+                    printf("%g ",nextHurdle);
+                    for(i=0; i<nspecies; i++) printf("%ld ", (long) state[i]);
+                    printf("\n");
+                    tstop = nextHurdle;
+                    nextHurdle += hurdle;
+                    reason = stop_check(stop, state, params, armed);
+                }
+                if(reason != STOP_NONE) break;
+                t = tevent;
+                events_fire(m, armed, t, state, params);
+                model_rates(m, state, params, rates);
+                continue;
+            }
+            if(a0 <= 0){
                 /* No more reactions are likely to occur*/
-                tau = tt;
-                return;
+                reason = STOP_ABSORBING;
+                tstop = t;
+                break;
             }
 
             t = t + tau;
@@ -105,23 +115,91 @@ void sim_direct_method(Model_t * m, double tt, double hurdle){
              */
             i = t > nextHurdle;
             i = t < tt;
-            while(t > nextHurdle){
+            while(t > nextHurdle && reason == STOP_NONE){
                 step += 1;
                 printf("%g ",nextHurdle);
                 for(i=0; i<nspecies; i++) printf("%ld ", (long) state[i]);
                 printf("\n");
+                tstop = nextHurdle;
                 nextHurdle += hurdle;
+                reason = stop_check(stop, state, params, armed);
             }
+            /* Stopped at a hurdle: the pending reaction is dropped */
+            if(reason != STOP_NONE) break;
             /* Species update */
-            for(i=0; i<nspecies; i++){
-                state[i] += ps[j][i] -rs[j][i];
+            model_update(m, j, state, params, rates);
+            if(m->nevents > 0) {
+                events_fire(m, armed, t, state, params);
+                model_rates(m, state, params, rates);
+            }
+            if(stop != NULL && stop->cond != NULL && condition_holds(stop->cond, state)){
+                reason = STOP_CONDITION;
+                tstop = t;
+                break;
+            }
+        }
+        /* The remaining hurdles keep the state at the stop */
+        if(reason != STOP_NONE){
+            printf("# %s at t=%g\n", stop_name(reason), tstop);
+            while(step < nsteps){
+                step += 1;
+                printf("%g ",nextHurdle);
+                for(i=0; i<nspecies; i++) printf("%ld ", (long) state[i]);
+                printf("\n");
+                nextHurdle += hurdle;
             }
         }
-        end = clock();
 		printf("%g ", nextHurdle);
         for(i=0; i<nspecies; i++) printf("%ld ", (long) state[i]);
         printf("\n");
     }
+    if(params != m->params) free_params(m, params);
+    free_ivector(armed);
+    free_dvector(state);
+    free_dvector(rates);
     gsl_rng_free(r);
     return;
 }
+
+double ssa_advance(Model_t * m, double ** params, int * armed, double * state,
+        double * rates, double t, double tend, gsl_rng * r, Condition_t * stop){
+    /* Advance state with the direct method from t up to tend.
+     * If stop is not NULL the trajectory halts as soon as the condition holds
+     * and the time at which it happened is returned. Otherwise tend is
+     * returned. rates is a workspace of size m->Nreactions.
+     * Events are applied, on params, unless armed is NULL.
+     */
+    int j;
+    int nreactions;
+    double a0, tau, tevent, thr, runningSum;
+
+    nreactions = m->Nreactions;
+    model_rates(m, state, params, rates);
+    while(1){
+        if(stop != NULL && condition_holds(stop, state)) return t;
+        a0 = dsum(rates, nreactions);
+        /* No more reactions are likely to occur unless an event comes */
+        tau = (a0 > 0) ? (-1/a0) * log(gsl_rng_uniform_pos(r)) : INFINITY;
+        tevent = (armed != NULL) ? events_next_time(m, armed) : INFINITY;
+        if(t + tau > tevent && tevent < tend){
+            t = tevent;
+            events_fire(m, armed, t, state, params);
+            model_rates(m, state, params, rates);
+            continue;
+        }
+        if(t + tau >= tend) return tend;
+        t += tau;
+
+        thr = a0 * gsl_rng_uniform_pos(r);
+        runningSum = 0;
+        for(j=0; j<nreactions-1; j++){
+            runningSum += rates[j];
+            if(runningSum > thr) break;
+        }
+        model_update(m, j, state, params, rates);
+        if(armed != NULL && m->nevents > 0) {
+            events_fire(m, armed, t, state, params);
+            model_rates(m, state, params, rates);
+        }
+    }
+}
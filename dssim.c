@@ -19,16 +19,62 @@
 #include "model.h"
 #include "parser.h"
 #include "methods.h"
+#ifdef USE_MPI
+#include<mpi.h>
+
+static void finalize_mpi(void){
+    MPI_Finalize();
+}
+#endif
 
 
 int main(int argc, char ** argv){
 	Model_t * m;
     int opterr, c;
-	char fname[1000], algorithm[100];
+	char fname[1000] = "", algorithm[100] = "direct";
+    char coordinate[1000] = "", condition[1000] = "", sweep[1000] = "", lib[1000] = "";
+    Coordinate_t * coord;
+    Condition_t * target;
+    Sweep_t * sw;
+    char biases[1000] = "", mode[100] = "trajectory";
+    char * item, * saveptr;
+    double * gamma;
+    double bmin = 0, bmax = 0, g, tol = 0.05;
+    int nbins = 0, nwalkers = 1, ntraj = 1, window = 0, seglen = 1024, nthreads = 1, compact = 0, j;
+    unsigned long seed = 0;
+    Stop_t * stop;
+    sampling_t sampling = SAMPLING_PSEUDO;
+    leapStepFunc step;
+#ifdef USE_MPI
+    int rank, nranks;
+#endif
+
+	double time = 0, timestep = 1, burnin = 0;
 
-	double time = 0, timestep = 1;
+    /* dssim compile model [lib]: builds the model into lib, by default the
+     * model file name with its extension replaced by .so */
+    if(argc > 2 && strcmp(argv[1], "compile") == 0) {
+        m = load_model_from_file(argv[2]);
+        if(argc > 3) {
+            strcpy(lib, argv[3]);
+        } else {
+            strcpy(lib, argv[2]);
+            item = strrchr(lib, '.');
+            if(item != NULL && strchr(item, '/') == NULL) *item = '\0';
+            strcat(lib, ".so");
+        }
+        sim_compile(m, argv[2], lib);
+        free_model(m);
+        return 0;
+    }
+#ifdef USE_MPI
+    MPI_Init(&argc, &argv);
+    atexit(finalize_mpi);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+#endif
     opterr = 0;
-    while ((c = getopt (argc, argv, "a:m:n:t:d:")) != -1)
+    while ((c = getopt (argc, argv, "a:m:n:t:d:c:b:w:s:g:v:e:o:i:l:j:r:p:x:k:")) != -1)
       switch (c)
         {
         case 't':
@@ -37,12 +83,92 @@ int main(int argc, char ** argv){
         case 'd':
           timestep = atof(optarg);
           break;
+        case 'n':
+          /* number of trajectories; the cross-entropy stage of dwSSA runs
+           * batches of a tenth of them, at least 1000, per level */
+          ntraj = atoi(optarg);
+          break;
         case 'm':
           strcpy(fname, optarg);
           break;
         case 'a':
           strcpy(algorithm, optarg);
           break;
+        case 'c':
+          strcpy(coordinate, optarg);
+          break;
+        case 'b':
+          /* bins along the coordinate (we) or of every species (stats): min:max:nbins */
+          if(sscanf(optarg, "%lf:%lf:%d", &bmin, &bmax, &nbins) != 3) {
+            fprintf (stderr, "Option -b expects min:max:nbins.\n");
+            return 1;
+          }
+          break;
+        case 'w':
+          nwalkers = atoi(optarg);
+          break;
+        case 's':
+          strcpy(condition, optarg);
+          break;
+        case 'e':
+          /* steady state window, in output points, and relative tolerance: window[:tol] */
+          if(sscanf(optarg, "%d:%lf", &window, &tol) < 1) {
+            fprintf (stderr, "Option -e expects window[:tol].\n");
+            return 1;
+          }
+          break;
+        case 'o':
+          /* output mode: trajectory, stationary, fpt, psd or stats */
+          strcpy(mode, optarg);
+          break;
+        case 'i':
+          /* burn-in time, discarded by the stationary and psd modes */
+          burnin = atof(optarg);
+          break;
+        case 'l':
+          /* segment length of the spectra, in points */
+          seglen = atoi(optarg);
+          break;
+        case 'j':
+          /* threads of the stats, fpt, psd and sweep modes, or of a leap trajectory */
+          nthreads = atoi(optarg);
+          break;
+        case 'r':
+          /* seed of the random streams, random if not given */
+          seed = strtoul(optarg, NULL, 10);
+          break;
+        case 'p':
+          /* precision of the stats mode: double or compact (32 bit counts) */
+          if(strcmp(optarg, "compact") == 0) {
+            compact = 1;
+          } else if(strcmp(optarg, "double") != 0) {
+            fprintf (stderr, "Option -p expects double or compact.\n");
+            return 1;
+          }
+          break;
+        case 'v':
+          /* variance reduction for leap ensembles */
+          if(strcmp(optarg, "anti") == 0) {
+            sampling = SAMPLING_ANTITHETIC;
+          } else if(strcmp(optarg, "rqmc") == 0) {
+            sampling = SAMPLING_RQMC;
+          } else {
+            fprintf (stderr, "Option -v expects anti or rqmc.\n");
+            return 1;
+          }
+          break;
+        case 'x':
+          /* sweep file, or axes "reaction 3 param 0 in logspace(1e-4, 1e-2, 50); ..." */
+          strcpy(sweep, optarg);
+          break;
+        case 'k':
+          /* shared object built by dssim compile */
+          strcpy(lib, optarg);
+          break;
+        case 'g':
+          /* propensity biases: reaction:factor,reaction:factor,... */
+          strcpy(biases, optarg);
+          break;
         case '?':
           if (optopt == 'c')
             fprintf (stderr, "Option -%c requires an argument.\n", optopt);
@@ -58,24 +184,169 @@ int main(int argc, char ** argv){
         }
 
 	m = load_model_from_file(fname);
-    if(strcmp(algorithm,"tleap") == 0) {
-        sim_tleap(m, time, timestep);
-    } else if(strcmp(algorithm,"nrk3l") == 0) {
-        sim_nrk3l(m, time, timestep);
-    } else if(strcmp(algorithm,"nrk3m") == 0) {
-        sim_nrk3m(m, time, timestep);
-    } else if(strcmp(algorithm,"nrk3h") == 0) {
-        sim_nrk3h(m, time, timestep);
-    } else if(strcmp(algorithm,"nrk5l") == 0) {
-        sim_nrk5l(m, time, timestep);
-    } else if(strcmp(algorithm,"nrk5m") == 0) {
-        sim_nrk5m(m, time, timestep);
-    } else if(strcmp(algorithm,"nrk5h") == 0) {
-        sim_nrk5h(m, time, timestep);
+    if(strlen(lib) > 0) {
+        /* Compiled models inline the parameters that a sweep or the
+         * sensitivities would change */
+        if(strcmp(mode,"sweep") == 0) report_warning("Sweeps ignore the compiled model\n");
+        else if(strcmp(algorithm,"cfd") == 0) report_warning("Sensitivities ignore the compiled model\n");
+        else model_load_compiled(m, lib);
+    }
+#ifdef USE_MPI
+    /* Every rank needs the same key, drawn by rank 0 if not given */
+    if(rank == 0) seed = rng_seed(seed);
+    MPI_Bcast(&seed, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+    if(nranks > 1 && strcmp(mode,"stats") != 0) {
+        report_error("Only the stats mode runs on several MPI ranks\n");
+        exit(1);
+    }
+#endif
+    rng_seed(seed);
+    step = leap_method(algorithm);
+    if(nthreads > 1 && strcmp(mode,"stats") != 0 && strcmp(mode,"fpt") != 0 && strcmp(mode,"psd") != 0
+            && strcmp(mode,"sweep") != 0 && (strcmp(mode,"trajectory") != 0 || step == NULL
+            || ntraj > 1 || sampling != SAMPLING_PSEUDO)) {
+        report_warning("Threads are only used by the stats, fpt, psd and sweep modes, and by single leap trajectories\n");
+    }
+    if(m->ninputs > 0 && step == NULL && strcmp(algorithm,"heun") != 0
+            && strcmp(algorithm,"thinning") != 0 && strcmp(algorithm,"direct") != 0) {
+        report_warning("Time dependent parameters are ignored by algorithm '%s'\n", algorithm);
+    }
+    if(m->nevents > 0 && (strcmp(algorithm,"we") == 0 || strcmp(algorithm,"dwssa") == 0
+            || strcmp(algorithm,"cfd") == 0)) {
+        report_warning("Events are ignored by algorithm '%s'\n", algorithm);
+    }
+    if(strcmp(mode,"stationary") == 0) {
+        if(strcmp(algorithm,"direct") != 0) {
+            report_warning("The stationary distribution is always computed with the direct method\n");
+        }
+        if(m->ninputs > 0) {
+            report_error("The stationary distribution requires time independent parameters\n");
+            exit(1);
+        }
+        sim_stationary(m, time, burnin);
+        free_model(m);
+        return 0;
+    } else if(strcmp(mode,"fpt") == 0) {
+        if(strlen(condition) == 0) {
+            report_error("First passage times require a target condition (-s)\n");
+            exit(1);
+        }
+        if(m->ninputs > 0 && step == NULL) {
+            report_error("First passage times with time dependent parameters require a leap method\n");
+            exit(1);
+        }
+        if(step == NULL && strcmp(algorithm,"direct") != 0) {
+            report_warning("First passage times are computed with the direct method\n");
+        }
+        target = parse_condition(m, condition);
+        sim_first_passage(m, time, timestep, step, ntraj, target, nthreads);
+        free_condition(target);
+        free_model(m);
+        return 0;
+    } else if(strcmp(mode,"psd") == 0) {
+        if(m->ninputs > 0 && step == NULL) {
+            report_error("Spectra with time dependent parameters require a leap method\n");
+            exit(1);
+        }
+        if(step == NULL && strcmp(algorithm,"direct") != 0) {
+            report_warning("Spectra are computed with the direct method\n");
+        }
+        sim_spectrum(m, time, timestep, step, ntraj, burnin, seglen, nthreads);
+        free_model(m);
+        return 0;
+    } else if(strcmp(mode,"stats") == 0) {
+        if(m->ninputs > 0 && step == NULL) {
+            report_error("Ensemble statistics with time dependent parameters require a leap method\n");
+            exit(1);
+        }
+        if(step == NULL && strcmp(algorithm,"direct") != 0) {
+            report_warning("Ensemble statistics are computed with the direct method\n");
+        }
+#ifdef USE_MPI
+        sim_ensemble_mpi(m, time, timestep, step, ntraj, bmin, bmax, nbins, nthreads, compact);
+#else
+        sim_ensemble(m, time, timestep, step, ntraj, bmin, bmax, nbins, nthreads, compact);
+#endif
+        free_model(m);
+        return 0;
+    } else if(strcmp(mode,"sweep") == 0) {
+        if(strlen(sweep) == 0) {
+            report_error("Sweeps require a parameter grid (-x)\n");
+            exit(1);
+        }
+        if(step == NULL && strcmp(algorithm,"direct") != 0) {
+            report_warning("Sweeps are computed with the direct method\n");
+        }
+        sw = parse_sweep(m, sweep);
+        sim_sweep(m, time, timestep, step, sw, ntraj, nthreads);
+        free_sweep(sw);
+        free_model(m);
+        return 0;
+    } else if(strcmp(mode,"trajectory") != 0) {
+        report_error("Output mode '%s' not recognised\n", mode);
+        exit(1);
+    }
+    /* Trajectories stop early on absorbing states, and on the condition (-s)
+     * or at steady state (-e) if given */
+    target = NULL;
+    stop = NULL;
+    if(strcmp(algorithm,"we") != 0 && strcmp(algorithm,"dwssa") != 0 && strcmp(algorithm,"cfd") != 0) {
+        target = (strlen(condition) > 0) ? parse_condition(m, condition) : NULL;
+        stop = stop_new(m, target, window, tol);
+    }
+    if(step != NULL && (ntraj > 1 || sampling != SAMPLING_PSEUDO)) {
+        coord = (strlen(coordinate) > 0) ? parse_coordinate(m, coordinate) : NULL;
+        sim_leap_ensemble(m, time, timestep, step, ntraj, sampling, coord, stop);
+        if(coord != NULL) free_coordinate(coord);
+    } else if(step != NULL && nthreads > 1) {
+        sim_leap(m, time, timestep, step, stop, nthreads);
+    } else if(strcmp(algorithm,"tleap") == 0) {
+        sim_tleap(m, time, timestep, stop);
+    } else if(step == nrk_step) {
+        sim_nrk(m, time, timestep, stop);
     } else if(strcmp(algorithm,"heun") == 0) {
-        sim_heun(m, time, timestep);
+        sim_heun(m, time, timestep, stop);
+    } else if(strcmp(algorithm,"we") == 0) {
+        if(strlen(coordinate) == 0 || nbins < 1) {
+            report_error("Weighted ensemble requires a coordinate (-c) and bins (-b)\n");
+            exit(1);
+        }
+        coord = parse_coordinate(m, coordinate);
+        target = (strlen(condition) > 0) ? parse_condition(m, condition) : NULL;
+        sim_weighted_ensemble(m, time, timestep, coord, bmin, bmax, nbins, nwalkers, target);
+        free_coordinate(coord);
+        if(target != NULL) free_condition(target);
+    } else if(strcmp(algorithm,"dwssa") == 0) {
+        if(strlen(condition) == 0) {
+            report_error("dwSSA requires a rare event condition (-s)\n");
+            exit(1);
+        }
+        target = parse_condition(m, condition);
+        gamma = NULL;
+        if(strlen(biases) > 0) {
+            gamma = dvector(m->Nreactions);
+            for(j=0; j<m->Nreactions; j++) gamma[j] = 1;
+            for(item=strtok_r(biases, ",", &saveptr); item != NULL; item=strtok_r(NULL, ",", &saveptr)) {
+                if(sscanf(item, "%d:%lf", &j, &g) != 2 || j < 0 || j >= m->Nreactions || g <= 0) {
+                    report_error("Bias '%s' not valid\n", item);
+                    exit(1);
+                }
+                gamma[j] = g;
+            }
+        }
+        sim_dwssa(m, time, ntraj, target, gamma);
+        free_condition(target);
+        if(gamma != NULL) free_dvector(gamma);
+    } else if(strcmp(algorithm,"cfd") == 0) {
+        sim_sensitivity(m, time, ntraj);
+    } else if(strcmp(algorithm,"thinning") == 0 || m->ninputs > 0) {
+        sim_thinning(m, time, timestep, stop);
     } else {
-        sim_direct_method(m, time, timestep);
+        sim_direct_method(m, time, timestep, stop);
+    }
+    if(stop != NULL) {
+        free_stop(stop);
+        if(target != NULL) free_condition(target);
     }
 	free_model(m);
 	return 0;
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+#include<gsl/gsl_sort.h>
+
+/* Doubly weighted SSA (Kuwahara & Mura 2008, Daigle et al. 2011).
+ * Reaction j fires with biased propensity gamma[j] * a_j(x). Each trajectory
+ * carries the likelihood ratio of the unbiased over the biased path,
+ *      W = prod_steps (a_j / b_j) * exp(-(a0 - b0) * tau),
+ * so that the mean of W * 1{event before tt} is an unbiased estimate of the
+ * probability of the rare event.
+ * Without user biases, they are found with the multilevel cross-entropy method:
+ * batches of trajectories push an intermediate level (the DWSSA_CE_RHO
+ * quantile of the closest approach to the event) towards the event, updating
+ * gamma[j] = sum W n_j / sum W int a_j dt over the trajectories reaching the
+ * level. A batch is ntraj / DWSSA_CE_SHARE trajectories, but at least
+ * DWSSA_CE_MINBATCH so that the quantile rests on enough of them.
+ */
+
+#define DWSSA_CE_SHARE 10
+#define DWSSA_CE_MINBATCH 1000
+#define DWSSA_CE_RHO 0.01
+#define DWSSA_CE_MAXLEVELS 20
+#define DWSSA_Z95 1.959963984540054
+
+static int dwssa_trajectory(Model_t * m, double tt, double * gamma, Condition_t * event,
+        gsl_rng * r, double * state, double * rates, double * logw, int direction,
+        double * extreme, double * nfired, double * integral,
+        double * snapfired, double * snapintegral, double * snaplogw){
+    /* Runs one biased trajectory from the initial condition up to tt or until
+     * the event happens, in which case 1 is returned. The log-likelihood ratio
+     * is returned in logw.
+     * If extreme is not NULL, the closest approach to the event along its
+     * coordinate is tracked, together with the reaction counts, propensity
+     * integrals and log-likelihood when it was reached (cross-entropy stats).
+     */
+    int i, j, nreactions, nspecies;
+    double t, a0, b0, tau, thr, runningSum, x;
+
+    nreactions = m->Nreactions;
+    nspecies = m->nspecies;
+    for(i=0; i<nspecies; i++) state[i] = (double) m->istate[i];
+    t = 0;
+    *logw = 0;
+    if(extreme != NULL){
+        *extreme = coordinate_value(event->lhs, state);
+        for(j=0; j<nreactions; j++){
+            nfired[j] = 0;
+            integral[j] = 0;
+            snapfired[j] = 0;
+            snapintegral[j] = 0;
+        }
+        *snaplogw = 0;
+    }
+    while(1){
+        if(condition_holds(event, state)) return 1;
+        a0 = 0;
+        b0 = 0;
+        model_rates(m, state, m->params, rates);
+        for(j=0; j<nreactions; j++){
+            a0 += rates[j];
+            b0 += gamma[j] * rates[j];
+        }
+        /* Biases are strictly positive, so b0 == 0 means an absorbing state */
+        if(b0 <= 0) return 0;
+        tau = (-1/b0) * log(gsl_rng_uniform_pos(r));
+        if(t + tau >= tt){
+            tau = tt - t;
+            *logw -= (a0 - b0) * tau;
+            if(extreme != NULL){
+                for(j=0; j<nreactions; j++) integral[j] += rates[j] * tau;
+            }
+            return 0;
+        }
+        t += tau;
+        *logw -= (a0 - b0) * tau;
+
+        /* Sample reaction j from the biased propensities */
+        thr = b0 * gsl_rng_uniform_pos(r);
+        runningSum = 0;
+        for(j=0; j<nreactions-1; j++){
+            runningSum += gamma[j] * rates[j];
+            if(runningSum > thr) break;
+        }
+        *logw -= log(gamma[j]);
+        model_fire(m, j, state);
+        if(extreme != NULL){
+            for(i=0; i<nreactions; i++) integral[i] += rates[i] * tau;
+            nfired[j] += 1;
+            x = coordinate_value(event->lhs, state);
+            if(direction * (x - *extreme) > 0){
+                *extreme = x;
+                memcpy(snapfired, nfired, nreactions * sizeof(double));
+                memcpy(snapintegral, integral, nreactions * sizeof(double));
+                *snaplogw = *logw;
+            }
+        }
+    }
+}
+
+static void dwssa_cross_entropy(Model_t * m, double tt, double * gamma, Condition_t * event,
+        int nbatch, gsl_rng * r, double * state, double * rates){
+    int j, k, level, nelite, nreactions, direction, final;
+    double lvl, num, den, w, logw;
+    double *extreme, *sorted, *nfired, *integral, *snapfired, *snapintegral, *snaplogw;
+
+    nreactions = m->Nreactions;
+    extreme = dvector(nbatch);
+    sorted = dvector(nbatch);
+    snaplogw = dvector(nbatch);
+    snapfired = dvector(nbatch * nreactions);
+    snapintegral = dvector(nbatch * nreactions);
+    nfired = dvector(nreactions);
+    integral = dvector(nreactions);
+
+    /* Move the coordinate up or down to reach the event? */
+    for(j=0; j<m->nspecies; j++) state[j] = (double) m->istate[j];
+    direction = (event->value >= coordinate_value(event->lhs, state)) ? 1 : -1;
+    nelite = (int) ceil(DWSSA_CE_RHO * nbatch);
+
+    for(level=0; level<DWSSA_CE_MAXLEVELS; level++){
+        for(k=0; k<nbatch; k++){
+            dwssa_trajectory(m, tt, gamma, event, r, state, rates, &logw, direction,
+                    extreme + k, nfired, integral, snapfired + k*nreactions,
+                    snapintegral + k*nreactions, snaplogw + k);
+            sorted[k] = direction * extreme[k];
+        }
+        /* Intermediate level: the rho quantile of the closest approach */
+        gsl_sort(sorted, 1, nbatch);
+        lvl = sorted[nbatch - nelite];
+        final = (lvl >= direction * event->value);
+        if(final) lvl = direction * event->value;
+        for(j=0; j<nreactions; j++){
+            num = 0;
+            den = 0;
+            for(k=0; k<nbatch; k++){
+                if(direction * extreme[k] < lvl) continue;
+                w = exp(snaplogw[k]);
+                num += w * snapfired[k*nreactions + j];
+                den += w * snapintegral[k*nreactions + j];
+            }
+            /* Reactions that never fired keep their bias */
+            if(num > 0 && den > 0) gamma[j] = num / den;
+        }
+        printf("# level %g gamma", direction * lvl);
+        for(j=0; j<nreactions; j++) printf(" %g", gamma[j]);
+        printf("\n");
+        if(final) break;
+    }
+    if(level == DWSSA_CE_MAXLEVELS){
+        report_warning("Cross-entropy did not reach the event after %d levels\n", DWSSA_CE_MAXLEVELS);
+    }
+    free_dvector(extreme);
+    free_dvector(sorted);
+    free_dvector(snaplogw);
+    free_dvector(snapfired);
+    free_dvector(snapintegral);
+    free_dvector(nfired);
+    free_dvector(integral);
+}
+
+void sim_dwssa(Model_t * m, double tt, int ntraj, Condition_t * event, double * gamma){
+    /* Probability that event happens before tt. If gamma is NULL the biases
+     * are optimised with the cross-entropy method first. */
+    int j, k, nhits, nbatch;
+    double *state, *rates, *g;
+    double logw, w, s1, s2, p, se;
+    gsl_rng * r;
+
+    if(ntraj < 2){
+        report_error("dwSSA requires at least two trajectories\n");
+        exit(1);
+    }
+    state = dvector(m->nspecies);
+    rates = dvector(m->Nreactions);
+    g = dvector(m->Nreactions);
+    for(j=0; j<m->Nreactions; j++) g[j] = (gamma != NULL) ? gamma[j] : 1;
+
+    r = rng_new(0);
+
+    if(gamma == NULL) {
+        nbatch = ntraj / DWSSA_CE_SHARE;
+        if(nbatch < DWSSA_CE_MINBATCH) nbatch = DWSSA_CE_MINBATCH;
+        dwssa_cross_entropy(m, tt, g, event, nbatch, r, state, rates);
+    }
+
+    nhits = 0;
+    s1 = 0;
+    s2 = 0;
+    for(k=0; k<ntraj; k++){
+        if(dwssa_trajectory(m, tt, g, event, r, state, rates, &logw, 0,
+                NULL, NULL, NULL, NULL, NULL, NULL)){
+            w = exp(logw);
+            nhits++;
+            s1 += w;
+            s2 += w * w;
+        }
+    }
+    p = s1 / ntraj;
+    se = sqrt((s2 / ntraj - p * p) / (ntraj - 1));
+    printf("#trajectories hits probability stderr ci95_low ci95_high\n");
+    printf("%d %d %g %g %g %g\n", ntraj, nhits, p, se, p - DWSSA_Z95 * se, p + DWSSA_Z95 * se);
+
+    free_dvector(state);
+    free_dvector(rates);
+    free_dvector(g);
+    gsl_rng_free(r);
+}
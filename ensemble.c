@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+#include "stats.h"
+
+/* Ensemble statistics. ntraj trajectories are run back to back and their
+ * states at the points of the dt grid, from 0 to tt, are folded into online
+ * accumulators as soon as they are reached (see Ensemble_t). Nothing is
+ * printed per trajectory, only the statistics at the end, so memory and
+ * output are O(points x species^2) whatever the number of trajectories.
+ * Trajectory k always uses random stream k and the trajectories are folded in
+ * order, so the statistics do not depend on the number of threads. Shards of
+ * the trajectories can also be collected apart and merged (ensemble_mpi.c).
+ * Leap methods on models without events run BATCH_LANES trajectories at a
+ * time (see batch.c), which gives the same trajectories. With compact set,
+ * tau-leap batches keep 32 bit counts and float propensities instead, which
+ * halves their memory traffic at the cost of single precision rates.
+ */
+
+typedef struct _EnsembleJob_t {
+    /* Shared arguments and per-thread workspaces of the trajectory pool, whose
+     * jobs are single trajectories or, with bstep, batches of them. Job k
+     * keeps its states in the result slot buf[k % nslots]
+     * ([lane][point][species]) until they are folded into e. */
+    double dt;
+    long first;
+    int npoints, ntraj, nslots;
+    Ensemble_t * e;
+    batchStepFunc bstep;
+    Traj_t ** tr;
+    Batch_t ** b;
+    double ** buf;
+} EnsembleJob_t;
+
+static void ensemble_run(void * arg, int thread, int k){
+    int step_n, ns;
+    EnsembleJob_t * job = (EnsembleJob_t *) arg;
+    Traj_t * tr = job->tr[thread];
+    double * buf = job->buf[k % job->nslots];
+
+    ns = tr->m->nspecies;
+    gsl_rng_set(tr->r, job->first + k);
+    traj_start(tr);
+    memcpy(buf, tr->state, ns * sizeof(double));
+    for(step_n=1; step_n<job->npoints; step_n++){
+        traj_advance(tr, job->dt * (step_n-1), job->dt * step_n, NULL);
+        memcpy(buf + step_n * ns, tr->state, ns * sizeof(double));
+    }
+}
+
+static void ensemble_run_batch(void * arg, int thread, int k){
+    int l, step_n, ns, nlanes;
+    EnsembleJob_t * job = (EnsembleJob_t *) arg;
+    Batch_t * b = job->b[thread];
+    double * buf = job->buf[k % job->nslots];
+
+    ns = b->m->nspecies;
+    nlanes = job->ntraj - k * BATCH_LANES;
+    if(nlanes > BATCH_LANES) nlanes = BATCH_LANES;
+    batch_start(b, (unsigned long) (job->first + k * BATCH_LANES), nlanes);
+    for(step_n=0; step_n<job->npoints; step_n++){
+        if(step_n > 0) batch_advance(b, job->bstep, job->dt * (step_n-1), job->dt * step_n);
+        for(l=0; l<nlanes; l++) batch_state(b, l, buf + (l * job->npoints + step_n) * ns);
+    }
+}
+
+static void ensemble_fold(void * arg, int thread, int k){
+    int l, step_n, nlanes;
+    double * buf;
+    EnsembleJob_t * job = (EnsembleJob_t *) arg;
+
+    nlanes = 1;
+    if(job->bstep != NULL){
+        nlanes = job->ntraj - k * BATCH_LANES;
+        if(nlanes > BATCH_LANES) nlanes = BATCH_LANES;
+    }
+    for(l=0; l<nlanes; l++){
+        buf = job->buf[k % job->nslots] + l * job->npoints * job->e->nspecies;
+        for(step_n=0; step_n<job->npoints; step_n++){
+            ensemble_add(job->e, step_n, buf + step_n * job->e->nspecies);
+        }
+    }
+}
+
+Ensemble_t * ensemble_collect(Model_t * m, double tt, double dt, leapStepFunc step,
+        long first, int ntraj, double bmin, double bmax, int nbins, int nthreads,
+        int compact, int * npromoted){
+    /* Statistics of trajectories first, ..., first + ntraj - 1, without any
+     * output, so that shards of an ensemble can be collected separately and
+     * merged. The number of batches promoted from compact counts is added to
+     * npromoted. */
+    int i, njobs;
+    EnsembleJob_t job;
+
+    job.bstep = (step != NULL && m->nevents == 0) ? batch_method(step) : NULL;
+    if(compact && job.bstep != tleap_batch_step) compact = 0;
+    njobs = (job.bstep != NULL) ? (ntraj + BATCH_LANES - 1) / BATCH_LANES : ntraj;
+    if(nthreads > njobs) nthreads = njobs;
+    if(nthreads < 1) nthreads = 1;
+    job.dt = dt;
+    job.first = first;
+    job.ntraj = ntraj;
+    job.npoints = (int) ceil(tt / dt) + 1;
+    job.nslots = pool_slots(nthreads, njobs);
+    job.e = ensemble_new(m->nspecies, job.npoints, bmin, bmax, nbins);
+    job.tr = (Traj_t **) malloc(nthreads * sizeof(Traj_t *));
+    job.b = (Batch_t **) malloc(nthreads * sizeof(Batch_t *));
+    job.buf = (double **) malloc(job.nslots * sizeof(double *));
+    if (!job.tr || !job.b || !job.buf) {
+        report_error("allocation failure in ensemble_collect()");
+        exit(1);
+    }
+    for(i=0; i<nthreads; i++){
+        if(job.bstep != NULL){
+            job.b[i] = batch_new(m, compact);
+        } else {
+            job.tr[i] = traj_new(m, step, rng_new(0));
+        }
+    }
+    for(i=0; i<job.nslots; i++){
+        job.buf[i] = dvector(((job.bstep != NULL) ? BATCH_LANES : 1) * job.npoints * m->nspecies);
+    }
+
+    if(ntraj > 0){
+        pool_run(nthreads, njobs, (job.bstep != NULL) ? ensemble_run_batch : ensemble_run,
+                ensemble_fold, &job);
+    }
+
+    for(i=0; i<nthreads; i++){
+        if(job.bstep != NULL){
+            *npromoted += job.b[i]->npromoted;
+            free_batch(job.b[i]);
+        } else {
+            gsl_rng_free(job.tr[i]->r);
+            free_traj(job.tr[i]);
+        }
+    }
+    for(i=0; i<job.nslots; i++) free_dvector(job.buf[i]);
+    free((char *) job.tr);
+    free((char *) job.b);
+    free((char *) job.buf);
+    return job.e;
+}
+
+void ensemble_check(Model_t * m, double dt, leapStepFunc step, double bmin, double bmax,
+        int nbins, int compact){
+    /* Errors and warnings on the arguments of sim_ensemble */
+    if(dt <= 0){
+        report_error("Ensemble statistics require a strictly positive output step\n");
+        exit(1);
+    }
+    if(nbins > 0 && bmax <= bmin){
+        report_error("Histogram bins require min < max\n");
+        exit(1);
+    }
+    if(compact && (step == NULL || m->nevents > 0 || batch_method(step) != tleap_batch_step)){
+        report_warning("Compact mode needs integer counts, only batched tau-leap uses it\n");
+    }
+    if(m->rates != NULL && step != NULL && m->nevents == 0 && batch_method(step) != NULL){
+        report_warning("Batched statistics ignore the compiled model\n");
+    }
+}
+
+void sim_ensemble(Model_t * m, double tt, double dt, leapStepFunc step, int ntraj,
+        double bmin, double bmax, int nbins, int nthreads, int compact){
+    int npromoted;
+    Ensemble_t * e;
+
+    ensemble_check(m, dt, step, bmin, bmax, nbins, compact);
+    npromoted = 0;
+    e = ensemble_collect(m, tt, dt, step, 0, ntraj, bmin, bmax, nbins, nthreads, compact, &npromoted);
+    ensemble_print(e, dt, m->species);
+    if(npromoted > 0) printf("# %d batches promoted to 64 bit counts\n", npromoted);
+    free_ensemble(e);
+}
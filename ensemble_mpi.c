@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Ensemble statistics over MPI ranks (make mpi). Rank r of p collects the
+ * trajectories of its shard, the r-th of p consecutive runs of batches, with
+ * sim_ensemble's own threads and streams, so the shards together are the
+ * trajectories of a single process run. The statistics are then gathered to
+ * rank 0 as packed records (see stats.c), merged there one rank after the
+ * other, and printed. Quantiles merged across ranks are approximate (see
+ * quant_merge), and the merge is not associative: folding in a fixed order,
+ * rather than by an MPI reduction whose bracketing is up to the
+ * implementation, keeps the output a function of the number of ranks only.
+ */
+
+#ifdef USE_MPI
+
+#include "methods.h"
+#include<mpi.h>
+
+void sim_ensemble_mpi(Model_t * m, double tt, double dt, leapStepFunc step, int ntraj,
+        double bmin, double bmax, int nbins, int nthreads, int compact){
+    int r, rank, size, nbatches, npromoted, total, rsize;
+    long first, last;
+    double *rec, *all;
+    Ensemble_t * e;
+    MPI_Datatype rtype;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    ensemble_check(m, dt, step, bmin, bmax, nbins, compact);
+    /* Shards of whole batches, also when trajectories are not batched */
+    nbatches = (ntraj + BATCH_LANES - 1) / BATCH_LANES;
+    first = (long) BATCH_LANES * ((long) nbatches * rank / size);
+    last = (long) BATCH_LANES * ((long) nbatches * (rank + 1) / size);
+    if(first > ntraj) first = ntraj;
+    if(last > ntraj) last = ntraj;
+
+    npromoted = 0;
+    e = ensemble_collect(m, tt, dt, step, first, (int) (last - first), bmin, bmax, nbins,
+            nthreads, compact, &npromoted);
+    rsize = ensemble_record_size(e);
+    rec = dvector(rsize * e->npoints);
+    all = (rank == 0) ? dvector((long) size * rsize * e->npoints) : NULL;
+    ensemble_pack(e, rec);
+
+    MPI_Type_contiguous(rsize, MPI_DOUBLE, &rtype);
+    MPI_Type_commit(&rtype);
+    MPI_Gather(rec, e->npoints, rtype, all, e->npoints, rtype, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&npromoted, &total, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Type_free(&rtype);
+
+    if(rank == 0){
+        /* Rank 0 first, then every other rank into it, in order */
+        for(r=1; r<size; r++) ensemble_merge_records(all + (long) r * rsize * e->npoints, all, e->npoints);
+        ensemble_unpack(e, all);
+        ensemble_print(e, dt, m->species);
+        if(total > 0) printf("# %d batches promoted to 64 bit counts\n", total);
+        free_dvector(all);
+    }
+    free_dvector(rec);
+    free_ensemble(e);
+}
+
+#endif /* USE_MPI */
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "model.h"
+#include<pthread.h>
+
+/* Expression rate laws. The parser turns every expression into instructions
+ * of one program shared by all the reactions, in static single assignment
+ * form: instruction k computes register k from registers of lower index, so
+ * the program runs straight through. Instructions are numbered by value
+ * (expr_node returns the existing register for an op and operands it has
+ * seen), so a subexpression common to several reactions is computed once,
+ * and constant subexpressions are folded. Parameters belong to their
+ * reaction (inputs, events and sweeps set them one by one), so their loads
+ * are keyed by reaction and index: only subexpressions of species and
+ * constants are shared. Vmax * S / (Km + S) in two reactions is computed
+ * twice, each with its own Vmax and Km; the load of S is shared.
+ * expr_rates runs the whole program once per state, for the block of the
+ * expressions in model_rates(). A single propensity
+ * (prop_EXPR, for the engines calling the rate laws one at a time) runs the
+ * instructions its reaction needs only, renumbered by expr_finish.
+ * Species are read without rounding, so expressions are smooth in the
+ * fractional states of the leap methods, but negative ones read as 0, as
+ * they do in the mass action law.
+ */
+
+#define EXPR_NONE -1
+
+/* Set once by expr_finish() when the model is loaded, read only afterwards */
+static Expr_t * expr_model = NULL;
+
+/* Registers of each thread, grown on demand and freed when the thread exits */
+static __thread double * expr_regs = NULL;
+static __thread int expr_nregs = 0;
+static pthread_key_t expr_key;
+static pthread_once_t expr_once = PTHREAD_ONCE_INIT;
+
+Expr_t * expr_new(int nreactions){
+    int j;
+    Expr_t * e;
+
+    e = (Expr_t *) malloc(sizeof(Expr_t));
+    if (!e) {
+        report_error("allocation failure in expr_new()");
+        exit(1);
+    }
+    e->n = 0;
+    e->max = 64;
+    e->code = (ExprIns_t *) malloc(e->max * sizeof(ExprIns_t));
+    e->tsize = 128;
+    e->table = ivector(e->tsize);
+    for(j=0; j<e->tsize; j++) e->table[j] = EXPR_NONE;
+    e->out = ivector(nreactions);
+    for(j=0; j<nreactions; j++) e->out[j] = EXPR_NONE;
+    e->lptr = NULL;
+    e->lcode = NULL;
+    if (!e->code) {
+        report_error("allocation failure in expr_new()");
+        exit(1);
+    }
+    return e;
+}
+
+static double expr_apply(expr_op op, double a, double b){
+    switch(op){
+    case EXPR_ADD: return a + b;
+    case EXPR_SUB: return a - b;
+    case EXPR_MUL: return a * b;
+    case EXPR_DIV: return a / b;
+    case EXPR_POW: return pow(a, b);
+    case EXPR_NEG: return -a;
+    case EXPR_EXP: return exp(a);
+    case EXPR_LOG: return log(a);
+    case EXPR_SQRT: return sqrt(a);
+    case EXPR_MIN: return (a < b) ? a : b;
+    case EXPR_MAX: return (a > b) ? a : b;
+    default: return 0;
+    }
+}
+
+static unsigned int expr_hash(expr_op op, int a, int b, double v){
+    unsigned int h;
+    unsigned char * c = (unsigned char *) &v;
+    size_t i;
+
+    h = 2166136261u;
+    h = (h ^ (unsigned int) op) * 16777619u;
+    h = (h ^ (unsigned int) a) * 16777619u;
+    h = (h ^ (unsigned int) b) * 16777619u;
+    for(i=0; i<sizeof(double); i++) h = (h ^ c[i]) * 16777619u;
+    return h;
+}
+
+static void expr_rehash(Expr_t * e){
+    int k;
+    unsigned int h;
+    ExprIns_t * c;
+
+    free_ivector(e->table);
+    e->tsize *= 2;
+    e->table = ivector(e->tsize);
+    for(k=0; k<e->tsize; k++) e->table[k] = EXPR_NONE;
+    for(k=0; k<e->n; k++){
+        c = e->code + k;
+        h = expr_hash(c->op, c->a, c->b, c->v) & (e->tsize - 1);
+        while(e->table[h] != EXPR_NONE) h = (h + 1) & (e->tsize - 1);
+        e->table[h] = k;
+    }
+}
+
+static int expr_binary(expr_op op){
+    return op == EXPR_ADD || op == EXPR_SUB || op == EXPR_MUL || op == EXPR_DIV
+        || op == EXPR_POW || op == EXPR_MIN || op == EXPR_MAX;
+}
+
+int expr_node(Expr_t * e, expr_op op, int a, int b, double v){
+    /* Register holding op(a, b), added to the program if new. Loads and
+     * constants take their operands in a, b and v, unary ops have b = 0 */
+    int tmp, binary;
+    unsigned int h;
+    ExprIns_t * c;
+
+    binary = expr_binary(op);
+    if(op > EXPR_PARAM) {
+        /* Folding, then commutative operands in a fixed order */
+        if(e->code[a].op == EXPR_CONST && (!binary || e->code[b].op == EXPR_CONST)) {
+            return expr_node(e, EXPR_CONST, 0, 0,
+                    expr_apply(op, e->code[a].v, binary ? e->code[b].v : 0));
+        }
+        if(!binary) b = 0;
+        if((op == EXPR_ADD || op == EXPR_MUL || op == EXPR_MIN || op == EXPR_MAX) && b < a) {
+            tmp = a; a = b; b = tmp;
+        }
+        v = 0;
+    }
+    if(op == EXPR_CONST && v == 0) v = 0; /* -0 and 0 differ in the table */
+    h = expr_hash(op, a, b, v) & (e->tsize - 1);
+    while(e->table[h] != EXPR_NONE){
+        c = e->code + e->table[h];
+        if(c->op == op && c->a == a && c->b == b && memcmp(&c->v, &v, sizeof(double)) == 0) return e->table[h];
+        h = (h + 1) & (e->tsize - 1);
+    }
+    if(e->n == e->max) {
+        e->max *= 2;
+        e->code = (ExprIns_t *) realloc(e->code, e->max * sizeof(ExprIns_t));
+        if (!e->code) {
+            report_error("allocation failure in expr_node()");
+            exit(1);
+        }
+    }
+    c = e->code + e->n;
+    c->op = op;
+    c->a = a;
+    c->b = b;
+    c->v = v;
+    e->table[h] = e->n;
+    e->n++;
+    if(2 * e->n > e->tsize) expr_rehash(e);
+    return e->n - 1;
+}
+
+void expr_finish(Model_t * m){
+    /* Extracts the instructions of every reaction */
+    int j, k, n;
+    int *need, *local;
+    Expr_t * e = m->expr;
+    ExprIns_t * c;
+
+    need = ivector(e->n);
+    local = ivector(e->n);
+    e->lptr = izeros(m->Nreactions + 1);
+    e->lcode = NULL;
+    for(j=0; j<m->Nreactions; j++){
+        n = 0;
+        if(e->out[j] != EXPR_NONE) {
+            /* Registers are only read by higher ones: a backward sweep marks them */
+            for(k=0; k<=e->out[j]; k++) need[k] = 0;
+            need[e->out[j]] = 1;
+            for(k=e->out[j]; k>=0; k--){
+                if(!need[k]) continue;
+                c = e->code + k;
+                /* b of unary ops is a placeholder, not a register */
+                if(c->op > EXPR_PARAM) need[c->a] = 1;
+                if(expr_binary(c->op)) need[c->b] = 1;
+            }
+            for(k=0; k<=e->out[j]; k++) if(need[k]) local[k] = n++;
+            e->lcode = (ExprIns_t *) realloc(e->lcode, (e->lptr[j] + n) * sizeof(ExprIns_t));
+            if (!e->lcode) {
+                report_error("allocation failure in expr_finish()");
+                exit(1);
+            }
+            for(k=0; k<=e->out[j]; k++){
+                if(!need[k]) continue;
+                c = e->lcode + e->lptr[j] + local[k];
+                *c = e->code[k];
+                if(c->op > EXPR_PARAM) c->a = local[c->a];
+                if(expr_binary(c->op)) c->b = local[c->b];
+            }
+        }
+        e->lptr[j+1] = e->lptr[j] + n;
+    }
+    free_ivector(need);
+    free_ivector(local);
+    expr_model = e;
+}
+
+static void expr_release(void * regs){
+    /* Destructor of expr_key, run by the exiting thread */
+    free(regs);
+    expr_regs = NULL;
+    expr_nregs = 0;
+}
+
+static void expr_key_new(void){
+    if(pthread_key_create(&expr_key, expr_release) != 0){
+        report_error("Could not create the key of the expression registers\n");
+        exit(1);
+    }
+}
+
+static double * expr_registers(int n){
+    if(n > expr_nregs) {
+        expr_regs = (double *) realloc(expr_regs, n * sizeof(double));
+        if (!expr_regs) {
+            report_error("allocation failure in expr_registers()");
+            exit(1);
+        }
+        expr_nregs = n;
+        pthread_once(&expr_once, expr_key_new);
+        pthread_setspecific(expr_key, expr_regs);
+    }
+    return expr_regs;
+}
+
+static void expr_run(const ExprIns_t * code, int n, const double * x,
+        double ** params, const double * p, double * r){
+    /* The interpreter. Parameters are params[a][b], or p[b] if p is given */
+    int k;
+    const ExprIns_t * c;
+
+    for(k=0; k<n; k++){
+        c = code + k;
+        switch(c->op){
+        case EXPR_CONST: r[k] = c->v; break;
+        case EXPR_SPECIES: r[k] = (x[c->a] > 0) ? x[c->a] : 0; break;
+        case EXPR_PARAM: r[k] = (p != NULL) ? p[c->b] : params[c->a][c->b]; break;
+        case EXPR_ADD: r[k] = r[c->a] + r[c->b]; break;
+        case EXPR_SUB: r[k] = r[c->a] - r[c->b]; break;
+        case EXPR_MUL: r[k] = r[c->a] * r[c->b]; break;
+        case EXPR_DIV: r[k] = r[c->a] / r[c->b]; break;
+        case EXPR_POW: r[k] = pow(r[c->a], r[c->b]); break;
+        case EXPR_NEG: r[k] = -r[c->a]; break;
+        case EXPR_EXP: r[k] = exp(r[c->a]); break;
+        case EXPR_LOG: r[k] = log(r[c->a]); break;
+        case EXPR_SQRT: r[k] = sqrt(r[c->a]); break;
+        case EXPR_MIN: r[k] = (r[c->a] < r[c->b]) ? r[c->a] : r[c->b]; break;
+        case EXPR_MAX: r[k] = (r[c->a] > r[c->b]) ? r[c->a] : r[c->b]; break;
+        }
+    }
+}
+
+double prop_EXPR(double *x , int nx, int *c, double *params, int * acting_species){
+    /* Expression rate law, acting_species[0] being the reaction */
+    int j, n;
+    double * r;
+
+    j = acting_species[0];
+    n = expr_model->lptr[j+1] - expr_model->lptr[j];
+    r = expr_registers(n);
+    expr_run(expr_model->lcode + expr_model->lptr[j], n, x, NULL, params, r);
+    return r[n-1];
+}
+
+void expr_rates(Model_t * m, double * x, double ** params, double * rates){
+    /* Propensities of the expression laws, by a single run of the program.
+     * The other rates are left alone */
+    int j;
+    double * r;
+    Expr_t * e = m->expr;
+
+    r = expr_registers(e->n);
+    expr_run(e->code, e->n, x, params, NULL, r);
+    for(j=0; j<m->Nreactions; j++){
+        if(e->out[j] != EXPR_NONE) rates[j] = r[e->out[j]];
+    }
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+
+/* First passage times. ntraj trajectories are run back to back from the
+ * initial condition, each one until target holds or up to tt. Only the
+ * hitting time and state are printed, one line per trajectory; trajectories
+ * not hitting before tt are censored (hit = 0, state at tt).
+ * Without a leap step the direct method gives exact hitting times. Leap
+ * methods check target at the end of every step, so hitting times are
+ * resolved to tau.
+ * Trajectory k uses random stream k and the lines are printed in order of k,
+ * so the output does not depend on the number of threads.
+ */
+
+static double fpt_trajectory(Traj_t * tr, double tt, double tau, Condition_t * target){
+    /* Hitting time of target, tt if it is not hit before */
+    double t, tnext;
+
+    traj_start(tr);
+    if(tr->step == NULL) return traj_advance(tr, 0, tt, target);
+    if(condition_holds(target, tr->state)) return 0;
+    /* The last step is shortened to end at tt */
+    for(t=0; t<tt; t=tnext){
+        tnext = (t + tau < tt) ? t + tau : tt;
+        traj_advance(tr, t, tnext, NULL);
+        if(condition_holds(target, tr->state)) return tnext;
+    }
+    return tt;
+}
+
+typedef struct _FptJob_t {
+    /* Shared arguments, per-thread workspaces and running sums of the pool.
+     * Trajectory k keeps its hitting time and final state in the result slot
+     * k % nslots of thit and final until it is folded. */
+    double tt, tau;
+    Condition_t * target;
+    Traj_t ** tr;
+    double * thit, * final;
+    int nslots, nhits;
+    double s1, s2;
+} FptJob_t;
+
+static void fpt_run(void * arg, int thread, int k){
+    FptJob_t * job = (FptJob_t *) arg;
+    Traj_t * tr = job->tr[thread];
+    int slot = k % job->nslots;
+
+    gsl_rng_set(tr->r, k);
+    job->thit[slot] = fpt_trajectory(tr, job->tt, job->tau, job->target);
+    memcpy(job->final + slot * tr->m->nspecies, tr->state, tr->m->nspecies * sizeof(double));
+}
+
+static void fpt_fold(void * arg, int thread, int k){
+    int i, hit;
+    double t;
+    FptJob_t * job = (FptJob_t *) arg;
+    int ns = job->tr[thread]->m->nspecies;
+    double * state = job->final + (k % job->nslots) * ns;
+
+    t = job->thit[k % job->nslots];
+    hit = condition_holds(job->target, state);
+    if(hit){
+        job->nhits++;
+        job->s1 += t;
+        job->s2 += t * t;
+    }
+    printf("%g %d ", t, hit);
+    for(i=0; i<ns; i++) printf("%ld ", (long) state[i]);
+    printf("\n");
+}
+
+void sim_first_passage(Model_t * m, double tt, double tau, leapStepFunc step,
+        int ntraj, Condition_t * target, int nthreads){
+    int i;
+    double mean;
+    FptJob_t job;
+
+    if(step != NULL && tau <= 0){
+        report_error("Leap methods require a strictly positive time step\n");
+        exit(1);
+    }
+    if(nthreads > ntraj) nthreads = ntraj;
+    if(nthreads < 1) nthreads = 1;
+    job.tt = tt;
+    job.tau = tau;
+    job.target = target;
+    job.nhits = 0;
+    job.s1 = 0;
+    job.s2 = 0;
+    job.tr = (Traj_t **) malloc(nthreads * sizeof(Traj_t *));
+    job.nslots = pool_slots(nthreads, ntraj);
+    job.thit = dvector(job.nslots);
+    job.final = dvector(job.nslots * m->nspecies);
+    if (!job.tr) {
+        report_error("allocation failure in sim_first_passage()");
+        exit(1);
+    }
+    for(i=0; i<nthreads; i++) job.tr[i] = traj_new(m, step, rng_new(0));
+
+    printf("#time hit ");
+    for(i=0; i<m->nspecies; i++) printf("%s ", m->species[i]);
+    printf("\n");
+    pool_run(nthreads, ntraj, fpt_run, fpt_fold, &job);
+    if(job.nhits > 0){
+        mean = job.s1 / job.nhits;
+        printf("# %d of %d trajectories hit, mean first passage time %g +- %g\n", job.nhits, ntraj,
+                mean, (job.nhits > 1) ? sqrt((job.s2 / job.nhits - mean * mean) / (job.nhits - 1)) : 0);
+    } else {
+        printf("# 0 of %d trajectories hit\n", ntraj);
+    }
+
+    for(i=0; i<nthreads; i++){
+        gsl_rng_free(job.tr[i]->r);
+        free_traj(job.tr[i]);
+    }
+    free((char *) job.tr);
+    free_dvector(job.thit);
+    free_dvector(job.final);
+}
@@ -19,28 +19,28 @@
 #include "time.h"
 #include<unistd.h>
 
-void sim_heun(Model_t * m, double tt, double tau){
-    int i, j, step;
+void sim_heun(Model_t * m, double tt, double tau, Stop_t * stop){
+    int i, k, step;
     int nreactions, nspecies;
-    int **rs, **ps, **as;
     double *y2, *f, *f2;
     double *state;
-    propensityFunc * prop;
     double **params;
     int nsteps;
+    int *armed;
+    double t, tnext, tend, tevent, h;
+    stop_reason reason;
     double *rates;
 
     /* Get the pointers */
     nreactions = m->Nreactions;
     nspecies = m->nspecies;
-    prop = m->prop;
-    params = m->params;
+    params = (m->ninputs > 0 || m->nevents > 0) ? model_params_copy(m) : m->params;
     state = dzeros(nspecies);
     rates = dzeros(nreactions);
     for(i=0; i<nspecies; i++) state[i] = (double) m->istate[i];
-    rs = m->rstoichiometry;
-    ps = m->pstoichiometry;
-    as = m->acting_species;
+    armed = ivector(m->nevents);
+    events_reset(m, armed);
+    events_fire(m, armed, 0, state, params);
 
 
     f  = dvector(nspecies);
@@ -60,42 +60,64 @@ void sim_heun(Model_t * m, double tt, double tau){
         exit(1);
     } else {
         nsteps = (int) ceil(tt / tau);
-        for(step=0; step < nsteps; step++) {
-            /* Step 0: Compute propensities and L(tau,x) = Pois(tau*x) -tau*x */
-            for(j=0; j< nreactions; j++){
-                rates[j] = prop[j](state, nspecies, rs[j], params[j], as[j]);
-            }
-            /* Step 1: compute d = stoichiometry * L
-             *                 f(y) = stoich. * propensities
-             *                 and Y2
-             */
-            for(i=0; i<nspecies; i++){
-                f[i] = 0;
-                for(j=0; j<nreactions; j++) {
-                    f[i] += (ps[j][i] - rs[j][i]) * rates[j];
+        reason = STOP_NONE;
+        if(stop != NULL) stop_reset(stop);
+        for(step=0; step < nsteps && reason == STOP_NONE; step++) {
+            /* The step is split at the timed events falling inside it */
+            t = tau * step;
+            tnext = tau * (step+1);
+            while(t < tnext) {
+                tevent = events_next_time(m, armed);
+                tend = (tevent < tnext) ? tevent : tnext;
+                h = tend - t;
+                /* Step 0: Compute propensities and L(tau,x) = Pois(tau*x) -tau*x */
+                if(m->ninputs > 0) model_set_inputs(m, params, t);
+                model_rates(m, state, params, rates);
+                /* Step 1: compute d = stoichiometry * L
+                 *                 f(y) = stoich. * propensities
+                 *                 and Y2
+                 */
+                for(i=0; i<nspecies; i++){
+                    f[i] = 0;
+                    for(k=m->sptr[i]; k<m->sptr[i+1]; k++) {
+                        f[i] += m->sdelta[k] * rates[m->sreaction[k]];
+                    }
+                    /* Y2 = y + A21 * (tau * f(y)  + d) */
+                    y2[i] = state[i]  + h * f[i];
                 }
-                /* Y2 = y + A21 * (tau * f(y)  + d) */
-                y2[i] = state[i]  + tau * f[i];
-            }
-            /* Step 2:  Compute propensities for Y2 */
-            for(j=0; j< nreactions; j++){
-                rates[j] = prop[j](y2, nspecies, rs[j], params[j], as[j]);
-            }
-            /* Step 3: compute f(Y2) = stoich. * propensities
-             *                 and state[n+1]
-             */
-            for(i=0; i<nspecies; i++){
-                f2[i] = 0;
-                for(j=0; j<nreactions; j++) {
-                    f2[i] += (ps[j][i] - rs[j][i]) * rates[j];
+                /* Step 2:  Compute propensities for Y2 */
+                if(m->ninputs > 0) model_set_inputs(m, params, tend);
+                model_rates(m, y2, params, rates);
+                /* Step 3: compute f(Y2) = stoich. * propensities
+                 *                 and state[n+1]
+                 */
+                for(i=0; i<nspecies; i++){
+                    f2[i] = 0;
+                    for(k=m->sptr[i]; k<m->sptr[i+1]; k++) {
+                        f2[i] += m->sdelta[k] * rates[m->sreaction[k]];
+                    }
+                    /* y_{n+1} = y_{n} + h/2 * (f(t, Y1) + f(t + h, Y2)) */
+                    state[i] = state[i]  + 0.5 * h * (f[i] + f2[i]);
                 }
-                /* y_{n+1} = y_{n} + h/2 * (f(t, Y1) + f(t + h, Y2)) */
-                state[i] = state[i]  + 0.5 * tau * (f[i] + f2[i]);
+                t = tend;
+                if(m->nevents > 0) events_fire(m, armed, t, state, params);
             }
             printf("%g ", tau * (step+1));
             for(i=0; i<nspecies; i++) printf("%g ", state[i]);
             printf("\n");
+            reason = stop_check(stop, state, params, armed);
+        }
+        /* The remaining output points keep the state at the stop */
+        if(reason != STOP_NONE){
+            printf("# %s at t=%g\n", stop_name(reason), tau * step);
+            for(; step < nsteps; step++) {
+                printf("%g ", tau * (step+1));
+                for(i=0; i<nspecies; i++) printf("%g ", state[i]);
+                printf("\n");
+            }
         }
     }
+    if(params != m->params) free_params(m, params);
+    free_ivector(armed);
     return;
 }
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+#include<stdint.h>
+#include<gsl/gsl_qrng.h>
+#include<gsl/gsl_sort.h>
+#include<gsl/gsl_cdf.h>
+
+/* Ensembles of leap trajectories with variance reduction.
+ *  SAMPLING_PSEUDO:     ntraj independent trajectories.
+ *  SAMPLING_ANTITHETIC: ntraj/2 pairs. Both members invert the Poisson CDF on
+ *                       the same uniforms, one on u and the other on 1-u.
+ *  SAMPLING_RQMC:       LEAP_RQMC_REPS independent replicates of array-RQMC
+ *                       (L'Ecuyer et al.) with ntraj/LEAP_RQMC_REPS chains.
+ *                       At every step the chains are sorted by sortkey (total
+ *                       count if NULL) and the i-th one takes the Poisson
+ *                       uniforms of the i-th point of a Sobol net sorted by its
+ *                       first coordinate. The net is randomised at every step
+ *                       with a random digital shift.
+ * The mean of the final state is reported with its 95% (Student t) confidence
+ * interval, computed from the variance across independent units (trajectories,
+ * pairs or replicates).
+ */
+
+#define LEAP_RQMC_REPS 10
+#define LEAP_RQMC_MAXDIM 40
+
+static double leap_sort_key(Coordinate_t * sortkey, double * state, int nspecies){
+    if(sortkey != NULL) return coordinate_value(sortkey, state);
+    return dsum(state, nspecies);
+}
+
+static void leap_rqmc_replicate(Model_t * m, double tt, double tau, leapStepFunc step,
+        int nchains, Coordinate_t * sortkey, gsl_rng * r, Leap_t * w, Stop_t * stop,
+        double * mean, int * nstopped){
+    /* Runs one array-RQMC replicate and returns the mean final state in mean.
+     * Stopped chains are frozen; nstopped counts them by stop_reason. */
+    int i, k, c, n, step_n, nsteps, nspecies, nevents, dim, nq, nactive;
+    int *armed, *carmed, *creason;
+    Stop_t ** cstop;
+    double *states, *net, *shifted, *keys;
+    double **params, ***cparams;
+    size_t *corder, *porder;
+    uint32_t *shift;
+    Stream_t s;
+    gsl_qrng * q;
+
+    nspecies = m->nspecies;
+    /* One coordinate to sort the points and one per Poisson draw */
+    dim = m->Nreactions + 1;
+    nq = (dim > LEAP_RQMC_MAXDIM) ? LEAP_RQMC_MAXDIM : dim;
+    states = dvector(nchains * nspecies);
+    net = dvector(nchains * nq);
+    shifted = dvector(nchains * nq);
+    keys = dvector(nchains);
+    corder = (size_t *) malloc(nchains * sizeof(size_t));
+    porder = (size_t *) malloc(nchains * sizeof(size_t));
+    shift = (uint32_t *) malloc(nq * sizeof(uint32_t));
+    if (!corder || !porder || !shift) {
+        report_error("allocation failure in leap_rqmc_replicate()");
+        exit(1);
+    }
+    q = gsl_qrng_alloc(gsl_qrng_sobol, nq);
+    for(c=0; c<nchains; c++) gsl_qrng_get(q, net + c*nq);
+    gsl_qrng_free(q);
+
+    /* Events act on each chain separately, so with events every chain gets
+     * its own parameters and event state */
+    nevents = m->nevents;
+    params = w->params;
+    armed = w->armed;
+    cparams = NULL;
+    carmed = NULL;
+    if(nevents > 0){
+        cparams = (double ***) malloc(nchains * sizeof(double **));
+        if (!cparams) {
+            report_error("allocation failure in leap_rqmc_replicate()");
+            exit(1);
+        }
+        carmed = ivector(nchains * nevents);
+    }
+    for(c=0; c<nchains; c++){
+        if(nevents > 0){
+            cparams[c] = model_params_copy(m);
+            w->params = cparams[c];
+            w->armed = carmed + c*nevents;
+        }
+        leap_start(w, states + c*nspecies);
+    }
+    /* Every chain has its own termination state */
+    creason = ivector(nchains);
+    cstop = NULL;
+    if(stop != NULL){
+        cstop = (Stop_t **) malloc(nchains * sizeof(Stop_t *));
+        if (!cstop) {
+            report_error("allocation failure in leap_rqmc_replicate()");
+            exit(1);
+        }
+    }
+    for(c=0; c<nchains; c++){
+        creason[c] = STOP_NONE;
+        if(stop != NULL) cstop[c] = stop_new(m, stop->cond, stop->window, stop->tol);
+    }
+    nactive = nchains;
+    /* Draws beyond the dimension of the net fall back to pseudo-random ones */
+    s.r = r;
+    s.inverse = 1;
+    s.antithetic = 0;
+    s.nu = nq - 1;
+
+    nsteps = (int) ceil(tt / tau);
+    for(step_n=0; step_n<nsteps && nactive > 0; step_n++){
+        for(k=0; k<nq; k++) shift[k] = (uint32_t) (gsl_rng_uniform(r) * 4294967296.0);
+        for(n=0; n<nchains*nq; n++){
+            shifted[n] = ((uint32_t) (net[n] * 4294967296.0) ^ shift[n % nq]) / 4294967296.0;
+        }
+        gsl_sort_index(porder, shifted, nq, nchains);
+        for(c=0; c<nchains; c++) keys[c] = leap_sort_key(sortkey, states + c*nspecies, nspecies);
+        gsl_sort_index(corder, keys, 1, nchains);
+        for(n=0; n<nchains; n++){
+            c = corder[n];
+            if(creason[c] != STOP_NONE) continue;
+            if(nevents > 0){
+                w->params = cparams[c];
+                w->armed = carmed + c*nevents;
+            }
+            s.u = shifted + porder[n]*nq + 1;
+            s.next = 0;
+            leap_advance(w, step, states + c*nspecies, tau * step_n, tau * (step_n+1), &s);
+            if(stop != NULL){
+                creason[c] = stop_check(cstop[c], states + c*nspecies, w->params, w->armed);
+                if(creason[c] != STOP_NONE) nactive--;
+            }
+        }
+    }
+    for(c=0; c<nchains; c++){
+        nstopped[creason[c]]++;
+        if(stop != NULL) free_stop(cstop[c]);
+    }
+    if(stop != NULL) free((char *) cstop);
+    free_ivector(creason);
+    w->params = params;
+    w->armed = armed;
+    if(nevents > 0){
+        for(c=0; c<nchains; c++) free_params(m, cparams[c]);
+        free((char *) cparams);
+        free_ivector(carmed);
+    }
+    for(i=0; i<nspecies; i++){
+        mean[i] = 0;
+        for(c=0; c<nchains; c++) mean[i] += states[c*nspecies + i];
+        mean[i] /= nchains;
+    }
+    free_dvector(states);
+    free_dvector(net);
+    free_dvector(shifted);
+    free_dvector(keys);
+    free((char *) corder);
+    free((char *) porder);
+    free((char *) shift);
+}
+
+static stop_reason leap_trajectory(Model_t * m, double tt, double tau, leapStepFunc step,
+        Leap_t * w, Stream_t * s, Stop_t * stop, double * state){
+    /* Final state of one trajectory, frozen when it stops early */
+    int step_n, nsteps;
+    stop_reason reason;
+
+    leap_start(w, state);
+    if(stop != NULL) stop_reset(stop);
+    nsteps = (int) ceil(tt / tau);
+    reason = STOP_NONE;
+    for(step_n=0; step_n<nsteps && reason == STOP_NONE; step_n++){
+        leap_advance(w, step, state, tau * step_n, tau * (step_n+1), s);
+        reason = stop_check(stop, state, w->params, w->armed);
+    }
+    return reason;
+}
+
+void sim_leap_ensemble(Model_t * m, double tt, double tau, leapStepFunc step,
+        int ntraj, sampling_t sampling, Coordinate_t * sortkey, Stop_t * stop){
+    int i, k, nunits, nspecies;
+    int nstopped[STOP_STEADY + 1];
+    double *state, *state2, *x, *s1, *s2;
+    double se, tq;
+    Leap_t * w;
+    Stream_t s;
+    gsl_rng * r, * r2;
+
+    if(tau <= 0){
+        report_error("Tau-leap requires a strictly positive time step\n");
+        exit(1);
+    }
+    nspecies = m->nspecies;
+    state = dvector(nspecies);
+    state2 = dvector(nspecies);
+    x = dvector(nspecies);
+    s1 = dzeros(nspecies);
+    s2 = dzeros(nspecies);
+    w = leap_new(m);
+    for(k=0; k<=STOP_STEADY; k++) nstopped[k] = 0;
+
+    r = rng_new(0);
+    s.r = r;
+    s.inverse = 0;
+    s.antithetic = 0;
+    s.u = NULL;
+
+    if(sampling == SAMPLING_ANTITHETIC){
+        nunits = ntraj / 2;
+    } else if(sampling == SAMPLING_RQMC){
+        nunits = LEAP_RQMC_REPS;
+    } else {
+        nunits = ntraj;
+    }
+    if(nunits < 2 || (sampling == SAMPLING_RQMC && ntraj < 2 * LEAP_RQMC_REPS)){
+        report_error("Not enough trajectories for a confidence interval\n");
+        exit(1);
+    }
+    if(sampling == SAMPLING_RQMC && ((ntraj / LEAP_RQMC_REPS) & (ntraj / LEAP_RQMC_REPS - 1)) != 0){
+        report_warning("Array-RQMC works best with a power of two chains per replicate\n");
+    }
+    for(k=0; k<nunits; k++){
+        if(sampling == SAMPLING_ANTITHETIC){
+            /* Both members consume the same uniforms */
+            r2 = gsl_rng_clone(r);
+            s.inverse = 1;
+            s.antithetic = 0;
+            nstopped[leap_trajectory(m, tt, tau, step, w, &s, stop, state)]++;
+            s.r = r2;
+            s.antithetic = 1;
+            nstopped[leap_trajectory(m, tt, tau, step, w, &s, stop, state2)]++;
+            s.r = r;
+            gsl_rng_free(r2);
+            for(i=0; i<nspecies; i++) x[i] = 0.5 * (state[i] + state2[i]);
+        } else if(sampling == SAMPLING_RQMC){
+            leap_rqmc_replicate(m, tt, tau, step, ntraj / LEAP_RQMC_REPS, sortkey, r, w, stop, x, nstopped);
+        } else {
+            nstopped[leap_trajectory(m, tt, tau, step, w, &s, stop, x)]++;
+        }
+        for(i=0; i<nspecies; i++){
+            s1[i] += x[i];
+            s2[i] += x[i] * x[i];
+        }
+    }
+
+    tq = gsl_cdf_tdist_Pinv(0.975, nunits - 1);
+    printf("#species mean stderr ci95_low ci95_high\n");
+    for(i=0; i<nspecies; i++){
+        s1[i] /= nunits;
+        se = sqrt((s2[i] / nunits - s1[i] * s1[i]) / (nunits - 1));
+        if(!(se >= 0)) se = 0;
+        printf("%s %g %g %g %g\n", m->species[i], s1[i], se, s1[i] - tq * se, s1[i] + tq * se);
+    }
+    for(k=STOP_ABSORBING; k<=STOP_STEADY; k++){
+        if(nstopped[k] > 0) printf("# %d trajectories stopped early: %s\n", nstopped[k], stop_name(k));
+    }
+
+    free_leap(w);
+    free_dvector(state);
+    free_dvector(state2);
+    free_dvector(x);
+    free_dvector(s1);
+    free_dvector(s2);
+    gsl_rng_free(r);
+}
@@ -21,21 +21,238 @@
 
 #define PRINT_RUNTIME
 
+#include<stdint.h>
+#include<pthread.h>
 #include<gsl/gsl_rng.h>
 #include<gsl/gsl_randist.h>
 #include "model.h"
+#include "rng.h"
+#include "stats.h"
 
+typedef enum _sampling_t {
+    SAMPLING_PSEUDO,
+    SAMPLING_ANTITHETIC,
+    SAMPLING_RQMC
+} sampling_t;
 
-void sim_direct_method(Model_t * m, double tt, double hurdle);
-void sim_tleap(Model_t * m, double tt, double tau);
-void sim_nrk3l(Model_t * m, double tt, double tau);
-void sim_nrk3m(Model_t * m, double tt, double tau);
-void sim_nrk3h(Model_t * m, double tt, double tau);
-void sim_nrk5l(Model_t * m, double tt, double tau);
-void sim_nrk5m(Model_t * m, double tt, double tau);
-void sim_nrk5h(Model_t * m, double tt, double tau);
+typedef struct _Stream_t {
+    /* Uniforms behind the Poisson draws of the leap methods.
+     * By default draws come straight from gsl_ran_poisson. With inverse set
+     * they are inverse-CDF draws on u from r, on 1-u if antithetic is also set.
+     * If u is not NULL its first nu entries are used in order instead (RQMC).
+     */
+    gsl_rng * r;
+    int inverse;
+    int antithetic;
+    double * u;
+    int nu, next;
+} Stream_t;
 
-void sim_heun(Model_t * m, double tt, double hurdle);
+typedef struct _Leap_t {
+    /* Workspace of the leap methods for one trajectory.
+     * The stoichiometry is the species-major one of the model (sptr...),
+     * params are the model ones, or a private copy if some are time dependent
+     * or changed by events, and armed holds the state of the events.
+     * If team is not NULL, its threads take the steps together (see team.c) */
+    Model_t * m;
+    double ** params;
+    int * armed;
+    int * K;
+    double * rates, * L, * d, * f, * y;
+    struct _Team_t * team;
+} Leap_t;
+
+#define NRK_MAXSTAGES 16
+
+typedef struct _Nrk_t {
+    /* Nested Runge-Kutta leap scheme: stage k moves the state by a[k] times
+     * the drift and noise of the step (see nrk.c) */
+    char name[100];
+    int nstages;
+    double a[NRK_MAXSTAGES];
+} Nrk_t;
+
+typedef void (*leapStepFunc)(Leap_t * w, double * state, double tau, Stream_t * s);
+
+typedef struct _Traj_t {
+    /* Workspace of one trajectory sampled on a time grid: a leap method if
+     * step is not NULL (with workspace w), the direct method otherwise (on
+     * params, with events armed and workspace rates). */
+    Model_t * m;
+    leapStepFunc step;
+    Leap_t * w;
+    double ** params;
+    int * armed;
+    double * rates, * state;
+    gsl_rng * r;
+    Stream_t s;
+} Traj_t;
+
+#define BATCH_LANES 8
+
+typedef struct _Batch_t {
+    /* Workspace of the leap methods for BATCH_LANES trajectories advanced in
+     * lockstep, in structure of arrays form: x, y and d are [species][lane]
+     * and rates and L are [reaction][lane], lane l at index i*BATCH_LANES + l.
+     * Only the first nlanes lanes draw random numbers, lane l from its own
+     * generator r[l]. Parameters are shared by all the lanes, so models with
+     * events are not batched.
+     * In compact mode (tau-leap only) the counts are int32 in xc and the
+     * propensities float in fr, with the Poisson counts in k, until an update
+     * would leave the int32 range: the batch is then promoted to x for good. */
+    Model_t * m;
+    int nlanes, compact, promoted, npromoted;
+    double ** params;
+    double * x, * y, * rates, * L, * d, * scratch;
+    int32_t * xc;
+    float * fr;
+    unsigned int * k;
+    int64_t * acc;
+    gsl_rng * r[BATCH_LANES];
+    Stream_t s[BATCH_LANES];
+} Batch_t;
+
+typedef void (*batchStepFunc)(Batch_t * b, double * x, double tau);
+
+struct _Team_t;
+typedef void (*teamStepFunc)(struct _Team_t * t, int p, double * x, double tau);
+
+typedef struct _Team_t {
+    /* nthreads threads taking the steps of the single trajectory of w.
+     * Partition p evaluates the propensities and draws the Poisson numbers of
+     * reactions jlo[p]..jhi[p]-1 from its own stream s[p], then updates
+     * species ilo[p]..ihi[p]-1; the phases are separated by the barrier sync.
+     * Thread 0 is the caller of team_advance, which hands it x and tau. */
+    Leap_t * w;
+    teamStepFunc step;
+    int nthreads, quit;
+    int *jlo, *jhi, *ilo, *ihi;
+    double * x;
+    double tau;
+    gsl_rng ** r;
+    Stream_t * s;
+    pthread_t * threads;
+    struct _TeamArg_t * args;
+    pthread_barrier_t sync;
+} Team_t;
+
+typedef enum _stop_reason {
+    STOP_NONE,
+    STOP_ABSORBING,
+    STOP_CONDITION,
+    STOP_STEADY
+} stop_reason;
+
+typedef struct _Stop_t {
+    /* Termination criteria of a trajectory: the user condition cond (NULL if
+     * none), absorbing states and, if window > 0, steady state over the last
+     * window output points, kept in the ring buffer buf, up to a relative
+     * tolerance tol, after ntests tests. last is the state at the previous
+     * output point. */
+    Model_t * m;
+    Condition_t * cond;
+    int window, n, ntests;
+    double tol;
+    double * buf, * last;
+} Stop_t;
+
+
+void sim_direct_method(Model_t * m, double tt, double hurdle, Stop_t * stop);
+void sim_tleap(Model_t * m, double tt, double tau, Stop_t * stop);
+void sim_nrk(Model_t * m, double tt, double tau, Stop_t * stop);
+void sim_compile(Model_t * m, char * fname, char * lib);
+void model_load_compiled(Model_t * m, char * lib);
+
+void sim_leap(Model_t * m, double tt, double tau, leapStepFunc step, Stop_t * stop, int nthreads);
+void sim_leap_ensemble(Model_t * m, double tt, double tau, leapStepFunc step,
+        int ntraj, sampling_t sampling, Coordinate_t * sortkey, Stop_t * stop);
+leapStepFunc leap_method(char * name);
+leapStepFunc nrk_method(char * name);
+Leap_t * leap_new(Model_t * m);
+void free_leap(Leap_t * w);
+Traj_t * traj_new(Model_t * m, leapStepFunc step, gsl_rng * r);
+void free_traj(Traj_t * tr);
+void traj_start(Traj_t * tr);
+double traj_advance(Traj_t * tr, double t, double tend, Condition_t * stop);
+double ** traj_own_params(Traj_t * tr);
+void leap_start(Leap_t * w, double * state);
+void leap_advance(Leap_t * w, leapStepFunc step, double * state, double t, double tend, Stream_t * s);
+
+Batch_t * batch_new(Model_t * m, int compact);
+void free_batch(Batch_t * b);
+void batch_start(Batch_t * b, unsigned long first, int nlanes);
+void batch_advance(Batch_t * b, batchStepFunc step, double t, double tend);
+void batch_state(Batch_t * b, int lane, double * state);
+void batch_propensities(Batch_t * b, double * x);
+void batch_propensities_compact(Batch_t * b);
+void batch_promote(Batch_t * b);
+void batch_nrk_step(Batch_t * b, double * x, double tau, const Nrk_t * scheme);
+batchStepFunc batch_method(leapStepFunc step);
+
+Team_t * team_new(Leap_t * w, teamStepFunc step, int nthreads);
+void free_team(Team_t * t);
+void team_advance(Team_t * t, double * x, double tau);
+void team_nrk_step(Team_t * t, int p, double * x, double tau, const Nrk_t * scheme);
+teamStepFunc team_method(leapStepFunc step);
+
+void tleap_batch_step(Batch_t * b, double * x, double tau);
+void tleap_batch_step_compact(Batch_t * b, double tau);
+void nrk_batch_step(Batch_t * b, double * x, double tau);
+
+void tleap_team_step(Team_t * t, int p, double * x, double tau);
+void nrk_team_step(Team_t * t, int p, double * x, double tau);
+
+void tleap_step(Leap_t * w, double * state, double tau, Stream_t * s);
+void nrk_step(Leap_t * w, double * state, double tau, Stream_t * s);
+
+unsigned int poisson_icdf(double u, double mu);
+unsigned int stream_poisson(Stream_t * s, double mu);
+
+void sim_heun(Model_t * m, double tt, double hurdle, Stop_t * stop);
+
+void sim_thinning(Model_t * m, double tt, double hurdle, Stop_t * stop);
+
+void sim_weighted_ensemble(Model_t * m, double tt, double tau, Coordinate_t * coord,
+        double bmin, double bmax, int nbins, int nwalkers, Condition_t * target);
+
+void sim_dwssa(Model_t * m, double tt, int ntraj, Condition_t * event, double * gamma);
+
+void sim_sensitivity(Model_t * m, double tt, int ntraj);
+
+void sim_stationary(Model_t * m, double tt, double burnin);
+
+void sim_first_passage(Model_t * m, double tt, double tau, leapStepFunc step,
+        int ntraj, Condition_t * target, int nthreads);
+
+void sim_spectrum(Model_t * m, double tt, double dt, leapStepFunc step, int ntraj,
+        double burnin, int seglen, int nthreads);
+
+void sim_ensemble(Model_t * m, double tt, double dt, leapStepFunc step, int ntraj,
+        double bmin, double bmax, int nbins, int nthreads, int compact);
+void ensemble_check(Model_t * m, double dt, leapStepFunc step, double bmin, double bmax,
+        int nbins, int compact);
+Ensemble_t * ensemble_collect(Model_t * m, double tt, double dt, leapStepFunc step,
+        long first, int ntraj, double bmin, double bmax, int nbins, int nthreads,
+        int compact, int * npromoted);
+void sim_ensemble_mpi(Model_t * m, double tt, double dt, leapStepFunc step, int ntraj,
+        double bmin, double bmax, int nbins, int nthreads, int compact);
+
+void sim_sweep(Model_t * m, double tt, double dt, leapStepFunc step, Sweep_t * sw,
+        int nrep, int nthreads);
+
+typedef void (*trajJob)(void * arg, int thread, int k);
+int pool_slots(int nthreads, int ntraj);
+void pool_run(int nthreads, int ntraj, trajJob run, trajJob fold, void * arg);
+void pool_steal(int nthreads, int ntasks, trajJob run, void * arg);
+
+Stop_t * stop_new(Model_t * m, Condition_t * cond, int window, double tol);
+void free_stop(Stop_t * st);
+void stop_reset(Stop_t * st);
+stop_reason stop_check(Stop_t * st, double * state, double ** params, int * armed);
+const char * stop_name(stop_reason reason);
+
+double ssa_advance(Model_t * m, double ** params, int * armed, double * state,
+        double * rates, double t, double tend, gsl_rng * r, Condition_t * stop);
 
 
 #endif /* METHODS_H_ */
@@ -16,8 +16,200 @@
  */
 
 #include "model.h"
+#include <limits.h>
+#include <pthread.h>
 #define MAX_NAME_SIZE 128
 
+/* Hill laws raise counts to non integer powers, pow(y/km, h) and the like.
+ * With km and h fixed, these only depend on the count y, so each law keeps
+ * tables of them (HILL_TABLES per reaction), filled on demand up to the
+ * largest count seen. A table keeps the first km and h it is filled with:
+ * other values (inputs, events) use pow() itself rather than rebuild it,
+ * which would cost O(y) pow() calls each time they change. So do counts
+ * beyond HILL_MAXSIZE, negative ones and calls from outside model_prop(). Entries are computed by the same
+ * expressions, so propensities do not change.
+ * Tables belong to the thread, engines running in parallel do not share them,
+ * and are freed when it exits.
+ */
+#define HILL_TABLES 3
+#define HILL_MAXSIZE 65536
+
+typedef enum _hill_form {
+    HILL_DIV, /* pow(y/k, h) */
+    HILL_INV, /* pow(k/y, h) */
+    HILL_MUL  /* pow(k*y, h) */
+} hill_form;
+
+typedef struct _Hill_t {
+    hill_form form;
+    double k, h;
+    int n, max; /* v[0..n-1] filled, room for max */
+    double * v;
+} Hill_t;
+
+static __thread Hill_t * hill_tables = NULL;
+static __thread int hill_ntables = 0;
+static pthread_key_t hill_key;
+static pthread_once_t hill_once = PTHREAD_ONCE_INIT;
+/* Tables of the reaction being evaluated by model_prop(), NULL otherwise */
+static __thread Hill_t * hill_current = NULL;
+
+static double hill_eval(int y, double k, double h, hill_form form){
+    switch(form){
+    case HILL_DIV: return pow(y/k, h);
+    case HILL_INV: return pow(k/y, h);
+    default: return pow(k*y, h);
+    }
+}
+
+static double hill_lookup(Hill_t * t, int y, double k, double h, hill_form form){
+    int n;
+
+    if(t == NULL || y < 0 || y >= HILL_MAXSIZE || isnan(k) || isnan(h)) return hill_eval(y, k, h, form);
+    if(t->k != k || t->h != h || t->form != form){
+        if(t->n > 0) return hill_eval(y, k, h, form);
+        t->k = k;
+        t->h = h;
+        t->form = form;
+    }
+    if(y >= t->n){
+        if(y >= t->max){
+            n = (2 * t->max > y + 1) ? 2 * t->max : y + 1;
+            if(n < 64) n = 64;
+            if(n > HILL_MAXSIZE) n = HILL_MAXSIZE;
+            t->v = (double *) realloc(t->v, n * sizeof(double));
+            if (!t->v) {
+                report_error("allocation failure in hill_lookup()");
+                exit(1);
+            }
+            t->max = n;
+        }
+        n = (2 * t->n > y + 1) ? 2 * t->n : y + 1;
+        if(n > t->max) n = t->max;
+        for(; t->n<n; t->n++) t->v[t->n] = hill_eval(t->n, k, h, form);
+    }
+    return t->v[y];
+}
+
+static double hill_pow(int slot, int y, double k, double h, hill_form form){
+    return hill_lookup((hill_current != NULL) ? hill_current + slot : NULL, y, k, h, form);
+}
+
+static void hill_release(void * tables){
+    /* Destructor of hill_key, run by the exiting thread */
+    int k;
+
+    for(k=0; k<hill_ntables; k++) free(hill_tables[k].v);
+    free(tables);
+    hill_tables = NULL;
+    hill_ntables = 0;
+}
+
+static void hill_key_new(void){
+    if(pthread_key_create(&hill_key, hill_release) != 0){
+        report_error("Could not create the key of the Hill tables\n");
+        exit(1);
+    }
+}
+
+static Hill_t * hill_reserve(Model_t * m){
+    /* Tables of the thread, for every reaction of m */
+    int k;
+
+    if(hill_ntables < HILL_TABLES * m->Nreactions){
+        hill_tables = (Hill_t *) realloc(hill_tables, HILL_TABLES * m->Nreactions * sizeof(Hill_t));
+        if (!hill_tables) {
+            report_error("allocation failure in hill_reserve()");
+            exit(1);
+        }
+        for(k=hill_ntables; k<HILL_TABLES * m->Nreactions; k++){
+            hill_tables[k].k = NAN;
+            hill_tables[k].n = 0;
+            hill_tables[k].max = 0;
+            hill_tables[k].v = NULL;
+        }
+        hill_ntables = HILL_TABLES * m->Nreactions;
+        pthread_once(&hill_once, hill_key_new);
+        pthread_setspecific(hill_key, hill_tables);
+    }
+    return hill_tables;
+}
+
+/* Mass action multiplies binomial(y, k) over the reactants, y being the count
+ * and k the order. Orders 1 to 3 take the operations of dchoose() in closed
+ * form. Higher orders take the falling factorial y (y-1) ... (y-k+1) over
+ * k!, exact while it is below 2^53, and while it is finite enough (y up to
+ * ma_limit[k]). Beyond, binomial(y, k) is exp of the log factorials, tabulated
+ * for counts below MA_LFACT_SIZE.
+ * Set once by ma_init() when the model is built, read only afterwards.
+ */
+#define MA_MAXORDER 170
+#define MA_LFACT_SIZE 65536
+
+static double ma_fact[MA_MAXORDER + 1];
+static int ma_limit[MA_MAXORDER + 1];
+static int ma_ready = 0;
+static double * ma_lfact = NULL;
+
+static void ma_init(int maxorder){
+    int k, n;
+    double l;
+
+    if(!ma_ready){
+        ma_fact[0] = 1;
+        ma_limit[0] = INT_MAX;
+        for(k=1; k<=MA_MAXORDER; k++){
+            ma_fact[k] = ma_fact[k-1] * k;
+            /* y^k below 2^1000 */
+            l = floor(pow(2, 1000.0 / k));
+            ma_limit[k] = (l < INT_MAX) ? (int) l : INT_MAX;
+        }
+        ma_ready = 1;
+    }
+    if(ma_lfact == NULL && (maxorder > MA_MAXORDER || ma_limit[maxorder] < INT_MAX)){
+        ma_lfact = dvector(MA_LFACT_SIZE);
+        for(n=0; n<MA_LFACT_SIZE; n++) ma_lfact[n] = lgamma(n + 1.0);
+    }
+}
+
+void model_ma_factorial(int k, double * fact, int * limit){
+    /* k! and the largest count taking the falling factorial, -1 if none */
+    ma_init(1);
+    *fact = (k <= MA_MAXORDER) ? ma_fact[k] : 1;
+    *limit = (k <= MA_MAXORDER) ? ma_limit[k] : -1;
+}
+
+static double ma_lfactorial(int n){
+    return (n < MA_LFACT_SIZE) ? ma_lfact[n] : lgamma(n + 1.0);
+}
+
+static double ma_choose_high(int n, int k){
+    int i;
+    double p;
+
+    if(k <= MA_MAXORDER && n <= ma_limit[k]){
+        p = n;
+        for(i=1; i<k; i++) p *= n - i;
+        return p / ma_fact[k];
+    }
+    return exp(ma_lfactorial(n) - ma_lfactorial(k) - ma_lfactorial(n - k));
+}
+
+static inline double ma_choose(int n, int k){
+    if(n < k) return 0;
+    switch(k){
+    case 1: return n;
+    case 2: return (double) (n - 1) * n / 2;
+    case 3: return (double) (n - 2) * (n - 1) / 2 * n / 3;
+    default: return ma_choose_high(n, k);
+    }
+}
+
+double model_ma_choose(int n, int k){
+    /* binomial(n, k) as the mass action law takes it, for the batched laws */
+    return ma_choose(n, k);
+}
+
 
 Model_t * model_new(){
 	Model_t * model;
@@ -37,15 +229,11 @@ void free_model(Model_t * model){
  	for(i=0; i< model->Nreactions; i++)
         if(model->rstoichiometry[i] != NULL)
             free((char *) model->rstoichiometry[i]);
-        if(model->pstoichiometry[i] != NULL)
-            free((char *) model->pstoichiometry[i]);
 	    if(model->params[i] != NULL)
 	        free((char *) model->params[i]);
 	printf("=\n");
     if(model->rstoichiometry != NULL)
         free((char *) model->rstoichiometry);
-    if(model->pstoichiometry != NULL)
-        free((char *) model->pstoichiometry);
     if(model->params != NULL)
         free((char *) model->params);
 */
@@ -65,10 +253,6 @@ void model_set_allocate(Model_t * model, int nspecies, int nreactions) {
 	if (model->prop == NULL) flag_error = 1;
 	model->nparams = izeros(nreactions);
 	if (model->nparams == NULL) flag_error = 1;
-    model->rstoichiometry = (int **) calloc(nreactions, sizeof(int *));
-    if (model->rstoichiometry == NULL) flag_error = 1;
-    model->pstoichiometry = (int **) calloc(nreactions, sizeof(int *));
-    if (model->pstoichiometry == NULL) flag_error = 1;
 	model->params = (double **) malloc(nreactions * sizeof(double *));
 	if (model->params == NULL) flag_error = 1;
     model->acting_species = (int **) calloc(nreactions, sizeof(int *));
@@ -80,17 +264,44 @@ void model_set_allocate(Model_t * model, int nspecies, int nreactions) {
 	    exit(1);
 	 }
 	for(i=0; i<nreactions; i++) {
-	    model->rstoichiometry[i] = (int *) calloc(nspecies, sizeof(int));
-        model->pstoichiometry[i] = (int *) calloc(nspecies, sizeof(int));
         model->species[i] = (char *) malloc(MAX_NAME_SIZE * sizeof(char));
 	}
+    /* Filled reaction by reaction with model_set_reactants() and
+     * model_set_products(), then model_build_changes() */
+    model->rptr = izeros(nreactions + 1);
+    model->pptr = izeros(nreactions + 1);
+    model->rspecies = model->rcoeff = NULL;
+    model->pspecies = model->pcoeff = NULL;
+    model->cptr = model->cspecies = model->cdelta = NULL;
+    model->sptr = model->sreaction = model->sdelta = NULL;
+    model->nreactants = NULL;
+    model->reactants = NULL;
 	model->istate =lzeros(nspecies);
 	model->ics = lzeros(nspecies);
+    model->ninputs = 0;
+    model->inputs = NULL;
+    model->nevents = 0;
+    model->events = NULL;
+    model->expr = NULL;
+    model->nblocks = 0;
+    model->blocks = NULL;
+    model->rates = NULL;
+    model->update = NULL;
+    model->lib = NULL;
 	return;
 }
 
+static void model_print_side(Model_t * m, int * species, int * coeffs, int n){
+    int k;
+    for(k=0; k<n; k++) {
+        if(k > 0) printf(" + ");
+        if(coeffs[k] == 1) printf("%s", m->species[species[k]]);
+        else printf("%d*%s", coeffs[k], m->species[species[k]]);
+    }
+}
+
 void model_print(Model_t * m){
-    int i, j;
+    int i;
     printf("# [Species] # %d species\n", m->nspecies);
     for(i=0; i<m->nspecies; i++){
         printf("%s = %ld\n", m->species[i], m->ics[i]);
@@ -98,22 +309,288 @@ void model_print(Model_t * m){
     printf("# [Reactions] # %d reactions\n", m->Nreactions);
     for(i=0; i<m->Nreactions;i++) {
         printf("# ");
-        for(j=0; j<m->nspecies-1; j++) {
-            if(m->rstoichiometry[i][j] == 1) printf("%s + ", m->species[j]);
-            else if(m->rstoichiometry[i][j] > 1) printf("%d*%s + ", m->rstoichiometry[i][j], m->species[j]);
-        }
-        if(m->rstoichiometry[i][m->nspecies-1] == 1) printf("%s", m->species[m->nspecies-1]);
-        else if(m->rstoichiometry[i][m->nspecies-1] > 1) printf("%d*%s", m->rstoichiometry[i][m->nspecies-1], m->species[j]);
+        model_print_side(m, m->rspecies + m->rptr[i], m->rcoeff + m->rptr[i], m->rptr[i+1] - m->rptr[i]);
         printf(" -> ");
-        for(j=0; j<m->nspecies-1; j++) {
-            if(m->pstoichiometry[i][j] == 1) printf("%s + ", m->species[j]);
-            else if(m->pstoichiometry[i][j] > 1) printf("%d*%s + ", m->pstoichiometry[i][j], m->species[j]);
-        }
-        if(m->pstoichiometry[i][m->nspecies-1] == 1) printf("%s", m->species[m->nspecies-1]);
-        else if(m->pstoichiometry[i][m->nspecies-1] > 1) printf("%d*%s", m->pstoichiometry[i][m->nspecies-1], m->species[j]);
+        model_print_side(m, m->pspecies + m->pptr[i], m->pcoeff + m->pptr[i], m->pptr[i+1] - m->pptr[i]);
         printf(" | \n");
     }
 }
+
+static void csr_set_row(int * ptr, int ** idx, int ** val, int row, int n, int * species, int * coeffs){
+    /* Appends row, rows being set in order */
+    ptr[row+1] = ptr[row] + n;
+    *idx = (int *) realloc(*idx, (ptr[row+1] > 0 ? ptr[row+1] : 1) * sizeof(int));
+    *val = (int *) realloc(*val, (ptr[row+1] > 0 ? ptr[row+1] : 1) * sizeof(int));
+    if (*idx == NULL || *val == NULL) {
+        report_error("allocation failure in csr_set_row()");
+        exit(1);
+    }
+    memcpy(*idx + ptr[row], species, n * sizeof(int));
+    memcpy(*val + ptr[row], coeffs, n * sizeof(int));
+}
+
+void model_set_reactants(Model_t * m, int reaction, int n, int * species, int * coeffs){
+    csr_set_row(m->rptr, &m->rspecies, &m->rcoeff, reaction, n, species, coeffs);
+}
+
+void model_set_products(Model_t * m, int reaction, int n, int * species, int * coeffs){
+    csr_set_row(m->pptr, &m->pspecies, &m->pcoeff, reaction, n, species, coeffs);
+}
+
+static void model_build_reactants(Model_t * m){
+    /* Reactant lists of the propensities, sorted as mass action multiplies
+     * its factors in increasing species order */
+    int j, k, l, n, s, c, maxorder;
+
+    maxorder = 1;
+    m->nreactants = izeros(m->Nreactions);
+    m->reactants = (int **) malloc(m->Nreactions * sizeof(int *) + 1);
+    if (!m->reactants) {
+        report_error("allocation failure in model_build_reactants()");
+        exit(1);
+    }
+    for(j=0; j<m->Nreactions; j++){
+        m->reactants[j] = ivector(2 * (m->rptr[j+1] - m->rptr[j]) + 1);
+        n = 0;
+        for(k=m->rptr[j]; k<m->rptr[j+1]; k++){
+            if(m->rcoeff[k] <= 0) continue;
+            s = m->rspecies[k];
+            c = m->rcoeff[k];
+            for(l=n; l>0 && m->reactants[j][2*(l-1)] > s; l--){
+                m->reactants[j][2*l] = m->reactants[j][2*(l-1)];
+                m->reactants[j][2*l+1] = m->reactants[j][2*(l-1)+1];
+            }
+            m->reactants[j][2*l] = s;
+            m->reactants[j][2*l+1] = c;
+            if(c > maxorder) maxorder = c;
+            n++;
+        }
+        m->nreactants[j] = n;
+    }
+    ma_init(maxorder);
+}
+
+void model_build_changes(Model_t * m){
+    /* Net changes by reaction and by species from the reactants and products,
+     * and the reactant lists */
+    int i, j, k, n, nnz;
+    int *delta, *count;
+
+    model_build_reactants(m);
+
+    delta = izeros(m->nspecies);
+    m->cptr = izeros(m->Nreactions + 1);
+    m->cspecies = ivector(m->rptr[m->Nreactions] + m->pptr[m->Nreactions] + 1);
+    m->cdelta = ivector(m->rptr[m->Nreactions] + m->pptr[m->Nreactions] + 1);
+    nnz = 0;
+    for(j=0; j<m->Nreactions; j++){
+        for(k=m->rptr[j]; k<m->rptr[j+1]; k++) delta[m->rspecies[k]] -= m->rcoeff[k];
+        for(k=m->pptr[j]; k<m->pptr[j+1]; k++) delta[m->pspecies[k]] += m->pcoeff[k];
+        /* Reactants, then products not among them, skipping zero changes */
+        for(k=m->rptr[j]; k<m->rptr[j+1]; k++){
+            i = m->rspecies[k];
+            if(delta[i] == 0) continue;
+            m->cspecies[nnz] = i;
+            m->cdelta[nnz++] = delta[i];
+            delta[i] = 0;
+        }
+        for(k=m->pptr[j]; k<m->pptr[j+1]; k++){
+            i = m->pspecies[k];
+            if(delta[i] == 0) continue;
+            m->cspecies[nnz] = i;
+            m->cdelta[nnz++] = delta[i];
+            delta[i] = 0;
+        }
+        m->cptr[j+1] = nnz;
+    }
+    /* Transpose */
+    count = izeros(m->nspecies + 1);
+    for(k=0; k<nnz; k++) count[m->cspecies[k] + 1]++;
+    for(i=0; i<m->nspecies; i++) count[i+1] += count[i];
+    m->sptr = ivector(m->nspecies + 1);
+    memcpy(m->sptr, count, (m->nspecies + 1) * sizeof(int));
+    m->sreaction = ivector(nnz + 1);
+    m->sdelta = ivector(nnz + 1);
+    for(j=0; j<m->Nreactions; j++){
+        for(k=m->cptr[j]; k<m->cptr[j+1]; k++){
+            n = count[m->cspecies[k]]++;
+            m->sreaction[n] = j;
+            m->sdelta[n] = m->cdelta[k];
+        }
+    }
+    free_ivector(delta);
+    free_ivector(count);
+}
+
+void model_fire(Model_t * m, int reaction, double * state){
+    /* state += net change of reaction */
+    int k;
+    for(k=m->cptr[reaction]; k<m->cptr[reaction+1]; k++) state[m->cspecies[k]] += m->cdelta[k];
+}
+
+double model_prop(Model_t * m, int reaction, double * state, double * params){
+    /* Propensity of reaction, the Hill laws using the tables of the thread */
+    double a;
+
+    hill_current = hill_reserve(m) + HILL_TABLES * reaction;
+    a = m->prop[reaction](state, m->nreactants[reaction], m->reactants[reaction], params, m->acting_species[reaction]);
+    hill_current = NULL;
+    return a;
+}
+
+void model_build_blocks(Model_t * m){
+    /* Groups the reactions by rate law, mass action by its reactants, so
+     * that model_rates() runs a loop per law instead of calling the
+     * propensity of each reaction. Reactions keep their order in a block */
+    int j, b, n;
+    int *kind, *count, *r;
+    Block_t * bl;
+
+    kind = ivector(m->Nreactions);
+    count = izeros(BLOCK_OTHER + 1);
+    for(j=0; j<m->Nreactions; j++){
+        n = m->nreactants[j];
+        r = m->reactants[j];
+        if(m->prop[j] == prop_MA && n == 0) kind[j] = BLOCK_MA0;
+        else if(m->prop[j] == prop_MA && n == 1 && r[1] == 1) kind[j] = BLOCK_MA1;
+        else if(m->prop[j] == prop_MA && n == 1 && r[1] == 2) kind[j] = BLOCK_MA2D;
+        else if(m->prop[j] == prop_MA && n == 2 && r[1] == 1 && r[3] == 1) kind[j] = BLOCK_MA2;
+        else if(m->prop[j] == prop_MA) kind[j] = BLOCK_MAH;
+        else if(m->prop[j] == prop_HA) kind[j] = BLOCK_HA;
+        else if(m->prop[j] == prop_HI) kind[j] = BLOCK_HI;
+        else if(m->prop[j] == prop_EXPR) kind[j] = BLOCK_EXPR;
+        else kind[j] = BLOCK_OTHER;
+        count[kind[j]]++;
+    }
+    m->nblocks = 0;
+    for(b=0; b<=BLOCK_OTHER; b++) if(count[b] > 0) m->nblocks++;
+    m->blocks = (Block_t *) malloc(m->nblocks * sizeof(Block_t) + 1);
+    if (!m->blocks) {
+        report_error("allocation failure in model_build_blocks()");
+        exit(1);
+    }
+    bl = m->blocks;
+    for(b=0; b<=BLOCK_OTHER; b++){
+        if(count[b] == 0) continue;
+        bl->kind = (block_kind) b;
+        bl->n = 0;
+        bl->reaction = ivector(count[b]);
+        bl->s1 = ivector(count[b]);
+        bl->s2 = ivector(count[b]);
+        for(j=0; j<m->Nreactions; j++){
+            if(kind[j] != b) continue;
+            r = m->reactants[j];
+            bl->reaction[bl->n] = j;
+            if(b == BLOCK_HA || b == BLOCK_HI) bl->s1[bl->n] = m->acting_species[j][0];
+            else bl->s1[bl->n] = (m->nreactants[j] > 0) ? r[0] : 0;
+            bl->s2[bl->n] = (b == BLOCK_MA2) ? r[2] : 0;
+            bl->n++;
+        }
+        bl++;
+    }
+    free_ivector(kind);
+    free_ivector(count);
+}
+
+static void model_block_rates(Model_t * m, double * state, double ** params, double * rates){
+    int b, l, j, i;
+    int * r;
+    double a;
+    Block_t * bl;
+    Hill_t * tables;
+
+    tables = hill_reserve(m);
+    for(b=0; b<m->nblocks; b++){
+        bl = m->blocks + b;
+        switch(bl->kind){
+        case BLOCK_MA0:
+            for(l=0; l<bl->n; l++){
+                j = bl->reaction[l];
+                rates[j] = params[j][0];
+            }
+            break;
+        case BLOCK_MA1:
+            for(l=0; l<bl->n; l++){
+                j = bl->reaction[l];
+                rates[j] = params[j][0] * ma_choose((int) state[bl->s1[l]], 1);
+            }
+            break;
+        case BLOCK_MA2:
+            for(l=0; l<bl->n; l++){
+                j = bl->reaction[l];
+                rates[j] = params[j][0] * ma_choose((int) state[bl->s1[l]], 1) * ma_choose((int) state[bl->s2[l]], 1);
+            }
+            break;
+        case BLOCK_MA2D:
+            for(l=0; l<bl->n; l++){
+                j = bl->reaction[l];
+                rates[j] = params[j][0] * ma_choose((int) state[bl->s1[l]], 2);
+            }
+            break;
+        case BLOCK_MAH:
+            /* As prop_MA(), without the call */
+            for(l=0; l<bl->n; l++){
+                j = bl->reaction[l];
+                r = m->reactants[j];
+                a = params[j][0];
+                for(i=0; i<m->nreactants[j]; i++) a *= ma_choose((int) state[r[2*i]], r[2*i+1]);
+                rates[j] = a;
+            }
+            break;
+        case BLOCK_HA:
+            for(l=0; l<bl->n; l++){
+                j = bl->reaction[l];
+                rates[j] = params[j][0] / (1 + hill_lookup(tables + HILL_TABLES * j,
+                            (int) state[bl->s1[l]], params[j][1], params[j][2], HILL_INV));
+            }
+            break;
+        case BLOCK_HI:
+            for(l=0; l<bl->n; l++){
+                j = bl->reaction[l];
+                rates[j] = params[j][0] / (1 + hill_lookup(tables + HILL_TABLES * j,
+                            (int) state[bl->s1[l]], params[j][1], params[j][2], HILL_DIV));
+            }
+            break;
+        case BLOCK_EXPR:
+            expr_rates(m, state, params, rates);
+            break;
+        default:
+            for(l=0; l<bl->n; l++){
+                j = bl->reaction[l];
+                rates[j] = model_prop(m, j, state, params[j]);
+            }
+        }
+    }
+}
+
+void model_rates(Model_t * m, double * state, double ** params, double * rates){
+    /* rates = every propensity at state, by the compiled model if loaded */
+    int j;
+
+    if(m->rates != NULL) {
+        m->rates(state, params, rates);
+        return;
+    }
+    if(m->blocks != NULL) {
+        model_block_rates(m, state, params, rates);
+        return;
+    }
+    for(j=0; j<m->Nreactions; j++){
+        rates[j] = model_prop(m, j, state, params[j]);
+    }
+}
+
+void model_update(Model_t * m, int reaction, double * state, double ** params, double * rates){
+    /* Fires reaction and brings rates up to date. The compiled model only
+     * recomputes the propensities reading the species that changed */
+    if(m->update != NULL) {
+        m->update(reaction, state, params, rates);
+        return;
+    }
+    model_fire(m, reaction, state);
+    model_rates(m, state, params, rates);
+}
+
 void model_print_state(Model_t * m){
     int i;
     printf("%g ",m->time);
@@ -124,20 +601,251 @@ void model_print_state(Model_t * m){
 
 }
 
+double ** model_params_copy(Model_t * m){
+    /* Private copy of the parameters, i.e. for time dependent ones */
+    int j;
+    double ** params;
+
+    params = (double **) malloc(m->Nreactions * sizeof(double *));
+    if (params == NULL) {
+        report_error("allocation failure in model_params_copy()");
+        exit(1);
+    }
+    for(j=0; j<m->Nreactions; j++){
+        params[j] = dvector(m->nparams[j]);
+        memcpy(params[j], m->params[j], m->nparams[j] * sizeof(double));
+    }
+    return params;
+}
+
+void model_params_reset(Model_t * m, double ** params){
+    /* Restores a copy made with model_params_copy() to the model values */
+    int j;
+    for(j=0; j<m->Nreactions; j++){
+        memcpy(params[j], m->params[j], m->nparams[j] * sizeof(double));
+    }
+}
+
+void free_params(Model_t * m, double ** params){
+    int j;
+    for(j=0; j<m->Nreactions; j++) free_dvector(params[j]);
+    free((char *) params);
+}
+
+double input_value(Input_t * in, double t){
+    int k;
+    if(in->type == INPUT_SINE){
+        return in->mean + in->amplitude * sin(2 * M_PI * t / in->period + in->phase);
+    }
+    if(in->repeat > 0) t = fmod(t, in->repeat);
+    if(t <= in->t[0]) return in->v[0];
+    for(k=1; k<in->npoints; k++){
+        if(t < in->t[k]) break;
+    }
+    if(k == in->npoints) return in->v[k-1];
+    if(in->type == INPUT_STEPS) return in->v[k-1];
+    return in->v[k-1] + (in->v[k] - in->v[k-1]) * (t - in->t[k-1]) / (in->t[k] - in->t[k-1]);
+}
+
+static void input_bounds_once(Input_t * in, double t0, double t1, double * lo, double * hi){
+    /* Bounds of a step or table input over [t0, t1] without wrapping around.
+     * Both are piecewise linear, so the extremes are attained at the ends or
+     * at the breakpoints in between. */
+    int k;
+    double v;
+
+    *lo = input_value(in, t0);
+    *hi = *lo;
+    v = input_value(in, t1);
+    if(v < *lo) *lo = v;
+    if(v > *hi) *hi = v;
+    for(k=0; k<in->npoints; k++){
+        if(in->t[k] <= t0 || in->t[k] > t1) continue;
+        if(in->v[k] < *lo) *lo = in->v[k];
+        if(in->v[k] > *hi) *hi = in->v[k];
+    }
+}
+
+void input_bounds(Input_t * in, double t0, double t1, double * lo, double * hi){
+    /* Lower and upper bound of the input over [t0, t1] */
+    double s[4], th0, th1, n, lo2, hi2;
+    int k, ns;
+
+    if(in->type == INPUT_SINE){
+        th0 = 2 * M_PI * t0 / in->period + in->phase;
+        th1 = 2 * M_PI * t1 / in->period + in->phase;
+        ns = 0;
+        s[ns++] = sin(th0);
+        s[ns++] = sin(th1);
+        /* Crest and trough inside the interval? */
+        n = ceil((th0 - M_PI / 2) / (2 * M_PI));
+        if(M_PI / 2 + 2 * M_PI * n <= th1) s[ns++] = 1;
+        n = ceil((th0 - 3 * M_PI / 2) / (2 * M_PI));
+        if(3 * M_PI / 2 + 2 * M_PI * n <= th1) s[ns++] = -1;
+        *lo = in->mean + in->amplitude * s[0];
+        *hi = *lo;
+        for(k=1; k<ns; k++){
+            if(in->mean + in->amplitude * s[k] < *lo) *lo = in->mean + in->amplitude * s[k];
+            if(in->mean + in->amplitude * s[k] > *hi) *hi = in->mean + in->amplitude * s[k];
+        }
+        return;
+    }
+    if(in->repeat <= 0){
+        input_bounds_once(in, t0, t1, lo, hi);
+        return;
+    }
+    if(t1 - t0 >= in->repeat){
+        input_bounds_once(in, 0, in->repeat, lo, hi);
+        return;
+    }
+    t1 = fmod(t0, in->repeat) + (t1 - t0);
+    t0 = fmod(t0, in->repeat);
+    if(t1 <= in->repeat){
+        input_bounds_once(in, t0, t1, lo, hi);
+    } else {
+        input_bounds_once(in, t0, in->repeat, lo, hi);
+        input_bounds_once(in, 0, t1 - in->repeat, &lo2, &hi2);
+        if(lo2 < *lo) *lo = lo2;
+        if(hi2 > *hi) *hi = hi2;
+    }
+}
+
+void model_set_inputs(Model_t * m, double ** params, double t){
+    /* Sets the time dependent parameters to their value at time t */
+    int k;
+    for(k=0; k<m->ninputs; k++){
+        params[m->inputs[k].reaction][m->inputs[k].param] = input_value(m->inputs + k, t);
+    }
+}
+
+void events_reset(Model_t * m, int * armed){
+    /* Arms every event, i.e. at the start of a trajectory */
+    int k;
+    for(k=0; k<m->nevents; k++) armed[k] = 1;
+}
+
+double events_next_time(Model_t * m, int * armed){
+    /* Time of the next timed event still to fire, INFINITY if none */
+    int k;
+    double t;
+    t = INFINITY;
+    for(k=0; k<m->nevents; k++){
+        if(m->events[k].trigger == NULL && armed[k] && m->events[k].time < t) t = m->events[k].time;
+    }
+    return t;
+}
+
+static void event_apply(Event_t * e, double * state, double ** params){
+    int k;
+    Action_t * a;
+    for(k=0; k<e->nactions; k++){
+        a = e->actions + k;
+        if(a->type == ACTION_SET_SPECIES){
+            state[a->species] = a->value;
+        } else if(a->type == ACTION_ADD_SPECIES){
+            state[a->species] += a->value;
+            if(state[a->species] < 0) state[a->species] = 0;
+        } else {
+            params[a->reaction][a->param] = a->value;
+        }
+    }
+}
+
+int events_fire(Model_t * m, int * armed, double t, double * state, double ** params){
+    /* Fires, in order of declaration, the timed events due by t and the
+     * triggered events whose condition has become true. A triggered event is
+     * armed again once its condition is false. Returns the number of events
+     * fired. */
+    int k, nfired;
+    Event_t * e;
+
+    nfired = 0;
+    for(k=0; k<m->nevents; k++){
+        e = m->events + k;
+        if(e->trigger == NULL){
+            if(!armed[k] || e->time > t) continue;
+        } else if(!condition_holds(e->trigger, state)){
+            armed[k] = 1;
+            continue;
+        } else if(!armed[k]){
+            continue;
+        }
+        event_apply(e, state, params);
+        armed[k] = 0;
+        nfired++;
+    }
+    return nfired;
+}
+
+double coordinate_value(Coordinate_t * c, double * state){
+    int k;
+    double value;
+    value = 0;
+    for(k=0; k<c->nterms; k++){
+        value += c->coeffs[k] * state[c->species[k]];
+    }
+    return value;
+}
+
+int condition_holds(Condition_t * c, double * state){
+    double value;
+    value = coordinate_value(c->lhs, state);
+    switch(c->rel){
+        case REL_LT: return value <  c->value;
+        case REL_LE: return value <= c->value;
+        case REL_EQ: return value == c->value;
+        case REL_NE: return value != c->value;
+        case REL_GE: return value >= c->value;
+        case REL_GT: return value >  c->value;
+    }
+    return 0;
+}
+
+void free_coordinate(Coordinate_t * c){
+    free_ivector(c->species);
+    free_dvector(c->coeffs);
+    free((char *) c);
+}
+
+void free_condition(Condition_t * c){
+    free_coordinate(c->lhs);
+    free((char *) c);
+}
+
+void sweep_point(Sweep_t * sw, int point, double ** params){
+    /* Sets the swept parameters to their values at point of the grid */
+    int k;
+
+    for(k=sw->naxes-1; k>=0; k--){
+        params[sw->reaction[k]][sw->param[k]] = sw->values[k][point % sw->nvalues[k]];
+        point /= sw->nvalues[k];
+    }
+}
+
+void free_sweep(Sweep_t * sw){
+    int k;
+
+    for(k=0; k<sw->naxes; k++) free_dvector(sw->values[k]);
+    free((char *) sw->values);
+    free((char *) sw->reaction);
+    free((char *) sw->param);
+    free((char *) sw->nvalues);
+    free((char *) sw);
+}
+
 /* Propensity reactions*/
 double prop_MA(double *x , int nx, int *c, double *params, int * acting_species){
 	/* Mass Action Law propensity
-	 * For species Xi with stoichiometric coefficients Ci, the propensity is given by:
+	 * For reactants Xi (c[2i]) with stoichiometric coefficients Ci (c[2i+1]), i < nx,
+	 * the propensity is given by:
 	 * 	rate * binomial(X1, C1) *  * binomial(XN, CN)
-	 *
+	 * with the binomials of ma_choose()
 	 * */
 	int i;
 	double prop;
 	prop = params[0];
 	for(i=0; i < nx; i++){
-		if(c[i]>0)
-		    //printf("x(%d)=%d, %d\n",i,x[i],c[i]);
-			prop *= dchoose(x[i], c[i]);
+		prop *= ma_choose((int) x[c[2*i]], c[2*i+1]);
 	}
 //	printf("prop=%g\n",prop);
 	return prop;
@@ -155,7 +863,7 @@ double prop_HA(double *x , int nx, int *c, double *params, int * acting_species)
     hcoop = params[2];
     y = x[acting_species[0]];
     //printf("rate=%g, km=%g, hcoop=%g  -> %d\n", rate, km, hcoop, y);
-    prop = rate / (1 + pow(km/y, hcoop));
+    prop = rate / (1 + hill_pow(0, y, km, hcoop, HILL_INV));
     return prop;
 }
 
@@ -171,7 +879,7 @@ double prop_HI(double *x , int nx, int *c, double *params, int * acting_species)
     hcoop = params[2];
 
     y = x[acting_species[0]];
-    prop = rate / (1 + pow(y/km, hcoop));
+    prop = rate / (1 + hill_pow(0, y, km, hcoop, HILL_DIV));
     return prop;
 }
 
@@ -189,7 +897,7 @@ double prop_MAHI(double *x , int nx, int *c, double *params, int * acting_specie
 
     ym = x[acting_species[0]];
     yi = x[acting_species[1]];
-    prop = rate * ym / (1 + pow(yi/kmi, hcoopi));
+    prop = rate * ym / (1 + hill_pow(0, yi, kmi, hcoopi, HILL_DIV));
     return prop;
 }
 
@@ -209,7 +917,7 @@ double prop_CI(double *x , int nx, int *c, double *params, int * acting_species)
     yi = x[acting_species[1]];
 
     if(ya==0) {prop = 0; }
-    else { prop = rate * pow(ya, hcoopa) / (pow(kma, hcoopa) + pow(ya, hcoopa) + pow(gamma*yi, hcoopi)); }
+    else { prop = rate * hill_pow(0, ya, 1, hcoopa, HILL_MUL) / (pow(kma, hcoopa) + hill_pow(0, ya, 1, hcoopa, HILL_MUL) + hill_pow(1, yi, gamma, hcoopi, HILL_MUL)); }
     return prop;
 }
 
@@ -231,7 +939,7 @@ double prop_HIHA(double *x , int nx, int *c, double *params, int * acting_specie
     ya = x[acting_species[1]];
 
     if(ya==0) {prop = 0; }
-    else { prop = rate / (1 + pow(yi/kmi, hcoopi)) / (1 + pow(kma/ya, hcoopa)); }
+    else { prop = rate / (1 + hill_pow(0, yi, kmi, hcoopi, HILL_DIV)) / (1 + hill_pow(1, ya, kma, hcoopa, HILL_INV)); }
     return prop;
 }
 
@@ -242,7 +950,7 @@ double prop_HAHAC(double *x , int nx, int *c, double *params, int * acting_speci
      *
      * */
     int ya1, ya2;
-    double rate1, rate2, kma1, hcoop1, kma2, hcoop2, prop;
+    double rate1, rate2, kma1, hcoop1, kma2, hcoop2, p1, p2, prop;
     rate1 = params[0];
     kma1 = params[1];
     hcoop1 = params[2];
@@ -254,7 +962,9 @@ double prop_HAHAC(double *x , int nx, int *c, double *params, int * acting_speci
     ya1 = x[acting_species[0]];
     ya2 = x[acting_species[1]];
 
-    prop = (rate1*pow(ya1/kma1, hcoop1) + rate2*pow(ya2/kma2, hcoop2) )/ (1 + pow(ya1/kma1, hcoop1) + pow(ya2/kma2, hcoop2));
+    p1 = hill_pow(0, ya1, kma1, hcoop1, HILL_DIV);
+    p2 = hill_pow(1, ya2, kma2, hcoop2, HILL_DIV);
+    prop = (rate1*p1 + rate2*p2 )/ (1 + p1 + p2);
     return prop;
 }
 
@@ -264,7 +974,7 @@ double prop_HAHAHIC(double *x , int nx, int *c, double *params, int * acting_spe
      *
      * */
     int ya1, ya2, yi;
-    double rate1, rate2, kma1, hcoop1, kma2, hcoop2, kmi, hcoopi, prop;
+    double rate1, rate2, kma1, hcoop1, kma2, hcoop2, kmi, hcoopi, p1, p2, prop;
     rate1 = params[0];
     kma1 = params[1];
     hcoop1 = params[2];
@@ -280,7 +990,9 @@ double prop_HAHAHIC(double *x , int nx, int *c, double *params, int * acting_spe
     ya2 = x[acting_species[1]];
     yi  = x[acting_species[2]];
 
-    prop = (rate1*pow(ya1/kma1, hcoop1) + rate2*pow(ya2/kma2, hcoop2) )/ (1 + pow(ya1/kma1, hcoop1) + pow(ya2/kma2, hcoop2) + pow(yi/kmi, hcoopi));
+    p1 = hill_pow(0, ya1, kma1, hcoop1, HILL_DIV);
+    p2 = hill_pow(1, ya2, kma2, hcoop2, HILL_DIV);
+    prop = (rate1*p1 + rate2*p2 )/ (1 + p1 + p2 + hill_pow(2, yi, kmi, hcoopi, HILL_DIV));
 
     return prop;
 }
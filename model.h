@@ -20,7 +20,115 @@
 
 #include "utils.h"
 
-typedef double (*propensityFunc)(double * state, int nreactants, int * rstoichiometry, double *params, int* acting_species);
+typedef double (*propensityFunc)(double * state, int nreactants, int * reactants, double *params, int* acting_species);
+typedef void (*ratesFunc)(double * state, double ** params, double * rates);
+typedef void (*updateFunc)(int reaction, double * state, double ** params, double * rates);
+
+typedef enum _input_type {
+    INPUT_STEPS,
+    INPUT_TABLE,
+    INPUT_SINE
+} input_type;
+
+typedef struct _Input_t {
+    /* Time dependent parameter: params[reaction][param] = f(t)
+     * INPUT_STEPS: piecewise constant, v[k] on [t[k], t[k+1])
+     * INPUT_TABLE: linear interpolation between the points (t[k], v[k])
+     * INPUT_SINE:  mean + amplitude * sin(2 pi t / period + phase)
+     * Steps and tables are repeated every repeat time units if repeat > 0.
+     * */
+    int reaction, param;
+    input_type type;
+    int npoints;
+    double * t, * v;
+    double mean, amplitude, period, phase;
+    double repeat;
+} Input_t;
+
+typedef enum _action_type {
+    ACTION_SET_SPECIES,
+    ACTION_ADD_SPECIES,
+    ACTION_SET_PARAM
+} action_type;
+
+typedef struct _Action_t {
+    /* state[species] = value, state[species] += value or params[reaction][param] = value */
+    action_type type;
+    int species, reaction, param;
+    double value;
+} Action_t;
+
+struct _Condition_t;
+
+typedef struct _Event_t {
+    /* Timed events fire once when the simulation reaches time. Triggered
+     * events (trigger not NULL) fire whenever their condition becomes true. */
+    double time;
+    struct _Condition_t * trigger;
+    int nactions;
+    Action_t * actions;
+} Event_t;
+
+typedef enum _expr_op {
+    EXPR_CONST,
+    EXPR_SPECIES,
+    EXPR_PARAM,
+    EXPR_ADD,
+    EXPR_SUB,
+    EXPR_MUL,
+    EXPR_DIV,
+    EXPR_POW,
+    EXPR_NEG,
+    EXPR_EXP,
+    EXPR_LOG,
+    EXPR_SQRT,
+    EXPR_MIN,
+    EXPR_MAX
+} expr_op;
+
+typedef struct _ExprIns_t {
+    /* register = op(register a, register b), or a constant v, species a, or
+     * params[a][b] for the loads */
+    expr_op op;
+    int a, b;
+    double v;
+} ExprIns_t;
+
+typedef struct _Expr_t {
+    /* Expression rate laws of a model, as a single program (see expr.c):
+     * instruction k writes register k, and the propensity of reaction j is
+     * register out[j]. lcode[lptr[j]..lptr[j+1]-1] is the part reaction j
+     * needs, renumbered from 0. */
+    int n, max;
+    ExprIns_t * code;
+    int tsize;
+    int * table;
+    int * out;
+    int * lptr;
+    ExprIns_t * lcode;
+} Expr_t;
+
+typedef enum _block_kind {
+    BLOCK_MA0,  /* rate */
+    BLOCK_MA1,  /* rate * A */
+    BLOCK_MA2,  /* rate * A * B */
+    BLOCK_MA2D, /* rate * A * (A - 1) / 2 */
+    BLOCK_MAH,  /* higher orders, rate * binomial(A, a) * binomial(B, b) ... */
+    BLOCK_HA,
+    BLOCK_HI,
+    BLOCK_EXPR, /* by a single run of the expression program */
+    BLOCK_OTHER /* by the propensity function of each reaction */
+} block_kind;
+
+typedef struct _Block_t {
+    /* Reactions sharing a rate law, with the species it reads: l-th reaction
+     * is reaction[l], reading s1[l] (and s2[l] for BLOCK_MA2) */
+    block_kind kind;
+    int n;
+    int * reaction;
+    int * s1;
+    int * s2;
+} Block_t;
 
 typedef struct _Model_t {
 	int nspecies;
@@ -34,9 +142,65 @@ typedef struct _Model_t {
     propensityFunc * prop;
     double ** params;
     int ** acting_species; /* Some reaction types need these. Such as the propensity depending on another variable */
-    int **rstoichiometry, **pstoichiometry;
+    /* Reactants of each reaction for the propensities, nreactants[j] pairs
+     * (species, order) in reactants[j], by increasing species */
+    int * nreactants;
+    int ** reactants;
+    /* Sparse stoichiometry in compressed rows, reaction j having the entries
+     * k = ptr[j]..ptr[j+1]-1 of its reactants (rspecies, rcoeff), products
+     * (pspecies, pcoeff) and net changes (cspecies, cdelta). The net changes
+     * are also kept by species, in compressed columns: species i changes by
+     * sdelta[k] when reaction sreaction[k] fires, k = sptr[i]..sptr[i+1]-1,
+     * in increasing reaction order. */
+    int *rptr, *rspecies, *rcoeff;
+    int *pptr, *pspecies, *pcoeff;
+    int *cptr, *cspecies, *cdelta;
+    int *sptr, *sreaction, *sdelta;
+    int ninputs;
+    Input_t * inputs;
+    int nevents;
+    Event_t * events;
+    Expr_t * expr; /* NULL without expression rate laws */
+    int nblocks;
+    Block_t * blocks; /* NULL until model_build_blocks() */
+    /* Compiled model (see compile.c), NULL unless loaded */
+    ratesFunc rates;
+    updateFunc update;
+    void * lib;
 } Model_t;
 
+typedef struct _Coordinate_t {
+    /* Linear combination of species counts: sum_k coeffs[k] * state[species[k]] */
+    int nterms;
+    int * species;
+    double * coeffs;
+} Coordinate_t;
+
+typedef enum _relation_t {
+    REL_LT,
+    REL_LE,
+    REL_EQ,
+    REL_NE,
+    REL_GE,
+    REL_GT
+} relation_t;
+
+typedef struct _Condition_t {
+    /* Condition of the form "coordinate <relation> value", i.e. "X >= 400" */
+    Coordinate_t * lhs;
+    relation_t rel;
+    double value;
+} Condition_t;
+
+typedef struct _Sweep_t {
+    /* Grid of parameter values: axis k sets params[reaction[k]][param[k]] to
+     * one of its nvalues[k] values, the points of the grid are all their
+     * combinations (the last axis varying fastest). */
+    int naxes, npoints;
+    int * reaction, * param, * nvalues;
+    double ** values;
+} Sweep_t;
+
 Model_t * model_new();
 
 void free_model(Model_t *model);
@@ -45,6 +209,56 @@ void model_set_allocate(Model_t * model, int nspecies, int nreactions);
 
 void model_print(Model_t * m);
 
+void model_set_reactants(Model_t * m, int reaction, int n, int * species, int * coeffs);
+
+void model_set_products(Model_t * m, int reaction, int n, int * species, int * coeffs);
+
+void model_build_changes(Model_t * m);
+
+void model_fire(Model_t * m, int reaction, double * state);
+
+void model_build_blocks(Model_t * m);
+
+void model_ma_factorial(int k, double * fact, int * limit);
+
+double model_ma_choose(int n, int k);
+
+double model_prop(Model_t * m, int reaction, double * state, double * params);
+
+void model_rates(Model_t * m, double * state, double ** params, double * rates);
+
+void model_update(Model_t * m, int reaction, double * state, double ** params, double * rates);
+
+double ** model_params_copy(Model_t * m);
+
+void free_params(Model_t * m, double ** params);
+
+double input_value(Input_t * in, double t);
+
+void input_bounds(Input_t * in, double t0, double t1, double * lo, double * hi);
+
+void model_set_inputs(Model_t * m, double ** params, double t);
+
+void model_params_reset(Model_t * m, double ** params);
+
+void events_reset(Model_t * m, int * armed);
+
+double events_next_time(Model_t * m, int * armed);
+
+int events_fire(Model_t * m, int * armed, double t, double * state, double ** params);
+
+double coordinate_value(Coordinate_t * c, double * state);
+
+int condition_holds(Condition_t * c, double * state);
+
+void free_coordinate(Coordinate_t * c);
+
+void free_condition(Condition_t * c);
+
+void sweep_point(Sweep_t * sw, int point, double ** params);
+
+void free_sweep(Sweep_t * sw);
+
 double prop_MA(double *x , int nx, int *c, double *params, int * acting_species);
 double prop_HA(double *x , int nx, int *c, double *params, int * acting_species);
 double prop_HI(double *x , int nx, int *c, double *params, int * acting_species);
@@ -54,4 +268,13 @@ double prop_CI(double *x , int nx, int *c, double *params, int * acting_species)
 double prop_HAHAC(double *x , int nx, int *c, double *params, int * acting_species);
 double prop_HAHAHIC(double *x , int nx, int *c, double *params, int * acting_species);
 double prop_TEST(double *x , int nx, int *c, double *params, int * acting_species);
+double prop_EXPR(double *x , int nx, int *c, double *params, int * acting_species);
+
+Expr_t * expr_new(int nreactions);
+
+int expr_node(Expr_t * e, expr_op op, int a, int b, double v);
+
+void expr_finish(Model_t * m);
+
+void expr_rates(Model_t * m, double * x, double ** params, double * rates);
 #endif /* DSSUTILS_H_ */
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+
+/* Nested Runge-Kutta leaps. A scheme with stage coefficients a[0..nstages-1]
+ * takes the step
+ *      d = S L,   L = Pois(tau * rates(x)) - tau * rates(x)
+ *      Y_k = x + a[k-1] (tau S rates(Y_{k-1}) + d),  Y_0 = x,  k = 1..nstages
+ *      x <- max(x + tau S rates(Y_nstages) + d, 0)
+ * where S is the net stoichiometry. Every stage is a single pass over the
+ * species columns of S (nrk_stage), the random numbers are only drawn for L.
+ * The scheme is chosen by name among nrk_builtin, or given by the user as
+ * nrk:coefficients, either a file or a comma separated list.
+ */
+
+static const Nrk_t nrk_builtin[] = {
+    {"nrk3l", 2, {7.215758807926195e-02, 2.344909977008790e-01}},
+    {"nrk3m", 2, {9.302165557301426e-02, 2.753884901801833e-01}},
+    {"nrk3h", 2, {1.274094895306793e-01, 3.328076532903382e-01}},
+    {"nrk5l", 4, {2.454451425521160e-02, 6.587052882448075e-02, 1.391840339679659e-01, 2.749723487080808e-01}},
+    {"nrk5m", 4, {3.468110267353592e-02, 9.340016296214622e-02, 1.958382737990192e-01, 3.562284057303278e-01}},
+    {"nrk5h", 4, {3.512099547699939e-02, 9.333225239662185e-02, 1.940500426863389e-01, 3.552631979151575e-01}}
+};
+
+/* Set once by nrk_method() before any simulation starts, read only afterwards */
+static Nrk_t nrk_scheme;
+
+static void nrk_add_stage(Nrk_t * scheme, char * item){
+    char * end;
+
+    if(scheme->nstages == NRK_MAXSTAGES) {
+        report_error("NRK schemes have at most %d stages\n", NRK_MAXSTAGES);
+        exit(1);
+    }
+    scheme->a[scheme->nstages] = strtod(item, &end);
+    if(end == item || *end != '\0') {
+        report_error("Stage coefficient '%s' not valid\n", item);
+        exit(1);
+    }
+    scheme->nstages++;
+}
+
+static void nrk_parse(Nrk_t * scheme, char * str){
+    /* Stage coefficients from the file str, or from str itself */
+    FILE * in;
+    char line[1024], buf[1024];
+    char * item, * saveptr;
+
+    strncpy(scheme->name, str, sizeof(scheme->name) - 1);
+    scheme->name[sizeof(scheme->name) - 1] = '\0';
+    scheme->nstages = 0;
+    in = fopen(str, "r");
+    if(in != NULL) {
+        while(fgets(line, sizeof(line), in) != NULL) {
+            if(remove_comments(line, '#') < 1 || trim(line) < 1) continue;
+            for(item=strtok_r(line, ", \t", &saveptr); item != NULL; item=strtok_r(NULL, ", \t", &saveptr)) {
+                nrk_add_stage(scheme, item);
+            }
+        }
+        fclose(in);
+    } else {
+        strncpy(buf, str, sizeof(buf) - 1);
+        buf[sizeof(buf) - 1] = '\0';
+        for(item=strtok_r(buf, ",", &saveptr); item != NULL; item=strtok_r(NULL, ",", &saveptr)) {
+            nrk_add_stage(scheme, item);
+        }
+    }
+    if(scheme->nstages == 0) {
+        report_error("NRK scheme '%s' has no stages\n", str);
+        exit(1);
+    }
+}
+
+leapStepFunc nrk_method(char * name){
+    /* Selects the scheme called name, or given by nrk:coefficients, and
+     * returns nrk_step. NULL if name is not an NRK scheme. */
+    int i;
+
+    for(i=0; i<(int) (sizeof(nrk_builtin) / sizeof(Nrk_t)); i++){
+        if(strcmp(name, nrk_builtin[i].name) == 0) {
+            nrk_scheme = nrk_builtin[i];
+            return nrk_step;
+        }
+    }
+    if(strncmp(name, "nrk:", 4) == 0) {
+        nrk_parse(&nrk_scheme, name + 4);
+        return nrk_step;
+    }
+    return NULL;
+}
+
+static void nrk_stage(Model_t * m, const double * restrict v, const double * x,
+        const double * restrict d, double c, double tau, double * y){
+    /* y = x + c (tau S v + d), in a single pass. y may be x */
+    int i, k;
+    const int * restrict sptr = m->sptr;
+    const int * restrict sreaction = m->sreaction;
+    const int * restrict sdelta = m->sdelta;
+    double acc;
+
+    for(i=0; i<m->nspecies; i++){
+        acc = 0;
+        for(k=sptr[i]; k<sptr[i+1]; k++) acc += sdelta[k] * v[sreaction[k]];
+        y[i] = x[i] + c * (tau * acc + d[i]);
+    }
+}
+
+void nrk_step(Leap_t * w, double * state, double tau, Stream_t * s){
+    int i, j, k;
+    Model_t * m = w->m;
+    const int * restrict sptr = m->sptr;
+    const int * restrict sreaction = m->sreaction;
+    const int * restrict sdelta = m->sdelta;
+    double *rates, *L, *d, *y;
+    double accd, accf;
+
+    rates = w->rates;
+    L = w->L;
+    d = w->d;
+    y = w->y;
+
+    model_rates(m, state, w->params, rates);
+    for(j=0; j<m->Nreactions; j++) L[j] = stream_poisson(s, tau * rates[j]) - tau * rates[j];
+    /* d = S L and the first stage, in a single pass */
+    for(i=0; i<m->nspecies; i++){
+        accd = 0;
+        accf = 0;
+        for(k=sptr[i]; k<sptr[i+1]; k++) {
+            accd += sdelta[k] * L[sreaction[k]];
+            accf += sdelta[k] * rates[sreaction[k]];
+        }
+        d[i] = accd;
+        y[i] = state[i] + nrk_scheme.a[0] * (tau * accf + accd);
+    }
+    for(k=1; k<nrk_scheme.nstages; k++){
+        model_rates(m, y, w->params, rates);
+        nrk_stage(m, rates, state, d, nrk_scheme.a[k], tau, y);
+    }
+    model_rates(m, y, w->params, rates);
+    nrk_stage(m, rates, state, d, 1, tau, state);
+    for(i=0; i<m->nspecies; i++){
+        if(state[i] < 0) state[i] = 0;
+    }
+}
+
+void nrk_batch_step(Batch_t * b, double * x, double tau){
+    batch_nrk_step(b, x, tau, &nrk_scheme);
+}
+
+void nrk_team_step(Team_t * t, int p, double * x, double tau){
+    team_nrk_step(t, p, x, tau, &nrk_scheme);
+}
+
+void sim_nrk(Model_t * m, double tt, double tau, Stop_t * stop){
+    sim_leap(m, tt, tau, nrk_step, stop, 1);
+}
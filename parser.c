@@ -16,6 +16,7 @@
  */
 
 #include "parser.h"
+#include <limits.h>
 
 #define REACTION_TYPES 4
 
@@ -37,6 +38,8 @@ typedef enum _parsing_section{
 	PARSING_NONE = 0,
 	PARSING_SPECIES = 1 ,
 	PARSING_REACTIONS = 2,
+	PARSING_INPUTS = 3,
+	PARSING_EVENTS = 4,
 } parsing_section;
 
 void parse_line_species(Model_t * model, List_t * lines) {
@@ -87,7 +90,7 @@ void parse_stoichiometry(char * str, Model_t * model, int ireaction, stoich_type
     int nspecies;
 	int species[2000], stoichiometry[2000];
 	char * aux_str1, * aux_str2, *aux_str3, *saveptr1, *saveptr2;
-	int k;
+	int k, n;
 	aux_str1 = strtok_r (str, "+", &saveptr1);
 	nspecies = 0;
 	while(aux_str1 != NULL) {
@@ -107,28 +110,241 @@ void parse_stoichiometry(char * str, Model_t * model, int ireaction, stoich_type
 			if(k == -1){
 				report_error("Species %s has not been defined", aux_str1);
 				exit(1);
-			} else if(type==REACTANTS){
-			    model->rstoichiometry[ireaction][k] = coeff;
-			} else if(type==PRODUCTS) {
-	            model->pstoichiometry[ireaction][k] = coeff;
 			}
-			species[nspecies] = k;
-			stoichiometry[nspecies] = coeff;
-			nspecies++;
+			/* A repeated species keeps its last coefficient */
+			for(n=0; n<nspecies && species[n] != k; n++);
+			if(n == 2000) {
+				report_error("Too many species in reaction %d\n", ireaction);
+				exit(1);
+			}
+			species[n] = k;
+			stoichiometry[n] = coeff;
+			if(n == nspecies) nspecies++;
 		}
 		aux_str1 = strtok_r (NULL, "+", &saveptr1);
 	}
+	/* Zero coefficients are dropped */
+	for(k=0, n=0; k<nspecies; k++) {
+		if(stoichiometry[k] == 0) continue;
+		species[n] = species[k];
+		stoichiometry[n++] = stoichiometry[k];
+	}
+	if(type == REACTANTS) model_set_reactants(model, ireaction, n, species, stoichiometry);
+	else model_set_products(model, ireaction, n, species, stoichiometry);
     return;
 }
+typedef struct _ExprParser_t {
+    /* Recursive descent over an expression rate law:
+     *      expr    := term (('+'|'-') term)*
+     *      term    := unary (('*'|'/') unary)*
+     *      unary   := '-' unary | power
+     *      power   := primary ('^' unary)?
+     *      primary := number | name | function '(' expr [, expr] ')' | '(' expr ')'
+     * */
+    Model_t * model;
+    int ireaction;
+    char ** names; /* names of the parameters of the reaction */
+    char * str; /* whole expression, for the error messages */
+    char * p;
+} ExprParser_t;
+
+static int parse_expr_sum(ExprParser_t * ep);
+
+static void parse_expr_skip(ExprParser_t * ep) {
+    while(isspace(*ep->p)) ep->p++;
+}
+
+static void parse_expr_expect(ExprParser_t * ep, char c) {
+    parse_expr_skip(ep);
+    if(*ep->p != c) {
+        report_error("Reaction %d: expected '%c' at '%s' in '%s'\n", ep->ireaction, c, ep->p, ep->str);
+        exit(1);
+    }
+    ep->p++;
+}
+
+static int parse_expr_primary(ExprParser_t * ep) {
+    char name[MAX_LINE_SIZE];
+    int n, k, a, b;
+    expr_op op;
+    Expr_t * e = ep->model->expr;
+
+    parse_expr_skip(ep);
+    if(isdigit(*ep->p) || *ep->p == '.') {
+        return expr_node(e, EXPR_CONST, 0, 0, strtod(ep->p, &ep->p));
+    }
+    if(*ep->p == '(') {
+        ep->p++;
+        a = parse_expr_sum(ep);
+        parse_expr_expect(ep, ')');
+        return a;
+    }
+    n = 0;
+    while(isalnum(*ep->p) || *ep->p == '_') name[n++] = *ep->p++;
+    name[n] = '\0';
+    if(n == 0) {
+        report_error("Reaction %d: unexpected '%s' in '%s'\n", ep->ireaction, ep->p, ep->str);
+        exit(1);
+    }
+    parse_expr_skip(ep);
+    if(*ep->p == '(') {
+        if(strcmp(name, "exp") == 0) op = EXPR_EXP;
+        else if(strcmp(name, "log") == 0) op = EXPR_LOG;
+        else if(strcmp(name, "sqrt") == 0) op = EXPR_SQRT;
+        else if(strcmp(name, "pow") == 0) op = EXPR_POW;
+        else if(strcmp(name, "min") == 0) op = EXPR_MIN;
+        else if(strcmp(name, "max") == 0) op = EXPR_MAX;
+        else {
+            report_error("Reaction %d: function '%s' not recognised\n", ep->ireaction, name);
+            exit(1);
+        }
+        ep->p++;
+        a = parse_expr_sum(ep);
+        b = 0;
+        if(op == EXPR_POW || op == EXPR_MIN || op == EXPR_MAX) {
+            parse_expr_expect(ep, ',');
+            b = parse_expr_sum(ep);
+        }
+        parse_expr_expect(ep, ')');
+        return expr_node(e, op, a, b, 0);
+    }
+    /* Parameters of the reaction hide species of the same name. Their loads
+     * are never shared with other reactions, see expr.c */
+    for(k=0; k<ep->model->nparams[ep->ireaction]; k++) {
+        if(strcmp(name, ep->names[k]) == 0) return expr_node(e, EXPR_PARAM, ep->ireaction, k, 0);
+    }
+    k = string_find(name, ep->model->species, ep->model->nspecies);
+    if(k == -1) {
+        report_error("Reaction %d: '%s' is neither a parameter nor a species\n", ep->ireaction, name);
+        exit(1);
+    }
+    return expr_node(e, EXPR_SPECIES, k, 0, 0);
+}
+
+static int parse_expr_unary(ExprParser_t * ep);
+
+static int parse_expr_power(ExprParser_t * ep) {
+    int a;
+
+    a = parse_expr_primary(ep);
+    parse_expr_skip(ep);
+    if(*ep->p == '^') {
+        ep->p++;
+        return expr_node(ep->model->expr, EXPR_POW, a, parse_expr_unary(ep), 0);
+    }
+    return a;
+}
+
+static int parse_expr_unary(ExprParser_t * ep) {
+    parse_expr_skip(ep);
+    if(*ep->p == '-') {
+        ep->p++;
+        return expr_node(ep->model->expr, EXPR_NEG, parse_expr_unary(ep), 0, 0);
+    }
+    return parse_expr_power(ep);
+}
+
+static int parse_expr_product(ExprParser_t * ep) {
+    int a;
+    char c;
+
+    a = parse_expr_unary(ep);
+    while(1) {
+        parse_expr_skip(ep);
+        c = *ep->p;
+        if(c != '*' && c != '/') return a;
+        ep->p++;
+        a = expr_node(ep->model->expr, (c == '*') ? EXPR_MUL : EXPR_DIV, a, parse_expr_unary(ep), 0);
+    }
+}
+
+static int parse_expr_sum(ExprParser_t * ep) {
+    int a;
+    char c;
+
+    a = parse_expr_product(ep);
+    while(1) {
+        parse_expr_skip(ep);
+        c = *ep->p;
+        if(c != '+' && c != '-') return a;
+        ep->p++;
+        a = expr_node(ep->model->expr, (c == '+') ? EXPR_ADD : EXPR_SUB, a, parse_expr_product(ep), 0);
+    }
+}
+
+void parse_expression(char * params_str, Model_t * model, int ireaction) {
+    /* Format is "<expression>; name = value, name = value", i.e.
+     * "k * A * B / (Km + B); k = 0.1, Km = 10". The parameters are numbered
+     * in the order they are given, for inputs, events and sweeps.
+     * */
+    ExprParser_t ep;
+    char * semicolon, * saveptr, * aux_str, * eq;
+    int k, n;
+
+    if(model->expr == NULL) model->expr = expr_new(model->Nreactions);
+    semicolon = strchr(params_str, ';');
+    n = 0;
+    if(semicolon != NULL) {
+        *semicolon = '\0';
+        n = 1;
+        for(aux_str=semicolon+1; *aux_str != '\0'; aux_str++) {
+            if(*aux_str == ',') n++;
+        }
+    }
+    model->params[ireaction] = (double *) malloc((n > 0 ? n : 1) * sizeof(double));
+    model->nparams[ireaction] = n;
+    ep.names = (char **) malloc((n > 0 ? n : 1) * sizeof(char *));
+    if (!model->params[ireaction] || !ep.names) {
+        report_error("allocation failure in parse_expression()");
+        exit(1);
+    }
+    k = 0;
+    if(semicolon != NULL) {
+        for(aux_str=strtok_r(semicolon+1, ",", &saveptr); aux_str != NULL; aux_str=strtok_r(NULL, ",", &saveptr)) {
+            eq = strchr(aux_str, '=');
+            if(eq == NULL) {
+                report_error("Reaction %d: parameter '%s' has no value\n", ireaction, aux_str);
+                exit(1);
+            }
+            *eq = '\0';
+            trim(aux_str);
+            ep.names[k] = aux_str;
+            model->params[ireaction][k] = atof(eq + 1);
+            k++;
+        }
+    }
+    if(k != n) {
+        report_error("Reaction %d: empty parameter\n", ireaction);
+        exit(1);
+    }
+    /* The propensity finds its code from the reaction number */
+    model->acting_species[ireaction] = (int *) malloc(sizeof(int));
+    model->acting_species[ireaction][0] = ireaction;
+
+    ep.model = model;
+    ep.ireaction = ireaction;
+    ep.str = params_str;
+    ep.p = params_str;
+    model->expr->out[ireaction] = parse_expr_sum(&ep);
+    parse_expr_skip(&ep);
+    if(*ep.p != '\0') {
+        report_error("Reaction %d: unexpected '%s' in '%s'\n", ireaction, ep.p, params_str);
+        exit(1);
+    }
+    free((char *) ep.names);
+}
+
 void parse_params(char * params_str, Model_t * model, int ireaction, char *rtype) {
     char * saveptr;
     char * aux_str;
     int idx;
     if (strcmp(rtype, "MA") == 0) {
         model->params[ireaction] = (double *) malloc(sizeof(double));
+        model->nparams[ireaction] = 1;
         model->params[ireaction][0] = atof(params_str);
     } else if ((strcmp(rtype, "HA") == 0) || (strcmp(rtype, "HI") == 0) ) {
         model->params[ireaction] = (double *) malloc(3 * sizeof(double)); /* rate, Ks, coop.*/
+        model->nparams[ireaction] = 3;
         model->acting_species[ireaction] = (int *) malloc(sizeof(int));
         /* Find Which species is acting */
         trim(params_str);
@@ -149,6 +365,7 @@ void parse_params(char * params_str, Model_t * model, int ireaction, char *rtype
     } else if ((strcmp(rtype, "HIHA") == 0) || (strcmp(rtype, "HIHI") == 0) || (strcmp(rtype, "HAHA") == 0) || (strcmp(rtype, "CI") == 0) ) {
         //printf("HIHA\n");
         model->params[ireaction] = (double *) malloc(5 * sizeof(double)); /* rate, Ks1, coop1, Ks2, coop2.*/
+        model->nparams[ireaction] = 5;
         /* for CI: rate, Ks, coop1, gamma, coop2. -> rate * (y1)^coop1 / ((y1)^coop1 + (Ks)^coop2 + (gamma*y2)^coop2) */
 		model->acting_species[ireaction] = (int *) malloc(2 * sizeof(int));
         trim(params_str);
@@ -180,6 +397,7 @@ void parse_params(char * params_str, Model_t * model, int ireaction, char *rtype
         model->params[ireaction][4] = atof(aux_str);
     } else if ((strcmp(rtype, "MAHA") == 0) || (strcmp(rtype, "MAHI") == 0)) {
         model->params[ireaction] = (double *) malloc(3 * sizeof(double)); /* rate, Ks1, coop1.*/
+        model->nparams[ireaction] = 3;
         model->acting_species[ireaction] = (int *) malloc(2 * sizeof(int));
         trim(params_str);
         aux_str = strtok_r(params_str, " ", &saveptr); /* Species name */
@@ -206,6 +424,7 @@ void parse_params(char * params_str, Model_t * model, int ireaction, char *rtype
         model->params[ireaction][2] = atof(aux_str);
     } else if ((strcmp(rtype, "HAHAC") == 0) ) {
         model->params[ireaction] = (double *) malloc(6 * sizeof(double)); /* rate1, Ks1, coop1, rate2, Ks2, coop2.*/
+        model->nparams[ireaction] = 6;
         /* for CI: rate, Ks, coop1, gamma, coop2. -> rate * (y1)^coop1 / ((y1)^coop1 + (Ks)^coop2 + (gamma*y2)^coop2) */
 		model->acting_species[ireaction] = (int *) malloc(2 * sizeof(int));
         trim(params_str);
@@ -239,6 +458,7 @@ void parse_params(char * params_str, Model_t * model, int ireaction, char *rtype
         model->params[ireaction][5] = atof(aux_str);
     } else if ((strcmp(rtype, "HAHAHIC") == 0) ) {
         model->params[ireaction] = (double *) malloc(8 * sizeof(double)); /* rate1, Ks1, coop1, rate2, Ks2, coop2, Ksi, coopi.*/
+        model->nparams[ireaction] = 8;
         /* for CI: rate, Ks, coop1, gamma, coop2. -> rate * (y1)^coop1 / ((y1)^coop1 + (Ks)^coop2 + (gamma*y2)^coop2) */
 		model->acting_species[ireaction] = (int *) malloc(3 * sizeof(int));
         trim(params_str);
@@ -282,6 +502,8 @@ void parse_params(char * params_str, Model_t * model, int ireaction, char *rtype
         model->params[ireaction][6] = atof(aux_str);
         aux_str = strtok_r(NULL, " ", &saveptr); /* cooperativity inhib */
         model->params[ireaction][7] = atof(aux_str);
+    } else if (strcmp(rtype, "EXPR") == 0) {
+        parse_expression(params_str, model, ireaction);
     } else {
         report_error("Reaction type '%s' not recognised", rtype);
         exit(1);
@@ -323,6 +545,8 @@ void parse_line_reactions(Model_t * model, List_t * reactions_lines) {
             model->prop[i] = prop_HAHAHIC;
 		} else if(strcmp(rtype, "HAHAC") == 0) {
             model->prop[i] = prop_HAHAC;
+		} else if(strcmp(rtype, "EXPR") == 0) {
+            model->prop[i] = prop_EXPR;
 	    }else{
 			printf("Warning! Propensity type not detected\n");
 	        model->prop[i] = prop_TEST;
@@ -331,9 +555,409 @@ void parse_line_reactions(Model_t * model, List_t * reactions_lines) {
 	    aux_str = strtok_r (NULL, "|", &saveptr1);
         parse_params(aux_str, model, i, rtype);
 	}
+    model_build_changes(model);
+    model_build_blocks(model);
+    if(model->expr != NULL) expr_finish(model);
+    return;
+}
+
+void parse_line_inputs(Model_t * model, List_t * lines) {
+    /* Input lines have the format:
+     * reaction 0 param 0 = steps 0:1 10:5 20:1 repeat 24
+     * reaction 1 param 0 = table 0:1 5:2 10:0.5
+     * reaction 2 param 0 = sine 10 5 24 0     # mean amplitude period phase
+     * */
+    int i, k, j, p, n, pos;
+    char kind[MAX_LINE_SIZE];
+    char * aux_str, * saveptr;
+    double values[4];
+    Input_t * in;
+
+    if(lines->size == 0) return;
+    model->ninputs = lines->size;
+    model->inputs = (Input_t *) calloc(lines->size, sizeof(Input_t));
+    if (model->inputs == NULL) {
+        report_error("allocation failure in parse_line_inputs()");
+        exit(1);
+    }
+    for(i=0; i<lines->size; i++) {
+        in = model->inputs + i;
+        if(sscanf(lines->items[i], " reaction %d param %d = %s %n", &j, &p, kind, &pos) != 3) {
+            report_error("Input '%s' not correctly formatted\n", lines->items[i]);
+            exit(1);
+        }
+        if(j < 0 || j >= model->Nreactions || p < 0 || p >= model->nparams[j]) {
+            report_error("Input '%s': no such reaction parameter\n", lines->items[i]);
+            exit(1);
+        }
+        for(k=0; k<i; k++) {
+            if(model->inputs[k].reaction == j) {
+                report_error("Reaction %d: only one time dependent parameter per reaction\n", j);
+                exit(1);
+            }
+        }
+        in->reaction = j;
+        in->param = p;
+        in->repeat = 0;
+        if(strcmp(kind, "sine") == 0) {
+            in->type = INPUT_SINE;
+            values[3] = 0;
+            n = sscanf(lines->items[i] + pos, "%lf %lf %lf %lf", values, values+1, values+2, values+3);
+            if(n < 3 || values[2] <= 0) {
+                report_error("Input '%s': sine expects mean amplitude period [phase]\n", lines->items[i]);
+                exit(1);
+            }
+            in->mean = values[0];
+            in->amplitude = values[1];
+            in->period = values[2];
+            in->phase = values[3];
+        } else if(strcmp(kind, "steps") == 0 || strcmp(kind, "table") == 0) {
+            in->type = (strcmp(kind, "steps") == 0) ? INPUT_STEPS : INPUT_TABLE;
+            in->t = dvector(MAX_LINE_SIZE / 4);
+            in->v = dvector(MAX_LINE_SIZE / 4);
+            in->npoints = 0;
+            for(aux_str=strtok_r(lines->items[i] + pos, " ", &saveptr); aux_str != NULL; aux_str=strtok_r(NULL, " ", &saveptr)) {
+                if(strcmp(aux_str, "repeat") == 0) {
+                    aux_str = strtok_r(NULL, " ", &saveptr);
+                    in->repeat = (aux_str != NULL) ? atof(aux_str) : 0;
+                    if(in->repeat <= 0) {
+                        report_error("Input '%s': repeat expects a positive period\n", lines->items[i]);
+                        exit(1);
+                    }
+                } else if(sscanf(aux_str, "%lf:%lf", in->t + in->npoints, in->v + in->npoints) == 2) {
+                    if(in->npoints > 0 && in->t[in->npoints] <= in->t[in->npoints-1]) {
+                        report_error("Input '%s': times must be increasing\n", lines->items[i]);
+                        exit(1);
+                    }
+                    in->npoints++;
+                } else {
+                    report_error("Input '%s': '%s' is not a time:value pair\n", lines->items[i], aux_str);
+                    exit(1);
+                }
+            }
+            if(in->npoints == 0) {
+                report_error("Input '%s' has no points\n", lines->items[i]);
+                exit(1);
+            }
+        } else {
+            report_error("Input type '%s' not recognised\n", kind);
+            exit(1);
+        }
+    }
     return;
 }
 
+void parse_action(Model_t * model, Action_t * a, char * str) {
+    /* Format is "X = 100", "X += 50", "X -= 50" or "reaction 2 param 0 = 0.1" */
+    char * op;
+    int pos;
+
+    if(sscanf(str, " reaction %d param %d = %lf %n", &a->reaction, &a->param, &a->value, &pos) == 3) {
+        if(a->reaction < 0 || a->reaction >= model->Nreactions || a->param < 0
+                || a->param >= model->nparams[a->reaction]) {
+            report_error("Action '%s': no such reaction parameter\n", str);
+            exit(1);
+        }
+        a->type = ACTION_SET_PARAM;
+        return;
+    }
+    op = strchr(str, '=');
+    if(op == NULL || op == str) {
+        report_error("Action '%s' not correctly formatted\n", str);
+        exit(1);
+    }
+    a->type = ACTION_SET_SPECIES;
+    a->value = atof(op + 1);
+    if(op[-1] == '+' || op[-1] == '-') {
+        a->type = ACTION_ADD_SPECIES;
+        if(op[-1] == '-') a->value = -a->value;
+        op--;
+    }
+    *op = '\0';
+    trim(str);
+    a->species = string_find(str, model->species, model->nspecies);
+    if(a->species == -1) {
+        report_error("Species '%s' not found\n", str);
+        exit(1);
+    }
+}
+
+void parse_line_events(Model_t * model, List_t * lines) {
+    /* Event lines have the format:
+     * at 10: X = 100, reaction 2 param 0 = 0.5     # fires once, at t = 10
+     * when X >= 400: Drug += 50                    # fires when X reaches 400
+     * Actions are applied in order. Triggered events fire again once their
+     * condition has been false.
+     * */
+    int i, n;
+    char * colon, * aux_str, * saveptr;
+    Event_t * e;
+
+    if(lines->size == 0) return;
+    model->nevents = lines->size;
+    model->events = (Event_t *) calloc(lines->size, sizeof(Event_t));
+    if (model->events == NULL) {
+        report_error("allocation failure in parse_line_events()");
+        exit(1);
+    }
+    for(i=0; i<lines->size; i++) {
+        e = model->events + i;
+        colon = strchr(lines->items[i], ':');
+        if(colon == NULL) {
+            report_error("Event '%s' has no actions\n", lines->items[i]);
+            exit(1);
+        }
+        *colon = '\0';
+        trim(lines->items[i]);
+        if(strncmp(lines->items[i], "at ", 3) == 0) {
+            e->trigger = NULL;
+            if(sscanf(lines->items[i] + 3, "%lf %n", &e->time, &n) != 1 || lines->items[i][3 + n] != '\0') {
+                report_error("Event 'at %s': time not correctly formatted\n", lines->items[i] + 3);
+                exit(1);
+            }
+        } else if(strncmp(lines->items[i], "when ", 5) == 0) {
+            e->time = INFINITY;
+            e->trigger = parse_condition(model, lines->items[i] + 5);
+        } else {
+            report_error("Event '%s' must start with 'at' or 'when'\n", lines->items[i]);
+            exit(1);
+        }
+        /* Actions are separated by commas */
+        e->nactions = 1;
+        for(aux_str=colon+1; *aux_str != '\0'; aux_str++) {
+            if(*aux_str == ',') e->nactions++;
+        }
+        e->actions = (Action_t *) malloc(e->nactions * sizeof(Action_t));
+        if (e->actions == NULL) {
+            report_error("allocation failure in parse_line_events()");
+            exit(1);
+        }
+        n = 0;
+        for(aux_str=strtok_r(colon+1, ",", &saveptr); aux_str != NULL; aux_str=strtok_r(NULL, ",", &saveptr)) {
+            parse_action(model, e->actions + n, aux_str);
+            n++;
+        }
+        if(n != e->nactions) {
+            report_error("Event '%s' has an empty action\n", lines->items[i]);
+            exit(1);
+        }
+    }
+    return;
+}
+
+Coordinate_t * parse_coordinate(Model_t * model, char * str) {
+    /* Format is "X", "2*X + B" or "X - 0.5*B". A species may appear more than
+     * once, its coefficients are then added up.
+     * */
+    Coordinate_t * c;
+    char name[MAX_LINE_SIZE];
+    char * p, * end;
+    double sign, coeff;
+    int k, len, idx;
+
+    c = (Coordinate_t *) malloc(sizeof(Coordinate_t));
+    if (!c) {
+        report_error("allocation failure in parse_coordinate()");
+        exit(1);
+    }
+    c->species = ivector(model->nspecies);
+    c->coeffs = dzeros(model->nspecies);
+    c->nterms = 0;
+
+    p = str;
+    sign = 1;
+    while(*p != '\0') {
+        if(isspace(*p) || *p == '+') {
+            p++;
+            continue;
+        }
+        if(*p == '-') {
+            sign = -sign;
+            p++;
+            continue;
+        }
+        coeff = 1;
+        if(isdigit(*p) || *p == '.') {
+            coeff = strtod(p, &end);
+            p = end;
+            while(isspace(*p)) p++;
+            if(*p != '*') {
+                report_error("Coordinate '%s': expected '*' after coefficient\n", str);
+                exit(1);
+            }
+            p++;
+            while(isspace(*p)) p++;
+        }
+        len = 0;
+        while(*p != '\0' && !isspace(*p) && *p != '+' && *p != '-' && *p != '*') {
+            name[len++] = *p++;
+        }
+        name[len] = '\0';
+        idx = string_find(name, model->species, model->nspecies);
+        if(idx == -1) {
+            report_error("Species '%s' not found\n", name);
+            exit(1);
+        }
+        for(k=0; k<c->nterms; k++) {
+            if(c->species[k] == idx) break;
+        }
+        if(k == c->nterms) {
+            c->species[k] = idx;
+            c->nterms++;
+        }
+        c->coeffs[k] += sign * coeff;
+        sign = 1;
+    }
+    if(c->nterms == 0) {
+        report_error("Coordinate '%s' has no species\n", str);
+        exit(1);
+    }
+    return c;
+}
+
+Condition_t * parse_condition(Model_t * model, char * str) {
+    /* Format is "<coordinate> <relation> <value>", i.e. "X >= 400".
+     * Valid relations are <, <=, ==, !=, >= and >
+     * */
+    Condition_t * cond;
+    char lhs[MAX_LINE_SIZE];
+    char * op;
+    int oplen;
+
+    cond = (Condition_t *) malloc(sizeof(Condition_t));
+    if (!cond) {
+        report_error("allocation failure in parse_condition()");
+        exit(1);
+    }
+    op = strpbrk(str, "<>=!");
+    if(op == NULL) {
+        report_error("Condition '%s' has no relation\n", str);
+        exit(1);
+    }
+    oplen = (op[1] == '=') ? 2 : 1;
+    if(strncmp(op, "<=", 2) == 0) cond->rel = REL_LE;
+    else if(strncmp(op, ">=", 2) == 0) cond->rel = REL_GE;
+    else if(strncmp(op, "==", 2) == 0) cond->rel = REL_EQ;
+    else if(strncmp(op, "!=", 2) == 0) cond->rel = REL_NE;
+    else if(op[0] == '<') cond->rel = REL_LT;
+    else if(op[0] == '>') cond->rel = REL_GT;
+    else {
+        report_error("Condition '%s' has no valid relation\n", str);
+        exit(1);
+    }
+    strncpy(lhs, str, op - str);
+    lhs[op - str] = '\0';
+    cond->lhs = parse_coordinate(model, lhs);
+    cond->value = atof(op + oplen);
+    return cond;
+}
+
+static void parse_sweep_axis(Model_t * model, Sweep_t * sw, char * str) {
+    /* Format is "reaction 3 param 0 in logspace(1e-4, 1e-2, 50)", with
+     * linspace(first, last, n) or a list of values "0.1, 0.2, 0.5" instead
+     * */
+    int k, n, pos, reaction, param, logscale;
+    double a, b;
+    double * v;
+    char * p, * end;
+
+    if(sscanf(str, " reaction %d param %d in %n", &reaction, &param, &pos) != 2) {
+        report_error("Sweep '%s' not correctly formatted\n", str);
+        exit(1);
+    }
+    if(reaction < 0 || reaction >= model->Nreactions || param < 0 || param >= model->nparams[reaction]) {
+        report_error("Sweep '%s': no such reaction parameter\n", str);
+        exit(1);
+    }
+    p = str + pos;
+    logscale = (strncmp(p, "logspace", 8) == 0);
+    if(sscanf(p, "logspace ( %lf , %lf , %d )", &a, &b, &n) == 3
+            || sscanf(p, "linspace ( %lf , %lf , %d )", &a, &b, &n) == 3) {
+        if(n < 1 || (logscale && (a <= 0 || b <= 0))) {
+            report_error("Sweep '%s': range not valid\n", str);
+            exit(1);
+        }
+        v = dvector(n);
+        for(k=0; k<n; k++) {
+            if(n == 1) v[k] = a;
+            else if(logscale) v[k] = a * pow(b / a, (double) k / (n - 1));
+            else v[k] = a + (b - a) * k / (n - 1);
+        }
+    } else {
+        n = 1;
+        for(end=p; *end != '\0'; end++) {
+            if(*end == ',') n++;
+        }
+        v = dvector(n);
+        for(k=0; k<n; k++) {
+            v[k] = strtod(p, &end);
+            while(isspace(*end)) end++;
+            if(end == p || (*end != ',' && *end != '\0')) {
+                report_error("Sweep '%s': values not valid\n", str);
+                exit(1);
+            }
+            p = end + 1;
+        }
+    }
+    k = sw->naxes++;
+    sw->reaction = (int *) realloc(sw->reaction, sw->naxes * sizeof(int));
+    sw->param = (int *) realloc(sw->param, sw->naxes * sizeof(int));
+    sw->nvalues = (int *) realloc(sw->nvalues, sw->naxes * sizeof(int));
+    sw->values = (double **) realloc(sw->values, sw->naxes * sizeof(double *));
+    if (!sw->reaction || !sw->param || !sw->nvalues || !sw->values) {
+        report_error("allocation failure in parse_sweep()");
+        exit(1);
+    }
+    sw->reaction[k] = reaction;
+    sw->param[k] = param;
+    sw->nvalues[k] = n;
+    sw->values[k] = v;
+    if(sw->npoints > INT_MAX / n) {
+        report_error("Sweep grid too large\n");
+        exit(1);
+    }
+    sw->npoints *= n;
+}
+
+Sweep_t * parse_sweep(Model_t * model, char * str) {
+    /* str is either a file with one sweep axis per line or the axes separated
+     * by ';'. The grid holds every combination of the values of the axes.
+     * */
+    Sweep_t * sw;
+    FILE * in;
+    char line[MAX_LINE_SIZE];
+    char * item, * saveptr;
+
+    sw = (Sweep_t *) malloc(sizeof(Sweep_t));
+    if (!sw) {
+        report_error("allocation failure in parse_sweep()");
+        exit(1);
+    }
+    sw->naxes = 0;
+    sw->npoints = 1;
+    sw->reaction = NULL;
+    sw->param = NULL;
+    sw->nvalues = NULL;
+    sw->values = NULL;
+    in = fopen(str, "r");
+    if(in != NULL) {
+        while(fgets(line, MAX_LINE_SIZE, in) != NULL) {
+            if(remove_comments(line, '#') < 1 || trim(line) < 1) continue;
+            parse_sweep_axis(model, sw, line);
+        }
+        fclose(in);
+    } else {
+        for(item=strtok_r(str, ";", &saveptr); item != NULL; item=strtok_r(NULL, ";", &saveptr)) {
+            parse_sweep_axis(model, sw, item);
+        }
+    }
+    if(sw->naxes == 0) {
+        report_error("Sweep '%s' has no axes\n", str);
+        exit(1);
+    }
+    return sw;
+}
+
 Model_t * load_model_from_file(char * fname) {
 	FILE * in;
 	Model_t * model;
@@ -342,11 +966,13 @@ Model_t * load_model_from_file(char * fname) {
 	int lastchr; /* Last character read */
 	int linenum, len; /* line number and length*/
     parsing_section section;
-    List_t * species_lines, * reactions_lines;
+    List_t * species_lines, * reactions_lines, * inputs_lines, * events_lines;
 
 	/* Lists initialisation */
     species_lines = list_new();
     reactions_lines = list_new();
+    inputs_lines = list_new();
+    events_lines = list_new();
 
     /* Here we get the strings for the species (and its initial conditions),
      * and the reactions.
@@ -388,6 +1014,18 @@ Model_t * load_model_from_file(char * fname) {
 		        	exit(1);
 				}
 				section = PARSING_REACTIONS;
+			} else if(strcmp(section_name, "Inputs") == 0) {
+				if(section != PARSING_REACTIONS && section != PARSING_EVENTS){
+		        	report_error("In file: %s, line %d: Inputs must be specified after reactions", fname, linenum);
+		        	exit(1);
+				}
+				section = PARSING_INPUTS;
+			} else if(strcmp(section_name, "Events") == 0) {
+				if(section != PARSING_REACTIONS && section != PARSING_INPUTS){
+		        	report_error("In file: %s, line %d: Events must be specified after reactions", fname, linenum);
+		        	exit(1);
+				}
+				section = PARSING_EVENTS;
 	        } else {
 	        	report_error("In file: %s, section %s not valid", fname, section_name);
 	        	exit(1);
@@ -396,6 +1034,10 @@ Model_t * load_model_from_file(char * fname) {
             list_append(species_lines, line);
 		} else if(section == PARSING_REACTIONS){
 			list_append(reactions_lines, line);
+		} else if(section == PARSING_INPUTS){
+			list_append(inputs_lines, line);
+		} else if(section == PARSING_EVENTS){
+			list_append(events_lines, line);
 		} else {
 			report_error("Line not correctly formatted!");
 			exit(1);
@@ -407,6 +1049,8 @@ Model_t * load_model_from_file(char * fname) {
     model_set_allocate(model, species_lines->size, reactions_lines->size);
     parse_line_species(model, species_lines);
     parse_line_reactions(model, reactions_lines);
+    parse_line_inputs(model, inputs_lines);
+    parse_line_events(model, events_lines);
 
 	return model;
 }
@@ -28,4 +28,10 @@
 
 Model_t * load_model_from_file(char * fname);
 
+Coordinate_t * parse_coordinate(Model_t * model, char * str);
+
+Condition_t * parse_condition(Model_t * model, char * str);
+
+Sweep_t * parse_sweep(Model_t * model, char * str);
+
 #endif /* PARSER_H_ */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+#include<float.h>
+#include<gsl/gsl_cdf.h>
+
+#define POISSON_SEARCH_MAX 30
+
+unsigned int poisson_icdf(double u, double mu){
+    /* Inverse of the Poisson(mu) CDF: smallest k with P(X <= k) >= u.
+     * Small means are inverted by sequential search from 0. Large ones start
+     * from the Cornish-Fisher normal approximation and walk to the exact
+     * quantile, which takes O(1) steps on average.
+     */
+    unsigned int k;
+    double p, F, z, k0;
+
+    if(mu <= 0 || u <= 0) return 0;
+    if(u >= 1) u = 1 - DBL_EPSILON;
+    if(mu < POISSON_SEARCH_MAX){
+        k = 0;
+        p = exp(-mu);
+        F = p;
+        while(F < u && p > 0){
+            k++;
+            p *= mu / k;
+            F += p;
+        }
+        return k;
+    }
+    z = gsl_cdf_ugaussian_Pinv(u);
+    k0 = floor(mu + sqrt(mu) * z + (z * z - 1) / 6 + 0.5);
+    k = (k0 < 0) ? 0 : (unsigned int) k0;
+    F = gsl_cdf_poisson_P(k, mu);
+    p = gsl_ran_poisson_pdf(k, mu);
+    if(F < u){
+        while(F < u && p > 0){
+            k++;
+            p *= mu / k;
+            F += p;
+        }
+    } else {
+        while(k > 0 && F - p >= u){
+            F -= p;
+            p *= k / mu;
+            k--;
+        }
+    }
+    return k;
+}
+
+unsigned int stream_poisson(Stream_t * s, double mu){
+    double u;
+
+    if(s->u != NULL && s->next < s->nu){
+        u = s->u[s->next++];
+    } else if(s->inverse){
+        u = gsl_rng_uniform(s->r);
+        if(s->antithetic) u = 1 - u;
+    } else {
+        return gsl_ran_poisson(s->r, mu);
+    }
+    return poisson_icdf(u, mu);
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+#include<pthread.h>
+
+/* Trajectory pool. nthreads workers claim trajectories 0..ntraj-1 in order;
+ * run(arg, thread, k) simulates trajectory k with the workspace of thread and
+ * keeps its result in slot k % nslots, nslots = pool_slots(nthreads, ntraj).
+ * fold(arg, thread, k), if not NULL, merges the result of slot k % nslots into
+ * the shared one. Folds are serialised and happen in the order of k, so with
+ * per-trajectory random streams the output does not depend on the number of
+ * threads. The slots are a reorder buffer: the thread that finishes the
+ * oldest unfolded trajectory folds it and every finished one after it, and
+ * workers only wait for a free slot, i.e. when a slow trajectory is nslots
+ * behind the newest one.
+ */
+
+#define POOL_SLOTS 4
+
+typedef struct _Pool_t {
+    int ntraj, nslots, next, nextfold, folding;
+    int * done;
+    trajJob run, fold;
+    void * arg;
+    pthread_mutex_t lock;
+    pthread_cond_t folded;
+} Pool_t;
+
+typedef struct _Worker_t {
+    Pool_t * pool;
+    int thread;
+} Worker_t;
+
+int pool_slots(int nthreads, int ntraj){
+    /* Result slots the callers of pool_run() have to keep */
+    int nslots;
+
+    nslots = (nthreads > 1) ? POOL_SLOTS * nthreads : 1;
+    if(nslots > ntraj) nslots = ntraj;
+    if(nslots < 1) nslots = 1;
+    return nslots;
+}
+
+static void * pool_worker(void * varg){
+    int k;
+    Worker_t * wk = (Worker_t *) varg;
+    Pool_t * p = wk->pool;
+
+    pthread_mutex_lock(&p->lock);
+    while(p->next < p->ntraj){
+        if(p->fold != NULL && p->next >= p->nextfold + p->nslots){
+            pthread_cond_wait(&p->folded, &p->lock);
+            continue;
+        }
+        k = p->next++;
+        pthread_mutex_unlock(&p->lock);
+        p->run(p->arg, wk->thread, k);
+        pthread_mutex_lock(&p->lock);
+        if(p->fold == NULL) continue;
+        p->done[k % p->nslots] = 1;
+        if(p->folding) continue;
+        /* Folds run unlocked, so that the others can claim and finish
+         * trajectories meanwhile, but only one thread folds at a time */
+        p->folding = 1;
+        while(p->nextfold < p->ntraj && p->done[p->nextfold % p->nslots]){
+            p->done[p->nextfold % p->nslots] = 0;
+            pthread_mutex_unlock(&p->lock);
+            p->fold(p->arg, wk->thread, p->nextfold);
+            pthread_mutex_lock(&p->lock);
+            p->nextfold++;
+            pthread_cond_broadcast(&p->folded);
+        }
+        p->folding = 0;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+void pool_run(int nthreads, int ntraj, trajJob run, trajJob fold, void * arg){
+    int i, k;
+    Pool_t p;
+    Worker_t * wk;
+    pthread_t * th;
+
+    if(nthreads <= 1){
+        for(k=0; k<ntraj; k++){
+            run(arg, 0, k);
+            if(fold != NULL) fold(arg, 0, k);
+        }
+        return;
+    }
+    p.ntraj = ntraj;
+    p.nslots = pool_slots(nthreads, ntraj);
+    p.next = 0;
+    p.nextfold = 0;
+    p.folding = 0;
+    p.done = ivector(p.nslots);
+    for(k=0; k<p.nslots; k++) p.done[k] = 0;
+    p.run = run;
+    p.fold = fold;
+    p.arg = arg;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.folded, NULL);
+    wk = (Worker_t *) malloc(nthreads * sizeof(Worker_t));
+    th = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    if (!wk || !th) {
+        report_error("allocation failure in pool_run()");
+        exit(1);
+    }
+    for(i=0; i<nthreads; i++){
+        wk[i].pool = &p;
+        wk[i].thread = i;
+        if(pthread_create(th + i, NULL, pool_worker, wk + i) != 0){
+            report_error("Could not start thread %d\n", i);
+            exit(1);
+        }
+    }
+    for(i=0; i<nthreads; i++) pthread_join(th[i], NULL);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.folded);
+    free_ivector(p.done);
+    free((char *) wk);
+    free((char *) th);
+}
+
+/* Work stealing pool, for tasks of very different costs. Every worker starts
+ * with a contiguous range of the tasks and runs it front to back; once it is
+ * empty, the worker steals the back half of the range with most tasks left.
+ * There are no folds, run(arg, thread, k) has to keep the result of task k
+ * apart, and the order of the tasks depends on the threads.
+ */
+
+typedef struct _Range_t {
+    int lo, hi;
+    pthread_mutex_t lock;
+} Range_t;
+
+typedef struct _Steal_t {
+    int nthreads;
+    Range_t * ranges;
+    trajJob run;
+    void * arg;
+} Steal_t;
+
+typedef struct _Thief_t {
+    Steal_t * pool;
+    int thread;
+} Thief_t;
+
+static int steal_left(Range_t * rg){
+    int left;
+
+    pthread_mutex_lock(&rg->lock);
+    left = rg->hi - rg->lo;
+    pthread_mutex_unlock(&rg->lock);
+    return left;
+}
+
+static int steal_next(Steal_t * p, int thread){
+    /* Next task of thread, -1 once every range is empty */
+    int i, k, left, most, victim;
+    Range_t * own = p->ranges + thread;
+    Range_t * rg;
+
+    pthread_mutex_lock(&own->lock);
+    k = (own->lo < own->hi) ? own->lo++ : -1;
+    pthread_mutex_unlock(&own->lock);
+    while(k == -1){
+        victim = -1;
+        most = 0;
+        for(i=0; i<p->nthreads; i++){
+            left = steal_left(p->ranges + i);
+            if(left > most){
+                most = left;
+                victim = i;
+            }
+        }
+        if(victim == -1) return -1;
+        /* The victim may have run out in the meantime, then look again */
+        rg = p->ranges + victim;
+        pthread_mutex_lock(&rg->lock);
+        left = rg->hi - rg->lo;
+        if(left > 0){
+            k = rg->hi - (left + 1) / 2;
+            left = rg->hi - k;
+            rg->hi = k;
+        }
+        pthread_mutex_unlock(&rg->lock);
+        if(k != -1){
+            pthread_mutex_lock(&own->lock);
+            own->lo = k + 1;
+            own->hi = k + left;
+            pthread_mutex_unlock(&own->lock);
+        }
+    }
+    return k;
+}
+
+static void * steal_worker(void * varg){
+    int k;
+    Thief_t * th = (Thief_t *) varg;
+
+    while((k = steal_next(th->pool, th->thread)) != -1) th->pool->run(th->pool->arg, th->thread, k);
+    return NULL;
+}
+
+void pool_steal(int nthreads, int ntasks, trajJob run, void * arg){
+    int i, k;
+    Steal_t p;
+    Thief_t * th;
+    pthread_t * tid;
+
+    if(nthreads <= 1){
+        for(k=0; k<ntasks; k++) run(arg, 0, k);
+        return;
+    }
+    p.nthreads = nthreads;
+    p.run = run;
+    p.arg = arg;
+    p.ranges = (Range_t *) malloc(nthreads * sizeof(Range_t));
+    th = (Thief_t *) malloc(nthreads * sizeof(Thief_t));
+    tid = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    if (!p.ranges || !th || !tid) {
+        report_error("allocation failure in pool_steal()");
+        exit(1);
+    }
+    for(i=0; i<nthreads; i++){
+        p.ranges[i].lo = (int) ((long) ntasks * i / nthreads);
+        p.ranges[i].hi = (int) ((long) ntasks * (i + 1) / nthreads);
+        pthread_mutex_init(&p.ranges[i].lock, NULL);
+    }
+    for(i=0; i<nthreads; i++){
+        th[i].pool = &p;
+        th[i].thread = i;
+        if(pthread_create(tid + i, NULL, steal_worker, th + i) != 0){
+            report_error("Could not start thread %d\n", i);
+            exit(1);
+        }
+    }
+    for(i=0; i<nthreads; i++) pthread_join(tid[i], NULL);
+    for(i=0; i<nthreads; i++) pthread_mutex_destroy(&p.ranges[i].lock);
+    free((char *) p.ranges);
+    free((char *) th);
+    free((char *) tid);
+}
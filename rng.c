@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "rng.h"
+#include "utils.h"
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+/* Written once by rng_seed() before any thread starts, read only afterwards */
+static uint32_t philox_key[2];
+
+typedef struct {
+    uint32_t ctr[4], out[4];
+    int n;
+} philox_state_t;
+
+static void philox_block(const uint32_t * ctr, uint32_t * out){
+    int i;
+    uint32_t k0, k1, x0, x1, x2, x3;
+    uint64_t p0, p1;
+
+    x0 = ctr[0];
+    x1 = ctr[1];
+    x2 = ctr[2];
+    x3 = ctr[3];
+    k0 = philox_key[0];
+    k1 = philox_key[1];
+    for(i=0; i<PHILOX_ROUNDS; i++){
+        p0 = (uint64_t) PHILOX_M0 * x0;
+        p1 = (uint64_t) PHILOX_M1 * x2;
+        x0 = (uint32_t) (p1 >> 32) ^ x1 ^ k0;
+        x1 = (uint32_t) p1;
+        x2 = (uint32_t) (p0 >> 32) ^ x3 ^ k1;
+        x3 = (uint32_t) p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = x0;
+    out[1] = x1;
+    out[2] = x2;
+    out[3] = x3;
+}
+
+static void philox_set(void * vstate, unsigned long int stream){
+    philox_state_t * state = (philox_state_t *) vstate;
+
+    state->ctr[0] = 0;
+    state->ctr[1] = 0;
+    state->ctr[2] = (uint32_t) stream;
+    state->ctr[3] = (uint32_t) ((uint64_t) stream >> 32);
+    state->n = 4;
+}
+
+static unsigned long int philox_get(void * vstate){
+    philox_state_t * state = (philox_state_t *) vstate;
+
+    if(state->n == 4){
+        philox_block(state->ctr, state->out);
+        /* 64 bit block counter in the lower half */
+        if(++state->ctr[0] == 0) state->ctr[1]++;
+        state->n = 0;
+    }
+    return state->out[state->n++];
+}
+
+static double philox_get_double(void * vstate){
+    return philox_get(vstate) / 4294967296.0;
+}
+
+static const gsl_rng_type philox_type = {
+    "philox4x32",
+    0xffffffffUL,
+    0,
+    sizeof(philox_state_t),
+    &philox_set,
+    &philox_get,
+    &philox_get_double
+};
+
+const gsl_rng_type * gsl_rng_philox = &philox_type;
+
+unsigned long rng_seed(unsigned long seed){
+    FILE * f;
+
+    if(seed == 0){
+        f = fopen("/dev/urandom", "rb");
+        if(f == NULL || fread(&seed, sizeof(seed), 1, f) != 1){
+            report_warning("Could not read /dev/urandom, seeding from the clock\n");
+            seed = (unsigned long) time(NULL) ^ ((unsigned long) getpid() << 16) ^ (unsigned long) clock();
+        }
+        if(f != NULL) fclose(f);
+    }
+    philox_key[0] = (uint32_t) seed;
+    philox_key[1] = (uint32_t) ((uint64_t) seed >> 32);
+    return seed;
+}
+
+gsl_rng * rng_new(unsigned long stream){
+    gsl_rng * r;
+
+    r = gsl_rng_alloc(gsl_rng_philox);
+    gsl_rng_set(r, stream);
+    return r;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RNG_H_
+#define RNG_H_
+
+#include<gsl/gsl_rng.h>
+
+/* Counter-based random streams: Philox4x32-10 (Salmon et al. 2011) as a GSL
+ * generator. The key is the seed of the run, set once with rng_seed() before
+ * any generator is allocated, and the upper half of the counter is the stream
+ * number given to gsl_rng_set(), so that streams are independent by
+ * construction and each one has 2^66 numbers. */
+
+extern const gsl_rng_type * gsl_rng_philox;
+
+unsigned long rng_seed(unsigned long seed);
+/* Set the seed of the run, a random one from /dev/urandom if seed is 0.
+ * Returns the seed used */
+gsl_rng * rng_new(unsigned long stream);
+/* Allocate a generator positioned at the start of stream */
+
+#endif /* RNG_H_ */
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+
+/* Coupled finite difference sensitivities (Anderson 2012).
+ * For each parameter theta = params[j][k], a nominal process X (theta) and a
+ * perturbed process Z (theta + h) are simulated together with the modified
+ * next reaction method. Every reaction r is split into three unit-rate Poisson
+ * streams sharing the random time change:
+ *      min(a_r(X), b_r(Z))      fires r in both processes,
+ *      a_r(X) - min(...)        fires r in X only,
+ *      b_r(Z) - min(...)        fires r in Z only,
+ * which keeps X and Z close and the variance of (Z(tt) - X(tt)) / h small.
+ */
+
+#define SENS_REL_STEP 1e-2
+
+static void cfd_pair(Model_t * m, double tt, double ** pz, gsl_rng * r,
+        double * x, double * z, double * a, double * b,
+        double * lambda, double * T, double * P){
+    int i, j, k, nreactions, nspecies, nchannels;
+    double t, dt, dtk, c;
+
+    nreactions = m->Nreactions;
+    nspecies = m->nspecies;
+    nchannels = 3 * nreactions;
+    for(i=0; i<nspecies; i++){
+        x[i] = (double) m->istate[i];
+        z[i] = (double) m->istate[i];
+    }
+    for(k=0; k<nchannels; k++){
+        T[k] = 0;
+        P[k] = -log(gsl_rng_uniform_pos(r));
+    }
+    t = 0;
+    while(1){
+        for(j=0; j<nreactions; j++){
+            a[j] = m->prop[j](x, m->nreactants[j], m->reactants[j], m->params[j], m->acting_species[j]);
+            b[j] = m->prop[j](z, m->nreactants[j], m->reactants[j], pz[j], m->acting_species[j]);
+            c = (a[j] < b[j]) ? a[j] : b[j];
+            lambda[3*j] = c;
+            lambda[3*j + 1] = a[j] - c;
+            lambda[3*j + 2] = b[j] - c;
+        }
+        /* Next channel to fire */
+        k = -1;
+        dt = INFINITY;
+        for(i=0; i<nchannels; i++){
+            if(lambda[i] <= 0) continue;
+            dtk = (P[i] - T[i]) / lambda[i];
+            if(dtk < dt){
+                dt = dtk;
+                k = i;
+            }
+        }
+        if(k == -1 || t + dt >= tt) return;
+        t += dt;
+        for(i=0; i<nchannels; i++) T[i] += lambda[i] * dt;
+        P[k] += -log(gsl_rng_uniform_pos(r));
+
+        j = k / 3;
+        if(k % 3 != 2) model_fire(m, j, x);
+        if(k % 3 != 1) model_fire(m, j, z);
+    }
+}
+
+void sim_sensitivity(Model_t * m, double tt, int ntraj){
+    /* Prints dE[X_i(tt)]/dtheta for every parameter of every reaction,
+     * with its standard error, estimated from ntraj coupled pairs. */
+    int i, j, k, n, nspecies, nreactions;
+    double h, d;
+    double *x, *z, *a, *b, *lambda, *T, *P, *pert, *s1, *s2;
+    double **pz;
+    gsl_rng * r;
+
+    if(ntraj < 2){
+        report_error("Sensitivities require at least two trajectory pairs\n");
+        exit(1);
+    }
+    nspecies = m->nspecies;
+    nreactions = m->Nreactions;
+    x = dvector(nspecies);
+    z = dvector(nspecies);
+    s1 = dvector(nspecies);
+    s2 = dvector(nspecies);
+    a = dvector(nreactions);
+    b = dvector(nreactions);
+    lambda = dvector(3 * nreactions);
+    T = dvector(3 * nreactions);
+    P = dvector(3 * nreactions);
+    pz = (double **) malloc(nreactions * sizeof(double *));
+    if (!pz) {
+        report_error("allocation failure in sim_sensitivity()");
+        exit(1);
+    }
+
+    r = rng_new(0);
+
+    printf("#reaction param value");
+    for(i=0; i<nspecies; i++) printf(" d%s se(d%s)", m->species[i], m->species[i]);
+    printf("\n");
+    for(j=0; j<nreactions; j++){
+        /* Only reaction j sees the perturbed parameters */
+        for(i=0; i<nreactions; i++) pz[i] = m->params[i];
+        pert = dvector(m->nparams[j]);
+        memcpy(pert, m->params[j], m->nparams[j] * sizeof(double));
+        pz[j] = pert;
+        for(k=0; k<m->nparams[j]; k++){
+            h = (m->params[j][k] != 0) ? SENS_REL_STEP * fabs(m->params[j][k]) : SENS_REL_STEP;
+            pert[k] = m->params[j][k] + h;
+            for(i=0; i<nspecies; i++){
+                s1[i] = 0;
+                s2[i] = 0;
+            }
+            for(n=0; n<ntraj; n++){
+                cfd_pair(m, tt, pz, r, x, z, a, b, lambda, T, P);
+                for(i=0; i<nspecies; i++){
+                    d = (z[i] - x[i]) / h;
+                    s1[i] += d;
+                    s2[i] += d * d;
+                }
+            }
+            printf("%d %d %g", j, k, m->params[j][k]);
+            for(i=0; i<nspecies; i++){
+                s1[i] /= ntraj;
+                printf(" %g %g", s1[i], sqrt((s2[i] / ntraj - s1[i] * s1[i]) / (ntraj - 1)));
+            }
+            printf("\n");
+            pert[k] = m->params[j][k];
+        }
+        free_dvector(pert);
+    }
+
+    free_dvector(x);
+    free_dvector(z);
+    free_dvector(s1);
+    free_dvector(s2);
+    free_dvector(a);
+    free_dvector(b);
+    free_dvector(lambda);
+    free_dvector(T);
+    free_dvector(P);
+    free((char *) pz);
+    gsl_rng_free(r);
+}
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+#include<fftw3.h>
+
+/* Power spectral densities and autocorrelation functions, streamed.
+ * Every species is sampled on the dt grid after the burn-in and kept in a ring
+ * buffer of seglen samples. Every seglen/2 new samples (50% overlap) the last
+ * segment is processed:
+ *  - Welch: the segment, minus its mean and times a Hann window, is
+ *    transformed and its periodogram accumulated.
+ *  - ACF: the segment, zero padded to 2*seglen so that the circular
+ *    correlation is the linear one, is transformed and |X|^2 accumulated. Its
+ *    inverse transform is the sum of the lagged products. The sums of the
+ *    first and last seglen - lag samples are accumulated too, so that the
+ *    mean over all the segments (not the one of each segment, which biases
+ *    short segments) is removed at the end. Samples are taken relative to the
+ *    first one to avoid cancellations.
+ * ntraj trajectories contribute segments to the same averages. Only the
+ * averaged spectra are printed, the time series never leave the engine.
+ * With several threads every thread accumulates its own spectrum, relative to
+ * its own first sample, and they are merged at the end: the Welch sums are
+ * added and the lagged products are shifted to a common reference.
+ */
+
+typedef struct _Spectrum_t {
+    int nspecies, seglen, n, nseg;
+    double dt, s2;
+    double *buf, *hann, *in, *pin, *ref, *tot;
+    double **psd, **pow2, **head, **tail, **lag;
+    fftw_complex *out, *pout;
+    fftw_plan plan, pplan;
+} Spectrum_t;
+
+static Spectrum_t * spectrum_new(int nspecies, int seglen, double dt){
+    int i, j;
+    Spectrum_t * sp;
+
+    sp = (Spectrum_t *) malloc(sizeof(Spectrum_t));
+    if (!sp) {
+        report_error("allocation failure in spectrum_new()");
+        exit(1);
+    }
+    sp->nspecies = nspecies;
+    sp->seglen = seglen;
+    sp->dt = dt;
+    sp->n = 0;
+    sp->nseg = 0;
+    sp->buf = dvector(nspecies * seglen);
+    /* Periodic Hann window */
+    sp->hann = dvector(seglen);
+    sp->s2 = 0;
+    for(j=0; j<seglen; j++){
+        sp->hann[j] = 0.5 * (1 - cos(2 * M_PI * j / seglen));
+        sp->s2 += sp->hann[j] * sp->hann[j];
+    }
+    sp->ref = dzeros(nspecies);
+    sp->tot = dzeros(nspecies);
+    sp->psd = (double **) malloc(nspecies * sizeof(double *));
+    sp->pow2 = (double **) malloc(nspecies * sizeof(double *));
+    sp->head = (double **) malloc(nspecies * sizeof(double *));
+    sp->tail = (double **) malloc(nspecies * sizeof(double *));
+    sp->lag = (double **) malloc(nspecies * sizeof(double *));
+    sp->in = (double *) fftw_malloc(seglen * sizeof(double));
+    sp->out = (fftw_complex *) fftw_malloc((seglen/2 + 1) * sizeof(fftw_complex));
+    sp->pin = (double *) fftw_malloc(2 * seglen * sizeof(double));
+    sp->pout = (fftw_complex *) fftw_malloc((seglen + 1) * sizeof(fftw_complex));
+    if (!sp->psd || !sp->pow2 || !sp->head || !sp->tail || !sp->lag || !sp->in || !sp->out || !sp->pin || !sp->pout) {
+        report_error("allocation failure in spectrum_new()");
+        exit(1);
+    }
+    for(i=0; i<nspecies; i++){
+        sp->psd[i] = dzeros(seglen/2 + 1);
+        sp->pow2[i] = dzeros(seglen + 1);
+        sp->head[i] = dzeros(seglen);
+        sp->tail[i] = dzeros(seglen);
+        sp->lag[i] = dzeros(seglen/2 + 1);
+    }
+    sp->plan = fftw_plan_dft_r2c_1d(seglen, sp->in, sp->out, FFTW_ESTIMATE);
+    sp->pplan = fftw_plan_dft_r2c_1d(2 * seglen, sp->pin, sp->pout, FFTW_ESTIMATE);
+    return sp;
+}
+
+static void free_spectrum(Spectrum_t * sp){
+    int i;
+    for(i=0; i<sp->nspecies; i++){
+        free_dvector(sp->psd[i]);
+        free_dvector(sp->pow2[i]);
+        free_dvector(sp->head[i]);
+        free_dvector(sp->tail[i]);
+        free_dvector(sp->lag[i]);
+    }
+    free((char *) sp->psd);
+    free((char *) sp->pow2);
+    free((char *) sp->head);
+    free((char *) sp->tail);
+    free((char *) sp->lag);
+    free_dvector(sp->ref);
+    free_dvector(sp->tot);
+    fftw_destroy_plan(sp->plan);
+    fftw_destroy_plan(sp->pplan);
+    fftw_free(sp->in);
+    fftw_free(sp->out);
+    fftw_free(sp->pin);
+    fftw_free(sp->pout);
+    free_dvector(sp->buf);
+    free_dvector(sp->hann);
+    free((char *) sp);
+}
+
+static void spectrum_segment(Spectrum_t * sp){
+    /* Processes the last seglen samples */
+    int i, j, k, L, first;
+    double mean, x, sum, first_k, last_k;
+
+    L = sp->seglen;
+    first = sp->n % L;
+    for(i=0; i<sp->nspecies; i++){
+        mean = 0;
+        for(j=0; j<L; j++) mean += sp->buf[j * sp->nspecies + i];
+        mean /= L;
+        for(j=0; j<L; j++){
+            x = sp->buf[((first + j) % L) * sp->nspecies + i];
+            sp->in[j] = sp->hann[j] * (x - mean);
+            sp->pin[j] = x - sp->ref[i];
+            sp->pin[L + j] = 0;
+        }
+        /* head[k] and tail[k]: sums of the first and last L - k samples */
+        sum = 0;
+        for(j=0; j<L; j++) sum += sp->pin[j];
+        sp->tot[i] += sum;
+        first_k = 0;
+        last_k = 0;
+        for(k=0; k<L; k++){
+            sp->head[i][k] += sum - last_k;
+            sp->tail[i][k] += sum - first_k;
+            first_k += sp->pin[k];
+            last_k += sp->pin[L-1-k];
+        }
+        fftw_execute(sp->plan);
+        fftw_execute(sp->pplan);
+        for(k=0; k<=L/2; k++) sp->psd[i][k] += sp->out[k][0] * sp->out[k][0] + sp->out[k][1] * sp->out[k][1];
+        for(k=0; k<=L; k++) sp->pow2[i][k] += sp->pout[k][0] * sp->pout[k][0] + sp->pout[k][1] * sp->pout[k][1];
+    }
+    sp->nseg++;
+}
+
+static void spectrum_add(Spectrum_t * sp, double * state){
+    if(sp->n == 0 && sp->nseg == 0) memcpy(sp->ref, state, sp->nspecies * sizeof(double));
+    memcpy(sp->buf + (sp->n % sp->seglen) * sp->nspecies, state, sp->nspecies * sizeof(double));
+    sp->n++;
+    if(sp->n >= sp->seglen && (sp->n - sp->seglen) % (sp->seglen / 2) == 0) spectrum_segment(sp);
+}
+
+static void spectrum_lags(Spectrum_t * sp){
+    /* Sums of lagged products, by inverse transform of the accumulated |X|^2.
+     * The c2r transform is unnormalised, hence the 1/(2L). */
+    int i, k, L;
+    double * acf;
+    fftw_plan plan;
+
+    L = sp->seglen;
+    acf = (double *) fftw_malloc(2 * L * sizeof(double));
+    if (!acf) {
+        report_error("allocation failure in spectrum_lags()");
+        exit(1);
+    }
+    plan = fftw_plan_dft_c2r_1d(2 * L, sp->pout, acf, FFTW_ESTIMATE);
+    for(i=0; i<sp->nspecies; i++){
+        for(k=0; k<=L; k++){
+            sp->pout[k][0] = sp->pow2[i][k];
+            sp->pout[k][1] = 0;
+        }
+        fftw_execute(plan);
+        for(k=0; k<=L/2; k++) sp->lag[i][k] = acf[k] / (2*L);
+    }
+    fftw_destroy_plan(plan);
+    fftw_free(acf);
+}
+
+static void spectrum_merge(Spectrum_t * sp, Spectrum_t * src){
+    /* Adds the sums of src, whose lags are already computed, to those of sp.
+     * With d the difference of references,
+     *      (x - ref)(y - ref) = (x - ref')(y - ref') + d (x - ref' + y - ref') + d^2 */
+    int i, k, L;
+    double d, nseg;
+
+    if(src->nseg == 0) return;
+    if(sp->nseg == 0) memcpy(sp->ref, src->ref, sp->nspecies * sizeof(double));
+    L = sp->seglen;
+    nseg = src->nseg;
+    for(i=0; i<sp->nspecies; i++){
+        d = src->ref[i] - sp->ref[i];
+        for(k=0; k<=L/2; k++){
+            sp->psd[i][k] += src->psd[i][k];
+            sp->lag[i][k] += src->lag[i][k] + d * (src->head[i][k] + src->tail[i][k]) + d * d * (L - k) * nseg;
+        }
+        for(k=0; k<L; k++){
+            sp->head[i][k] += src->head[i][k] + d * (L - k) * nseg;
+            sp->tail[i][k] += src->tail[i][k] + d * (L - k) * nseg;
+        }
+        sp->tot[i] += src->tot[i] + d * L * nseg;
+    }
+    sp->nseg += src->nseg;
+}
+
+static void spectrum_print(Spectrum_t * sp, char ** names){
+    /* The lags have to be computed (or merged) first */
+    int i, k, L;
+    double scale, mu, c0, ck;
+
+    L = sp->seglen;
+    printf("# Welch power spectral density: %d segments of %d points, Hann window, 50%% overlap\n", sp->nseg, L);
+    printf("#frequency ");
+    for(i=0; i<sp->nspecies; i++) printf("%s ", names[i]);
+    printf("\n");
+    for(k=0; k<=L/2; k++){
+        /* One sided density: positive and negative frequencies are added */
+        scale = sp->dt / (sp->s2 * sp->nseg) * ((k == 0 || 2*k == L) ? 1 : 2);
+        printf("%g ", k / (L * sp->dt));
+        for(i=0; i<sp->nspecies; i++) printf("%g ", sp->psd[i][k] * scale);
+        printf("\n");
+    }
+
+    printf("# autocorrelation, lags up to half a segment\n");
+    printf("#lag ");
+    for(i=0; i<sp->nspecies; i++) printf("%s ", names[i]);
+    printf("\n");
+    for(k=0; k<=L/2; k++){
+        printf("%g ", k * sp->dt);
+        for(i=0; i<sp->nspecies; i++){
+            /* Autocovariance about the overall mean, over its value at lag 0 */
+            mu = sp->tot[i] / ((double) L * sp->nseg);
+            c0 = (sp->lag[i][0] - 2 * mu * sp->head[i][0]) / ((double) L * sp->nseg) + mu * mu;
+            ck = (sp->lag[i][k] - mu * (sp->head[i][k] + sp->tail[i][k])) / ((double) (L - k) * sp->nseg) + mu * mu;
+            printf("%g ", (c0 > 0) ? ck / c0 : 0);
+        }
+        printf("\n");
+    }
+}
+
+typedef struct _SpectrumJob_t {
+    /* Shared arguments and per-thread workspaces of the trajectory pool */
+    double dt, burnin;
+    int nsteps;
+    Traj_t ** tr;
+    Spectrum_t ** sp;
+} SpectrumJob_t;
+
+static void spectrum_run(void * arg, int thread, int k){
+    int step_n;
+    SpectrumJob_t * job = (SpectrumJob_t *) arg;
+    Traj_t * tr = job->tr[thread];
+    Spectrum_t * sp = job->sp[thread];
+
+    gsl_rng_set(tr->r, k);
+    traj_start(tr);
+    /* Segments do not span trajectories */
+    sp->n = 0;
+    for(step_n=0; step_n<job->nsteps; step_n++){
+        if(job->dt * step_n >= job->burnin) spectrum_add(sp, tr->state);
+        traj_advance(tr, job->dt * step_n, job->dt * (step_n+1), NULL);
+    }
+}
+
+void sim_spectrum(Model_t * m, double tt, double dt, leapStepFunc step, int ntraj,
+        double burnin, int seglen, int nthreads){
+    int i;
+    SpectrumJob_t job;
+
+    if(dt <= 0){
+        report_error("Spectra require a strictly positive sampling step\n");
+        exit(1);
+    }
+    if(seglen < 4 || seglen % 2 != 0){
+        report_error("Spectra require an even segment length of at least 4 points\n");
+        exit(1);
+    }
+    job.dt = dt;
+    job.burnin = burnin;
+    job.nsteps = (int) ceil(tt / dt);
+    if(job.nsteps - (int) ceil(burnin / dt) < seglen){
+        report_error("The trajectories are shorter than one segment of %d points\n", seglen);
+        exit(1);
+    }
+    if(nthreads > ntraj) nthreads = ntraj;
+    if(nthreads < 1) nthreads = 1;
+    /* FFTW plans are created here, only their execution is thread safe */
+    job.tr = (Traj_t **) malloc(nthreads * sizeof(Traj_t *));
+    job.sp = (Spectrum_t **) malloc(nthreads * sizeof(Spectrum_t *));
+    if (!job.tr || !job.sp) {
+        report_error("allocation failure in sim_spectrum()");
+        exit(1);
+    }
+    for(i=0; i<nthreads; i++){
+        job.tr[i] = traj_new(m, step, rng_new(0));
+        job.sp[i] = spectrum_new(m->nspecies, seglen, dt);
+    }
+
+    pool_run(nthreads, ntraj, spectrum_run, NULL, &job);
+
+    for(i=0; i<nthreads; i++) spectrum_lags(job.sp[i]);
+    for(i=1; i<nthreads; i++) spectrum_merge(job.sp[0], job.sp[i]);
+    spectrum_print(job.sp[0], m->species);
+
+    for(i=0; i<nthreads; i++){
+        gsl_rng_free(job.tr[i]->r);
+        free_traj(job.tr[i]);
+        free_spectrum(job.sp[i]);
+    }
+    free((char *) job.tr);
+    free((char *) job.sp);
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+#include "stats.h"
+
+/* Stationary distribution from one long trajectory of the direct method.
+ * After the burn-in every state is weighted by its residence time, i.e. the
+ * time until the next reaction (or event, or tt). Time-weighted means and
+ * covariances are updated online (West's weighted algorithm) together with one
+ * adaptive histogram per species, so memory is O(species^2 + species x bins)
+ * whatever the length of the trajectory.
+ */
+
+static void stationary_add(int nspecies, double * state, double dt, double * wsum,
+        double * mean, double * d, double ** comoment, Hist_t ** hist){
+    int i, j;
+
+    if(dt <= 0) return;
+    *wsum += dt;
+    for(i=0; i<nspecies; i++){
+        d[i] = state[i] - mean[i];
+        mean[i] += dt / *wsum * d[i];
+    }
+    for(i=0; i<nspecies; i++){
+        for(j=0; j<=i; j++) comoment[i][j] += dt * d[i] * (state[j] - mean[j]);
+        hist_add(hist[i], state[i], dt);
+    }
+}
+
+void sim_stationary(Model_t * m, double tt, double burnin){
+    int i, j, nreactions, nspecies;
+    int *armed;
+    double *state, *rates, *mean, *d;
+    double **params, **comoment;
+    double t, tau, a0, thr, runningSum, tevent, tnext, wsum;
+    Hist_t ** hist;
+    gsl_rng * r;
+
+    if(burnin < 0 || burnin >= tt){
+        report_error("The burn-in must be shorter than the simulation time\n");
+        exit(1);
+    }
+    nreactions = m->Nreactions;
+    nspecies = m->nspecies;
+    params = (m->nevents > 0) ? model_params_copy(m) : m->params;
+    armed = ivector(m->nevents);
+    events_reset(m, armed);
+    state = dvector(nspecies);
+    for(i=0; i<nspecies; i++) state[i] = (double) m->istate[i];
+    rates = dvector(nreactions);
+    mean = dzeros(nspecies);
+    d = dvector(nspecies);
+    comoment = (double **) malloc(nspecies * sizeof(double *));
+    hist = (Hist_t **) malloc(nspecies * sizeof(Hist_t *));
+    if (!comoment || !hist) {
+        report_error("allocation failure in sim_stationary()");
+        exit(1);
+    }
+    for(i=0; i<nspecies; i++){
+        comoment[i] = dzeros(nspecies);
+        hist[i] = hist_new();
+    }
+    wsum = 0;
+
+    r = rng_new(0);
+
+    t = 0;
+    events_fire(m, armed, t, state, params);
+    model_rates(m, state, params, rates);
+    while(t < tt){
+        a0 = dsum(rates, nreactions);
+        tau = (a0 > 0) ? (-1/a0) * log(gsl_rng_uniform_pos(r)) : INFINITY;
+        tevent = events_next_time(m, armed);
+        tnext = t + tau;
+        if(tevent < tnext) tnext = tevent;
+        if(tt < tnext) tnext = tt;
+        /* The state is held over [t, tnext) */
+        stationary_add(nspecies, state, tnext - ((t > burnin) ? t : burnin),
+                &wsum, mean, d, comoment, hist);
+        if(tnext >= tt) break;
+        t = tnext;
+        if(tevent <= t){
+            events_fire(m, armed, t, state, params);
+            model_rates(m, state, params, rates);
+            continue;
+        }
+        thr = a0 * gsl_rng_uniform_pos(r);
+        runningSum = 0;
+        for(j=0; j<nreactions-1; j++){
+            runningSum += rates[j];
+            if(runningSum > thr) break;
+        }
+        model_update(m, j, state, params, rates);
+        if(m->nevents > 0) {
+            events_fire(m, armed, t, state, params);
+            model_rates(m, state, params, rates);
+        }
+    }
+
+    printf("# stationary distribution over [%g, %g]\n", burnin, tt);
+    printf("#species mean variance\n");
+    for(i=0; i<nspecies; i++) printf("%s %g %g\n", m->species[i], mean[i], comoment[i][i] / wsum);
+    printf("#covariance");
+    for(i=0; i<nspecies; i++) printf(" %s", m->species[i]);
+    printf("\n");
+    for(i=0; i<nspecies; i++){
+        printf("%s", m->species[i]);
+        for(j=0; j<nspecies; j++) printf(" %g", ((j <= i) ? comoment[i][j] : comoment[j][i]) / wsum);
+        printf("\n");
+    }
+    printf("#species bin_low bin_high probability\n");
+    for(i=0; i<nspecies; i++) hist_print(hist[i], m->species[i]);
+
+    for(i=0; i<nspecies; i++){
+        free_dvector(comoment[i]);
+        free_hist(hist[i]);
+    }
+    free((char *) comoment);
+    free((char *) hist);
+    if(params != m->params) free_params(m, params);
+    free_ivector(armed);
+    free_dvector(state);
+    free_dvector(rates);
+    free_dvector(mean);
+    free_dvector(d);
+    gsl_rng_free(r);
+}
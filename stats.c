@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "stats.h"
+
+Hist_t * hist_new(void){
+    Hist_t * h;
+
+    h = (Hist_t *) malloc(sizeof(Hist_t));
+    if (!h) {
+        report_error("allocation failure in hist_new()");
+        exit(1);
+    }
+    h->lo = 0;
+    h->width = 1;
+    h->total = 0;
+    h->nbins = 0;
+    h->w = dzeros(HIST_MAXBINS);
+    return h;
+}
+
+void free_hist(Hist_t * h){
+    free_dvector(h->w);
+    free((char *) h);
+}
+
+static void hist_merge(Hist_t * h){
+    /* Doubles the bin width, keeping lo a multiple of it */
+    int k, offset, nbins;
+    double lo;
+
+    lo = floor(h->lo / (2 * h->width)) * 2 * h->width;
+    offset = (int) round((h->lo - lo) / h->width);
+    nbins = (h->nbins + offset + 1) / 2;
+    for(k=0; k<nbins; k++){
+        h->w[k] = ((2*k - offset >= 0) ? h->w[2*k - offset] : 0)
+            + ((2*k + 1 - offset < h->nbins) ? h->w[2*k + 1 - offset] : 0);
+    }
+    for(k=nbins; k<h->nbins; k++) h->w[k] = 0;
+    h->lo = lo;
+    h->width *= 2;
+    h->nbins = nbins;
+}
+
+void hist_add(Hist_t * h, double x, double weight){
+    int k, shift, n;
+    double lo, hi;
+
+    if(h->nbins == 0){
+        h->lo = floor(x / h->width) * h->width;
+        h->nbins = 1;
+    }
+    /* Extend the range to x, merging bins until it fits */
+    while(x < h->lo || x >= h->lo + h->nbins * h->width){
+        lo = (x < h->lo) ? floor(x / h->width) * h->width : h->lo;
+        hi = h->lo + h->nbins * h->width;
+        if(x >= hi) hi = (floor(x / h->width) + 1) * h->width;
+        n = (int) round((hi - lo) / h->width);
+        if(n > HIST_MAXBINS){
+            hist_merge(h);
+            continue;
+        }
+        shift = (int) round((h->lo - lo) / h->width);
+        if(shift > 0){
+            memmove(h->w + shift, h->w, h->nbins * sizeof(double));
+            for(k=0; k<shift; k++) h->w[k] = 0;
+        }
+        h->lo = lo;
+        h->nbins = n;
+    }
+    k = (int) floor((x - h->lo) / h->width);
+    if(k >= h->nbins) k = h->nbins - 1;
+    h->w[k] += weight;
+    h->total += weight;
+}
+
+void hist_print(Hist_t * h, const char * label){
+    int k;
+
+    for(k=0; k<h->nbins; k++){
+        if(h->w[k] == 0) continue;
+        printf("%s %g %g %g\n", label, h->lo + k * h->width, h->lo + (k+1) * h->width, h->w[k] / h->total);
+    }
+}
+
+static const double ens_probs[ENS_NQUANT] = {0.05, 0.25, 0.5, 0.75, 0.95};
+/* Desired cumulative probability of every marker, the quantile q is marker 2q+2 */
+static const double ens_markers[ENS_NMARKERS] = {0, 0.025, 0.05, 0.15, 0.25, 0.375,
+    0.5, 0.625, 0.75, 0.85, 0.95, 0.975, 1};
+
+static void quant_add(Quant_t * qt, double x){
+    int i, k;
+    double d, np, qp, *q, *n;
+
+    q = qt->q;
+    n = qt->n;
+    if(qt->count < ENS_NMARKERS){
+        /* Insertion sort of the first observations */
+        for(i=qt->count; i>0 && q[i-1] > x; i--) q[i] = q[i-1];
+        q[i] = x;
+        qt->count++;
+        if(qt->count == ENS_NMARKERS){
+            for(i=0; i<ENS_NMARKERS; i++) n[i] = i;
+        }
+        return;
+    }
+    qt->count++;
+    /* Cell of x, extending the extreme markers if needed */
+    if(x < q[0]){
+        q[0] = x;
+        k = 0;
+    } else if(x >= q[ENS_NMARKERS-1]){
+        q[ENS_NMARKERS-1] = x;
+        k = ENS_NMARKERS - 2;
+    } else {
+        for(k=0; k<ENS_NMARKERS-2; k++){
+            if(x < q[k+1]) break;
+        }
+    }
+    for(i=k+1; i<ENS_NMARKERS; i++) n[i] += 1;
+    /* Move the inner markers towards their desired positions */
+    for(i=1; i<ENS_NMARKERS-1; i++){
+        np = (qt->count - 1) * ens_markers[i];
+        d = np - n[i];
+        if((d >= 1 && n[i+1] - n[i] > 1) || (d <= -1 && n[i-1] - n[i] < -1)){
+            d = (d > 0) ? 1 : -1;
+            qp = q[i] + d / (n[i+1] - n[i-1]) * ((n[i] - n[i-1] + d) * (q[i+1] - q[i]) / (n[i+1] - n[i])
+                    + (n[i+1] - n[i] - d) * (q[i] - q[i-1]) / (n[i] - n[i-1]));
+            if(q[i-1] < qp && qp < q[i+1]){
+                q[i] = qp;
+            } else {
+                /* Linear prediction if the parabola is not monotonic */
+                k = i + (int) d;
+                q[i] += d * (q[k] - q[i]) / (n[k] - n[i]);
+            }
+            n[i] += d;
+        }
+    }
+}
+
+static double quant_value(Quant_t * qt, int quantile){
+    /* Before all the markers are set, the nearest rank of the sorted observations */
+    int k;
+
+    if(qt->count == 0) return NAN;
+    if(qt->count >= ENS_NMARKERS) return qt->q[2*quantile + 2];
+    k = (int) ceil(ens_probs[quantile] * qt->count) - 1;
+    if(k < 0) k = 0;
+    return qt->q[k];
+}
+
+Ensemble_t * ensemble_new(int nspecies, int npoints, double bmin, double bmax, int nbins){
+    Ensemble_t * e;
+
+    e = (Ensemble_t *) malloc(sizeof(Ensemble_t));
+    if (!e) {
+        report_error("allocation failure in ensemble_new()");
+        exit(1);
+    }
+    e->nspecies = nspecies;
+    e->npoints = npoints;
+    e->nbins = nbins;
+    e->bmin = bmin;
+    e->bmax = bmax;
+    e->n = (long *) calloc(npoints, sizeof(long));
+    e->quant = (Quant_t *) calloc(npoints * nspecies, sizeof(Quant_t));
+    if (!e->n || !e->quant) {
+        report_error("allocation failure in ensemble_new()");
+        exit(1);
+    }
+    e->mean = dzeros(npoints * nspecies);
+    e->comom = dzeros(npoints * nspecies * (nspecies + 1) / 2);
+    e->hist = (nbins > 0) ? dzeros(npoints * nspecies * (nbins + 2)) : NULL;
+    e->delta = dvector(nspecies);
+    return e;
+}
+
+void free_ensemble(Ensemble_t * e){
+    free((char *) e->n);
+    free((char *) e->quant);
+    free_dvector(e->mean);
+    free_dvector(e->comom);
+    if(e->hist != NULL) free_dvector(e->hist);
+    free_dvector(e->delta);
+    free((char *) e);
+}
+
+void ensemble_add(Ensemble_t * e, int point, double * state){
+    int i, j, b, ns;
+    double *mean, *comom;
+
+    ns = e->nspecies;
+    mean = e->mean + point * ns;
+    comom = e->comom + point * ns * (ns + 1) / 2;
+    e->n[point]++;
+    /* Welford: C_ij += (x_i - old mean_i) (x_j - new mean_j) */
+    for(i=0; i<ns; i++){
+        e->delta[i] = state[i] - mean[i];
+        mean[i] += e->delta[i] / e->n[point];
+    }
+    for(i=0; i<ns; i++){
+        for(j=i; j<ns; j++) *comom++ += e->delta[i] * (state[j] - mean[j]);
+    }
+    for(i=0; i<ns; i++){
+        quant_add(e->quant + point*ns + i, state[i]);
+        if(e->nbins > 0){
+            if(state[i] < e->bmin) b = 0;
+            else if(state[i] >= e->bmax) b = e->nbins + 1;
+            else b = 1 + (int) (e->nbins * (state[i] - e->bmin) / (e->bmax - e->bmin));
+            e->hist[(point*ns + i) * (e->nbins + 2) + b] += 1;
+        }
+    }
+}
+
+static void quant_merge(Quant_t * a, Quant_t * b){
+    /* a += b. While one of them still keeps its observations they are added
+     * to the other one. Otherwise the marker heights are averaged with the
+     * counts as weights and the positions added, which is exact only for
+     * large shards of the same distribution but keeps the markers ordered. */
+    int i;
+    long count;
+    Quant_t t;
+
+    if(b->count < ENS_NMARKERS){
+        for(i=0; i<b->count; i++) quant_add(a, b->q[i]);
+        return;
+    }
+    if(a->count < ENS_NMARKERS){
+        t = *b;
+        for(i=0; i<a->count; i++) quant_add(&t, a->q[i]);
+        *a = t;
+        return;
+    }
+    count = a->count + b->count;
+    for(i=1; i<ENS_NMARKERS-1; i++){
+        a->q[i] = (a->count * a->q[i] + b->count * b->q[i]) / count;
+        a->n[i] += b->n[i];
+    }
+    if(b->q[0] < a->q[0]) a->q[0] = b->q[0];
+    if(b->q[ENS_NMARKERS-1] > a->q[ENS_NMARKERS-1]) a->q[ENS_NMARKERS-1] = b->q[ENS_NMARKERS-1];
+    a->n[ENS_NMARKERS-1] = count - 1;
+    a->count = count;
+}
+
+/* Records: the statistics of one time point in a flat array of doubles,
+ *      nspecies nbins n mean[nspecies] comom[nspecies (nspecies+1) / 2]
+ *      (count q[ENS_NMARKERS] n[ENS_NMARKERS])[nspecies] hist[nspecies (nbins+2)]
+ * so that they can be merged wherever they were computed. */
+
+static int ens_record_size(int ns, int nbins){
+    return 3 + ns + ns * (ns + 1) / 2 + ns * (1 + 2 * ENS_NMARKERS)
+        + ((nbins > 0) ? ns * (nbins + 2) : 0);
+}
+
+int ensemble_record_size(Ensemble_t * e){
+    return ens_record_size(e->nspecies, e->nbins);
+}
+
+static void quant_pack(Quant_t * qt, double * rec){
+    rec[0] = qt->count;
+    memcpy(rec + 1, qt->q, ENS_NMARKERS * sizeof(double));
+    memcpy(rec + 1 + ENS_NMARKERS, qt->n, ENS_NMARKERS * sizeof(double));
+}
+
+static void quant_unpack(Quant_t * qt, double * rec){
+    qt->count = (long) rec[0];
+    memcpy(qt->q, rec + 1, ENS_NMARKERS * sizeof(double));
+    memcpy(qt->n, rec + 1 + ENS_NMARKERS, ENS_NMARKERS * sizeof(double));
+}
+
+void ensemble_pack(Ensemble_t * e, double * rec){
+    int i, k, ns, nc, nh;
+
+    ns = e->nspecies;
+    nc = ns * (ns + 1) / 2;
+    nh = (e->nbins > 0) ? ns * (e->nbins + 2) : 0;
+    for(k=0; k<e->npoints; k++){
+        rec[0] = ns;
+        rec[1] = e->nbins;
+        rec[2] = e->n[k];
+        memcpy(rec + 3, e->mean + k*ns, ns * sizeof(double));
+        memcpy(rec + 3 + ns, e->comom + k*nc, nc * sizeof(double));
+        for(i=0; i<ns; i++) quant_pack(e->quant + k*ns + i, rec + 3 + ns + nc + i * (1 + 2 * ENS_NMARKERS));
+        if(nh > 0) memcpy(rec + 3 + ns + nc + ns * (1 + 2 * ENS_NMARKERS), e->hist + k*nh, nh * sizeof(double));
+        rec += ensemble_record_size(e);
+    }
+}
+
+void ensemble_unpack(Ensemble_t * e, double * rec){
+    int i, k, ns, nc, nh;
+
+    ns = e->nspecies;
+    nc = ns * (ns + 1) / 2;
+    nh = (e->nbins > 0) ? ns * (e->nbins + 2) : 0;
+    for(k=0; k<e->npoints; k++){
+        e->n[k] = (long) rec[2];
+        memcpy(e->mean + k*ns, rec + 3, ns * sizeof(double));
+        memcpy(e->comom + k*nc, rec + 3 + ns, nc * sizeof(double));
+        for(i=0; i<ns; i++) quant_unpack(e->quant + k*ns + i, rec + 3 + ns + nc + i * (1 + 2 * ENS_NMARKERS));
+        if(nh > 0) memcpy(e->hist + k*nh, rec + 3 + ns + nc + ns * (1 + 2 * ENS_NMARKERS), nh * sizeof(double));
+        rec += ensemble_record_size(e);
+    }
+}
+
+void ensemble_merge_records(double * in, double * inout, int count){
+    /* Chan et al.: with d = mean_b - mean_a, the merged comoments are
+     * C_a + C_b + d_i d_j n_a n_b / n */
+    int i, j, k, ns, nc, nh, size;
+    double na, nb, n, *ma, *mb, *ca, *cb, *qa, *qb;
+    Quant_t ta, tb;
+
+    for(k=0; k<count; k++){
+        ns = (int) in[0];
+        nc = ns * (ns + 1) / 2;
+        nh = ((int) in[1] > 0) ? ns * ((int) in[1] + 2) : 0;
+        size = ens_record_size(ns, (int) in[1]);
+        na = inout[2];
+        nb = in[2];
+        n = na + nb;
+        ma = inout + 3;
+        mb = in + 3;
+        ca = ma + ns;
+        cb = mb + ns;
+        if(nb > 0){
+            for(i=0; i<ns; i++){
+                for(j=i; j<ns; j++) *ca++ += *cb++ + (mb[i] - ma[i]) * (mb[j] - ma[j]) * na * nb / n;
+            }
+            for(i=0; i<ns; i++) ma[i] += (mb[i] - ma[i]) * nb / n;
+            inout[2] = n;
+        }
+        qa = inout + 3 + ns + nc;
+        qb = in + 3 + ns + nc;
+        for(i=0; i<ns; i++){
+            quant_unpack(&ta, qa);
+            quant_unpack(&tb, qb);
+            quant_merge(&ta, &tb);
+            quant_pack(&ta, qa);
+            qa += 1 + 2 * ENS_NMARKERS;
+            qb += 1 + 2 * ENS_NMARKERS;
+        }
+        for(i=0; i<nh; i++) qa[i] += qb[i];
+        in += size;
+        inout += size;
+    }
+}
+
+void ensemble_print(Ensemble_t * e, double dt, char ** species){
+    int i, j, k, b, q, ns, nc;
+    long n;
+    double *comom, *h;
+
+    ns = e->nspecies;
+    nc = ns * (ns + 1) / 2;
+    printf("#time");
+    for(i=0; i<ns; i++){
+        printf(" %s_mean %s_var", species[i], species[i]);
+        for(q=0; q<ENS_NQUANT; q++) printf(" %s_q%02d", species[i], (int) round(100 * ens_probs[q]));
+    }
+    printf("\n");
+    for(k=0; k<e->npoints; k++){
+        n = e->n[k];
+        printf("%g", dt * k);
+        for(i=0; i<ns; i++){
+            /* Diagonal of the packed comoments */
+            printf(" %g %g", e->mean[k*ns + i],
+                    (n > 1) ? e->comom[k*nc + i*ns - i*(i-1)/2] / (n - 1) : 0);
+            for(q=0; q<ENS_NQUANT; q++) printf(" %g", quant_value(e->quant + k*ns + i, q));
+        }
+        printf("\n");
+    }
+    if(ns > 1){
+        printf("#time species1 species2 covariance\n");
+        for(k=0; k<e->npoints; k++){
+            n = e->n[k];
+            comom = e->comom + k * nc;
+            for(i=0; i<ns; i++){
+                comom++;
+                for(j=i+1; j<ns; j++, comom++){
+                    printf("%g %s %s %g\n", dt * k, species[i], species[j], (n > 1) ? *comom / (n - 1) : 0);
+                }
+            }
+        }
+    }
+    if(e->nbins > 0){
+        printf("#time species bin_low bin_high probability\n");
+        for(k=0; k<e->npoints; k++){
+            if(e->n[k] == 0) continue;
+            for(i=0; i<ns; i++){
+                h = e->hist + (k*ns + i) * (e->nbins + 2);
+                for(b=0; b<e->nbins+2; b++){
+                    printf("%g %s %g %g %g\n", dt * k, species[i],
+                            (b == 0) ? -INFINITY : e->bmin + (b-1) * (e->bmax - e->bmin) / e->nbins,
+                            (b == e->nbins+1) ? INFINITY : e->bmin + b * (e->bmax - e->bmin) / e->nbins,
+                            h[b] / e->n[k]);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "utils.h"
+
+#define HIST_MAXBINS 1024
+
+typedef struct _Hist_t {
+    /* Adaptive histogram of weights. Bin k covers [lo + k*width, lo + (k+1)*width).
+     * width starts at 1 (one bin per copy number) and doubles, merging the bins
+     * in pairs, whenever the range would need more than HIST_MAXBINS bins. */
+    double lo, width, total;
+    int nbins;
+    double * w;
+} Hist_t;
+
+Hist_t * hist_new(void);
+void free_hist(Hist_t * h);
+void hist_add(Hist_t * h, double x, double weight);
+/* Add weight to the bin of x */
+void hist_print(Hist_t * h, const char * label);
+/* Print "label bin_low bin_high probability" for every non empty bin */
+
+#define ENS_NQUANT 5
+#define ENS_NMARKERS (2 * ENS_NQUANT + 3)
+
+typedef struct _Quant_t {
+    /* Extended P^2 estimator of the ENS_NQUANT ensemble quantiles (Jain &
+     * Chlamtac 1985, Raatikainen 1987): heights q and positions n of markers
+     * at the minimum, the quantiles, the midpoints between them and the
+     * maximum. Sharing the markers keeps the quantiles ordered. The first
+     * ENS_NMARKERS observations are kept sorted in q. */
+    long count;
+    double q[ENS_NMARKERS], n[ENS_NMARKERS];
+} Quant_t;
+
+typedef struct _Ensemble_t {
+    /* Statistics across trajectories at each of npoints time points, updated
+     * one state at a time: the mean and the comoments (packed upper triangle)
+     * with Welford's recurrence, the quantiles and, if nbins > 0, a fixed-bin
+     * histogram per species whose bins 0 and nbins+1 collect the states below
+     * bmin and above bmax. */
+    int nspecies, npoints, nbins;
+    double bmin, bmax;
+    long * n;
+    double *mean, *comom, *hist, *delta;
+    Quant_t * quant;
+} Ensemble_t;
+
+Ensemble_t * ensemble_new(int nspecies, int npoints, double bmin, double bmax, int nbins);
+void free_ensemble(Ensemble_t * e);
+void ensemble_add(Ensemble_t * e, int point, double * state);
+/* Add a state observed at time point point */
+int ensemble_record_size(Ensemble_t * e);
+/* Doubles per time point of a packed ensemble */
+void ensemble_pack(Ensemble_t * e, double * rec);
+/* Copy the statistics into npoints consecutive records */
+void ensemble_unpack(Ensemble_t * e, double * rec);
+/* Copy them back from the records of an ensemble of the same shape */
+void ensemble_merge_records(double * in, double * inout, int count);
+/* Merge count records of in into those of inout, as if all their states had
+ * been added to inout */
+void ensemble_print(Ensemble_t * e, double dt, char ** species);
+/* Print the moments and quantiles table, then the covariances and histograms */
+
+#endif /* STATS_H_ */
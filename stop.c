@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+#include<gsl/gsl_cdf.h>
+
+/* Early termination of a trajectory. Checked at every output point:
+ *  STOP_CONDITION: the user condition holds.
+ *  STOP_ABSORBING: every propensity is zero. Only tested when the state did
+ *                  not change since the previous output point, which it
+ *                  cannot avoid.
+ *  STOP_STEADY:    the means of every species over the first and the second
+ *                  half of the last window output points are shown equal, up
+ *                  to a relative tolerance tol, by an equivalence test (two one
+ *                  sided t-tests) with standard errors from STOP_BATCHES batch
+ *                  means per half. Noise alone thus never stops a trajectory.
+ *                  The test is repeated every half window, the k-th time at
+ *                  level STOP_ALPHA / (k (k+1)), so that the chance of a false
+ *                  stop over the whole trajectory stays below STOP_ALPHA.
+ *                  This is a heuristic: the batches should be longer than the
+ *                  correlation time of the species, and a drift slower than
+ *                  tol per window goes unnoticed.
+ * The last two only apply when nothing else can change the dynamics, i.e.
+ * without time dependent parameters nor pending timed events.
+ * The state reached is then frozen for the rest of the output points. At
+ * stationarity it is distributed like the state at the final time, so
+ * ensemble statistics of the final state are kept.
+ */
+
+#define STOP_BATCHES 5
+#define STOP_ALPHA 0.05
+
+Stop_t * stop_new(Model_t * m, Condition_t * cond, int window, double tol){
+    Stop_t * st;
+
+    st = (Stop_t *) malloc(sizeof(Stop_t));
+    if (!st) {
+        report_error("allocation failure in stop_new()");
+        exit(1);
+    }
+    if(window != 0 && window < 2 * STOP_BATCHES){
+        report_error("Steady state detection requires a window of at least %d output points\n", 2 * STOP_BATCHES);
+        exit(1);
+    }
+    if(window != 0 && tol <= 0){
+        report_error("Steady state detection requires a strictly positive tolerance\n");
+        exit(1);
+    }
+    st->m = m;
+    st->cond = cond;
+    st->window = window;
+    st->tol = tol;
+    st->buf = (window > 0) ? dvector(window * m->nspecies) : NULL;
+    st->last = dvector(m->nspecies);
+    stop_reset(st);
+    return st;
+}
+
+void free_stop(Stop_t * st){
+    if(st->buf != NULL) free_dvector(st->buf);
+    free_dvector(st->last);
+    free((char *) st);
+}
+
+void stop_reset(Stop_t * st){
+    /* Forgets the past output points, i.e. at the start of a trajectory */
+    int i;
+    st->n = 0;
+    st->ntests = 0;
+    for(i=0; i<st->m->nspecies; i++) st->last[i] = NAN;
+}
+
+const char * stop_name(stop_reason reason){
+    if(reason == STOP_ABSORBING) return "absorbing state";
+    if(reason == STOP_CONDITION) return "stop condition";
+    if(reason == STOP_STEADY) return "steady state";
+    return "none";
+}
+
+static int stop_absorbing(Stop_t * st, double * state, double ** params, int * armed){
+    int i, j;
+    Model_t * m;
+
+    m = st->m;
+    for(i=0; i<m->nspecies; i++){
+        if(state[i] != st->last[i]) return 0;
+    }
+    for(j=0; j<m->Nreactions; j++){
+        if(m->prop[j](state, m->nreactants[j], m->reactants[j], params[j], m->acting_species[j]) > 0) return 0;
+    }
+    return 1;
+}
+
+static int stop_steady(Stop_t * st, double * state){
+    int i, j, k, b, h, w, nb, nspecies;
+    double bm, m[2], v[2], t, scale;
+
+    nspecies = st->m->nspecies;
+    w = st->window;
+    memcpy(st->buf + (st->n % w) * nspecies, state, nspecies * sizeof(double));
+    st->n++;
+    h = w / 2;
+    if(st->n < w || (st->n - w) % h != 0) return 0;
+    st->ntests++;
+    t = gsl_cdf_tdist_Pinv(1 - STOP_ALPHA / (st->ntests * (st->ntests + 1.0)), 2 * STOP_BATCHES - 2);
+    /* The oldest point of the ring buffer is at n % w. Each half is split in
+     * STOP_BATCHES batches of nb points. */
+    nb = h / STOP_BATCHES;
+    for(i=0; i<nspecies; i++){
+        for(k=0; k<2; k++){
+            m[k] = 0;
+            v[k] = 0;
+            for(b=0; b<STOP_BATCHES; b++){
+                bm = 0;
+                for(j=0; j<nb; j++){
+                    bm += st->buf[((st->n + (w - h) * k + b * nb + j) % w) * nspecies + i];
+                }
+                bm /= nb;
+                m[k] += bm;
+                v[k] += bm * bm;
+            }
+            m[k] /= STOP_BATCHES;
+            /* Variance of the mean of the half */
+            v[k] = (v[k] / STOP_BATCHES - m[k] * m[k]) / (STOP_BATCHES - 1);
+            if(v[k] < 0) v[k] = 0;
+        }
+        /* Relative to the mean, but at least to one molecule */
+        scale = 0.5 * (fabs(m[0]) + fabs(m[1]));
+        if(scale < 1) scale = 1;
+        if(fabs(m[0] - m[1]) + t * sqrt(v[0] + v[1]) >= st->tol * scale) return 0;
+    }
+    return 1;
+}
+
+stop_reason stop_check(Stop_t * st, double * state, double ** params, int * armed){
+    /* To be called at every output point with the current parameters and
+     * event state. st may be NULL, then the trajectory never stops. */
+    stop_reason reason;
+
+    if(st == NULL) return STOP_NONE;
+    reason = STOP_NONE;
+    if(st->cond != NULL && condition_holds(st->cond, state)){
+        reason = STOP_CONDITION;
+    } else if(st->m->ninputs > 0 || (st->m->nevents > 0 && events_next_time(st->m, armed) < INFINITY)){
+        /* The dynamics will change: the past output points are meaningless */
+        st->n = 0;
+    } else if(stop_absorbing(st, state, params, armed)){
+        reason = STOP_ABSORBING;
+    } else if(st->window > 0 && stop_steady(st, state)){
+        reason = STOP_STEADY;
+    }
+    memcpy(st->last, state, st->m->nspecies * sizeof(double));
+    return reason;
+}
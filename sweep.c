@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+#include<limits.h>
+
+/* Parameter sweeps. Every point of the grid (see Sweep_t) is simulated nrep
+ * times up to tt, task k being replicate k % nrep of point k / nrep, on random
+ * stream k. All the tasks share the parsed model: each thread owns a copy of
+ * the parameters and a task only writes the swept ones after traj_start.
+ * The cost of a point can be anything from an immediate extinction to the
+ * whole run, so the tasks go to a work stealing pool. Their final states are
+ * kept and reduced in task order at the end, so the output does not depend on
+ * the number of threads.
+ */
+
+typedef struct _SweepJob_t {
+    double tt, dt;
+    int nrep;
+    Sweep_t * sw;
+    Traj_t ** tr;
+    double *** params;
+    double * final;
+} SweepJob_t;
+
+static void sweep_run(void * arg, int thread, int k){
+    double t, tnext;
+    SweepJob_t * job = (SweepJob_t *) arg;
+    Traj_t * tr = job->tr[thread];
+
+    gsl_rng_set(tr->r, k);
+    traj_start(tr);
+    sweep_point(job->sw, k / job->nrep, job->params[thread]);
+    if(tr->step == NULL){
+        traj_advance(tr, 0, job->tt, NULL);
+    } else {
+        for(t=0; t<job->tt; t=tnext){
+            tnext = (t + job->dt < job->tt) ? t + job->dt : job->tt;
+            traj_advance(tr, t, tnext, NULL);
+        }
+    }
+    memcpy(job->final + (long) k * tr->m->nspecies, tr->state, tr->m->nspecies * sizeof(double));
+}
+
+void sim_sweep(Model_t * m, double tt, double dt, leapStepFunc step, Sweep_t * sw,
+        int nrep, int nthreads){
+    /* Prints the swept values of every point and the mean and variance of
+     * every species at tt over its replicates */
+    int i, k, p, q, ns, ntasks;
+    double *x, *mean, *var, *delta;
+    SweepJob_t job;
+
+    if(nrep < 1){
+        report_error("Sweeps require at least one replicate per point\n");
+        exit(1);
+    }
+    if(step != NULL && dt <= 0){
+        report_error("Sweeps with a leap method require a strictly positive step\n");
+        exit(1);
+    }
+    if((long) sw->npoints * nrep > INT_MAX){
+        report_error("Sweep grid too large\n");
+        exit(1);
+    }
+    ns = m->nspecies;
+    ntasks = sw->npoints * nrep;
+    if(nthreads > ntasks) nthreads = ntasks;
+    if(nthreads < 1) nthreads = 1;
+    job.tt = tt;
+    job.dt = dt;
+    job.nrep = nrep;
+    job.sw = sw;
+    job.tr = (Traj_t **) malloc(nthreads * sizeof(Traj_t *));
+    job.params = (double ***) malloc(nthreads * sizeof(double **));
+    if (!job.tr || !job.params) {
+        report_error("allocation failure in sim_sweep()");
+        exit(1);
+    }
+    job.final = dvector((long) ntasks * ns);
+    for(i=0; i<nthreads; i++){
+        job.tr[i] = traj_new(m, step, rng_new(0));
+        job.params[i] = traj_own_params(job.tr[i]);
+    }
+
+    pool_steal(nthreads, ntasks, sweep_run, &job);
+
+    mean = dvector(ns);
+    var = dvector(ns);
+    delta = dvector(ns);
+    printf("#");
+    for(k=0; k<sw->naxes; k++) printf("%sreaction%d_param%d", (k > 0) ? " " : "", sw->reaction[k], sw->param[k]);
+    for(i=0; i<ns; i++) printf(" %s_mean %s_var", m->species[i], m->species[i]);
+    printf("\n");
+    for(p=0; p<sw->npoints; p++){
+        /* Welford over the replicates */
+        for(i=0; i<ns; i++){
+            mean[i] = 0;
+            var[i] = 0;
+        }
+        for(k=0; k<nrep; k++){
+            x = job.final + ((long) p * nrep + k) * ns;
+            for(i=0; i<ns; i++){
+                delta[i] = x[i] - mean[i];
+                mean[i] += delta[i] / (k + 1);
+                var[i] += delta[i] * (x[i] - mean[i]);
+            }
+        }
+        for(k=0, q=sw->npoints; k<sw->naxes; k++){
+            q /= sw->nvalues[k];
+            printf("%s%g", (k > 0) ? " " : "", sw->values[k][(p / q) % sw->nvalues[k]]);
+        }
+        for(i=0; i<ns; i++) printf(" %g %g", mean[i], (nrep > 1) ? var[i] / (nrep - 1) : 0);
+        printf("\n");
+    }
+
+    for(i=0; i<nthreads; i++){
+        gsl_rng_free(job.tr[i]->r);
+        free_traj(job.tr[i]);
+    }
+    free((char *) job.tr);
+    free((char *) job.params);
+    free_dvector(job.final);
+    free_dvector(mean);
+    free_dvector(var);
+    free_dvector(delta);
+}
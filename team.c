@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+
+/* Thread teams for single trajectories of large networks. The reactions and
+ * the species are split in nthreads static, contiguous partitions. A step
+ * alternates two kinds of phases, separated by a barrier:
+ *      reaction phases, where partition p fills rates[j] (and L[j] or K[j])
+ *          for its reactions only, reading the shared state;
+ *      species phases, where partition p accumulates the rows of the
+ *          stoichiometry of its species, reading every reaction.
+ * No location is written by two partitions, nor read and written within a
+ * phase, so there are no locks, and the sums run over the reactions in the
+ * same order as the serial steps. Partition p draws from random stream p, so
+ * a run only depends on the seed and the number of threads.
+ * Everything is allocated by team_new, the steps allocate nothing.
+ */
+
+typedef struct _TeamArg_t {
+    Team_t * t;
+    int p;
+} TeamArg_t;
+
+static void * team_worker(void * varg){
+    TeamArg_t * a = (TeamArg_t *) varg;
+    Team_t * t = a->t;
+
+    while(1){
+        /* Wait for team_advance, or free_team */
+        pthread_barrier_wait(&t->sync);
+        if(t->quit) break;
+        t->step(t, a->p, t->x, t->tau);
+    }
+    return NULL;
+}
+
+Team_t * team_new(Leap_t * w, teamStepFunc step, int nthreads){
+    int p;
+    Team_t * t;
+    Model_t * m;
+
+    m = w->m;
+    t = (Team_t *) malloc(sizeof(Team_t));
+    if (!t) {
+        report_error("allocation failure in team_new()");
+        exit(1);
+    }
+    t->w = w;
+    t->step = step;
+    t->nthreads = nthreads;
+    t->quit = 0;
+    t->jlo = ivector(nthreads);
+    t->jhi = ivector(nthreads);
+    t->ilo = ivector(nthreads);
+    t->ihi = ivector(nthreads);
+    t->r = (gsl_rng **) malloc(nthreads * sizeof(gsl_rng *));
+    t->s = (Stream_t *) malloc(nthreads * sizeof(Stream_t));
+    t->threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    t->args = (TeamArg_t *) malloc(nthreads * sizeof(TeamArg_t));
+    if (!t->r || !t->s || !t->threads || !t->args) {
+        report_error("allocation failure in team_new()");
+        exit(1);
+    }
+    for(p=0; p<nthreads; p++){
+        t->jlo[p] = (int) ((long) m->Nreactions * p / nthreads);
+        t->jhi[p] = (int) ((long) m->Nreactions * (p + 1) / nthreads);
+        t->ilo[p] = (int) ((long) m->nspecies * p / nthreads);
+        t->ihi[p] = (int) ((long) m->nspecies * (p + 1) / nthreads);
+        t->r[p] = rng_new(p);
+        t->s[p].r = t->r[p];
+        t->s[p].inverse = 0;
+        t->s[p].antithetic = 0;
+        t->s[p].u = NULL;
+        t->args[p].t = t;
+        t->args[p].p = p;
+    }
+    pthread_barrier_init(&t->sync, NULL, nthreads);
+    /* Thread 0 is the caller */
+    for(p=1; p<nthreads; p++){
+        if(pthread_create(t->threads + p, NULL, team_worker, t->args + p) != 0){
+            report_error("Could not start thread %d\n", p);
+            exit(1);
+        }
+    }
+    return t;
+}
+
+void free_team(Team_t * t){
+    int p;
+
+    t->quit = 1;
+    pthread_barrier_wait(&t->sync);
+    for(p=1; p<t->nthreads; p++) pthread_join(t->threads[p], NULL);
+    pthread_barrier_destroy(&t->sync);
+    for(p=0; p<t->nthreads; p++) gsl_rng_free(t->r[p]);
+    free_ivector(t->jlo);
+    free_ivector(t->jhi);
+    free_ivector(t->ilo);
+    free_ivector(t->ihi);
+    free((char *) t->r);
+    free((char *) t->s);
+    free((char *) t->threads);
+    free((char *) t->args);
+    free((char *) t);
+}
+
+void team_advance(Team_t * t, double * x, double tau){
+    /* One step of x of length tau by the whole team. Steps end with a
+     * barrier, so x is complete on return. */
+    t->x = x;
+    t->tau = tau;
+    pthread_barrier_wait(&t->sync);
+    t->step(t, 0, x, tau);
+}
+
+static void team_rates(Team_t * t, int p, double * x){
+    /* Propensities of the reactions of partition p */
+    int j;
+    Model_t * m = t->w->m;
+
+    for(j=t->jlo[p]; j<t->jhi[p]; j++){
+        t->w->rates[j] = m->prop[j](x, m->nreactants[j], m->reactants[j], t->w->params[j], m->acting_species[j]);
+    }
+}
+
+static double team_row(Team_t * t, int i, double * v){
+    /* Row i of the stoichiometry times v */
+    int k;
+    Model_t * m = t->w->m;
+    double acc = 0;
+
+    for(k=m->sptr[i]; k<m->sptr[i+1]; k++) acc += m->sdelta[k] * v[m->sreaction[k]];
+    return acc;
+}
+
+void tleap_team_step(Team_t * t, int p, double * x, double tau){
+    /* tleap_step, with the counts of partition p drawn from its stream */
+    int i, j, k;
+    int * K = t->w->K;
+    Model_t * m = t->w->m;
+    double acc;
+
+    team_rates(t, p, x);
+    for(j=t->jlo[p]; j<t->jhi[p]; j++) K[j] = stream_poisson(t->s + p, tau * t->w->rates[j]);
+    pthread_barrier_wait(&t->sync);
+    for(i=t->ilo[p]; i<t->ihi[p]; i++){
+        acc = 0;
+        for(k=m->sptr[i]; k<m->sptr[i+1]; k++) acc += K[m->sreaction[k]] * m->sdelta[k];
+        x[i] += acc;
+    }
+    pthread_barrier_wait(&t->sync);
+}
+
+void team_nrk_step(Team_t * t, int p, double * x, double tau, const Nrk_t * scheme){
+    /* nrk_step for the partitions of a team */
+    int i, j, k;
+    double *L, *d, *f, *y, *rates;
+
+    L = t->w->L;
+    d = t->w->d;
+    f = t->w->f;
+    y = t->w->y;
+    rates = t->w->rates;
+
+    team_rates(t, p, x);
+    for(j=t->jlo[p]; j<t->jhi[p]; j++) L[j] = stream_poisson(t->s + p, tau * rates[j]) - tau * rates[j];
+    pthread_barrier_wait(&t->sync);
+    for(i=t->ilo[p]; i<t->ihi[p]; i++){
+        d[i] = team_row(t, i, L);
+        f[i] = team_row(t, i, rates);
+    }
+    for(k=0; k<scheme->nstages; k++){
+        for(i=t->ilo[p]; i<t->ihi[p]; i++) y[i] = x[i] + scheme->a[k] * (tau * f[i] + d[i]);
+        pthread_barrier_wait(&t->sync);
+        team_rates(t, p, y);
+        pthread_barrier_wait(&t->sync);
+        for(i=t->ilo[p]; i<t->ihi[p]; i++) f[i] = team_row(t, i, rates);
+    }
+    for(i=t->ilo[p]; i<t->ihi[p]; i++){
+        x[i] += (tau * f[i] + d[i]);
+        if(x[i] < 0) x[i] = 0;
+    }
+    pthread_barrier_wait(&t->sync);
+}
+
+teamStepFunc team_method(leapStepFunc step){
+    /* Team version of a leap step, NULL if there is none */
+    if(step == tleap_step) return tleap_team_step;
+    if(step == nrk_step) return nrk_team_step;
+    return NULL;
+}
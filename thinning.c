@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+
+/* Exact SSA for time dependent parameters by thinning (Lewis & Shedler).
+ * Between two output points the state only changes at accepted reactions, so
+ * with the state frozen every propensity is bounded over the rest of the output
+ * interval by evaluating it at the bounds of its time dependent parameter
+ * (propensities are monotone in each parameter). Candidate times are drawn
+ * from the total bound B and accepted with probability a0(t) / B, in which case
+ * the reaction is chosen from the actual propensities at t. Only the reactions
+ * with time dependent parameters are re-evaluated at candidate times, so the
+ * cost stays close to the direct method when the bound is tight.
+ */
+
+void sim_thinning(Model_t * m, double tt, double hurdle, Stop_t * stop){
+    int i, j, k, step;
+    int nreactions, nspecies;
+    int *nr, **rs, **as, *input, *armed;
+    double *state, *rates, *bound;
+    double **params;
+    propensityFunc * prop;
+    int nsteps, warned;
+    double t, B, a0, thr, runningSum, nextHurdle, tend, tevent, lo, hi, blo, bhi;
+    double tstop;
+    stop_reason reason;
+    Input_t * in;
+    gsl_rng * r;
+
+    if(hurdle <= 0){
+        report_error("Thinning requires a strictly positive output step\n");
+        exit(1);
+    }
+    /* The bounds call the rate laws one by one */
+    if(m->rates != NULL) report_warning("Thinning ignores the compiled model\n");
+    /* Get the pointers */
+    nreactions = m->Nreactions;
+    nspecies = m->nspecies;
+    prop = m->prop;
+    nr = m->nreactants;
+    rs = m->reactants;
+    as = m->acting_species;
+    state = dzeros(nspecies);
+    for(i=0; i<nspecies; i++) state[i] = (double) m->istate[i];
+    rates = dzeros(nreactions);
+    bound = dzeros(nreactions);
+    params = model_params_copy(m);
+    armed = ivector(m->nevents);
+    events_reset(m, armed);
+    /* Input driving each reaction, -1 if none */
+    input = ivector(nreactions);
+    for(j=0; j<nreactions; j++) input[j] = -1;
+    for(k=0; k<m->ninputs; k++) input[m->inputs[k].reaction] = k;
+
+    r = rng_new(0);
+
+    t = 0;
+    events_fire(m, armed, t, state, params);
+    /* Header: column names */
+    printf("#time ");
+    for(i=0; i<nspecies; i++) printf("%s ", m->species[i]);
+    printf("\n");
+    printf("%g ", t);
+    for(i=0; i<nspecies; i++) printf("%ld ", (long) state[i]);
+    printf("\n");
+
+    nsteps = (int) ceil(tt / hurdle);
+    warned = 0;
+    step = 0;
+    nextHurdle = hurdle;
+    reason = STOP_NONE;
+    tstop = 0;
+    if(stop != NULL) stop_reset(stop);
+    while(step < nsteps && reason == STOP_NONE){
+        /* Bound the propensities until the next output point or event */
+        tevent = events_next_time(m, armed);
+        tend = (tevent < nextHurdle) ? tevent : nextHurdle;
+        B = 0;
+        for(j=0; j<nreactions; j++){
+            if(input[j] < 0){
+                rates[j] = model_prop(m, j, state, params[j]);
+                bound[j] = rates[j];
+            } else {
+                in = m->inputs + input[j];
+                input_bounds(in, t, tend, &lo, &hi);
+                params[j][in->param] = lo;
+                blo = prop[j](state, nr[j], rs[j], params[j], as[j]);
+                params[j][in->param] = hi;
+                bhi = prop[j](state, nr[j], rs[j], params[j], as[j]);
+                bound[j] = (blo > bhi) ? blo : bhi;
+            }
+            B += bound[j];
+        }
+        /* Candidates until one is accepted or the output point is reached */
+        while(1){
+            if(B > 0){
+                t += (-1/B) * log(gsl_rng_uniform_pos(r));
+            } else {
+                t = tend;
+            }
+            if(t >= tend){
+                t = tend;
+                /* Output points show the state right after the events */
+                if(t >= tevent) events_fire(m, armed, t, state, params);
+                if(t >= nextHurdle){
+                    step += 1;
+                    printf("%g ", nextHurdle);
+                    for(i=0; i<nspecies; i++) printf("%ld ", (long) state[i]);
+                    printf("\n");
+                    tstop = nextHurdle;
+                    nextHurdle += hurdle;
+                    reason = stop_check(stop, state, params, armed);
+                }
+                break;
+            }
+            a0 = 0;
+            for(j=0; j<nreactions; j++){
+                if(input[j] >= 0){
+                    in = m->inputs + input[j];
+                    params[j][in->param] = input_value(in, t);
+                    rates[j] = prop[j](state, nr[j], rs[j], params[j], as[j]);
+                }
+                a0 += rates[j];
+            }
+            if(a0 > B * (1 + 1e-12) && !warned){
+                report_warning("Thinning bound exceeded at t=%g, propensities are not monotone in their time dependent parameter\n", t);
+                warned = 1;
+            }
+            thr = B * gsl_rng_uniform_pos(r);
+            /* Rejected candidate: the state and the bound stay the same */
+            if(thr >= a0) continue;
+            runningSum = 0;
+            for(j=0; j<nreactions-1; j++){
+                runningSum += rates[j];
+                if(runningSum > thr) break;
+            }
+            /* Species update */
+            model_fire(m, j, state);
+            if(m->nevents > 0) events_fire(m, armed, t, state, params);
+            if(stop != NULL && stop->cond != NULL && condition_holds(stop->cond, state)){
+                reason = STOP_CONDITION;
+                tstop = t;
+            }
+            break;
+        }
+    }
+    /* The remaining output points keep the state at the stop */
+    if(reason != STOP_NONE){
+        printf("# %s at t=%g\n", stop_name(reason), tstop);
+        while(step < nsteps){
+            step += 1;
+            printf("%g ", nextHurdle);
+            for(i=0; i<nspecies; i++) printf("%ld ", (long) state[i]);
+            printf("\n");
+            nextHurdle += hurdle;
+        }
+    }
+    free_params(m, params);
+    free_ivector(input);
+    free_ivector(armed);
+    free_dvector(state);
+    free_dvector(rates);
+    free_dvector(bound);
+    gsl_rng_free(r);
+    return;
+}
@@ -17,49 +17,219 @@
 
 #include "methods.h"
 #include "time.h"
-#include<unistd.h>
 
 #ifdef PRINT_RUNTIME
 clock_t start, end;
 #endif
 
-void sim_tleap(Model_t * m, double tt, double tau){
-    int i, j, step;
-    long seed;
+Leap_t * leap_new(Model_t * m){
+    /* Allocates the workspace of the leap methods for one trajectory */
     int nreactions, nspecies;
-    int **rs, **stoich, **as, *K;
-    double *state;
-    propensityFunc * prop;
-    double **params;
-    int nsteps;
-    double rate;
-    const gsl_rng_type * type = gsl_rng_default;
-    gsl_rng * r;
+    Leap_t * w;
 
-    /* Get the pointers */
+    w = (Leap_t *) malloc(sizeof(Leap_t));
+    if (!w) {
+        report_error("allocation failure in leap_new()");
+        exit(1);
+    }
     nreactions = m->Nreactions;
     nspecies = m->nspecies;
-    /* Convention: rows correspond to species while columns to reactions, thus
-     * stoich[i][j] refers to the stoichiometry of the species i due to reaction j */
-    stoich = imatrix(nspecies, nreactions);
-    rs = m->rstoichiometry;
-    for(i=0; i< nspecies;i++){
-        for(j=0; j< nreactions; j++){
-            stoich[i][j] = (m->pstoichiometry[j][i] - rs[j][i]);
+    w->m = m;
+    w->params = (m->ninputs > 0 || m->nevents > 0) ? model_params_copy(m) : m->params;
+    w->armed = ivector(m->nevents);
+    w->K = ivector(nreactions);
+    w->rates = dzeros(nreactions);
+    w->L = dvector(nreactions);
+    w->d = dvector(nspecies);
+    w->f = dvector(nspecies);
+    w->y = dvector(nspecies);
+    w->team = NULL;
+    return w;
+}
+
+void free_leap(Leap_t * w){
+    if(w->team != NULL) free_team(w->team);
+    if(w->params != w->m->params) free_params(w->m, w->params);
+    free_ivector(w->armed);
+    free_ivector(w->K);
+    free_dvector(w->rates);
+    free_dvector(w->L);
+    free_dvector(w->d);
+    free_dvector(w->f);
+    free_dvector(w->y);
+    free((char *) w);
+}
+
+void leap_start(Leap_t * w, double * state){
+    /* Sets state to the initial condition and restores the parameters and
+     * events of w for a new trajectory */
+    int i;
+    Model_t * m;
+
+    m = w->m;
+    for(i=0; i<m->nspecies; i++) state[i] = (double) m->istate[i];
+    if(w->params != m->params) model_params_reset(m, w->params);
+    events_reset(m, w->armed);
+    events_fire(m, w->armed, 0, state, w->params);
+}
+
+void leap_advance(Leap_t * w, leapStepFunc step, double * state, double t,
+        double tend, Stream_t * s){
+    /* Leaps from t to tend, in a single step unless timed events fall in
+     * between, in which case the step is split at them. Time dependent
+     * parameters are frozen along each step and the triggered events are
+     * checked at the end of each one. */
+    double tevent, tnext;
+    Model_t * m;
+
+    m = w->m;
+    while(t < tend){
+        tevent = events_next_time(m, w->armed);
+        tnext = (tevent < tend) ? tevent : tend;
+        if(m->ninputs > 0) model_set_inputs(m, w->params, t);
+        if(w->team != NULL) team_advance(w->team, state, tnext - t);
+        else step(w, state, tnext - t, s);
+        t = tnext;
+        if(m->nevents > 0) events_fire(m, w->armed, t, state, w->params);
+    }
+}
+
+leapStepFunc leap_method(char * name){
+    /* Step function of the leap method called name, NULL if there is none */
+    if(strcmp(name,"tleap") == 0) return tleap_step;
+    return nrk_method(name);
+}
+
+void tleap_step(Leap_t * w, double * state, double tau, Stream_t * s){
+    int i, j, k;
+    int nreactions, nspecies;
+    int *K, *sptr, *sreaction, *sdelta;
+
+    nreactions = w->m->Nreactions;
+    nspecies = w->m->nspecies;
+    sptr = w->m->sptr;
+    sreaction = w->m->sreaction;
+    sdelta = w->m->sdelta;
+    K = w->K;
+
+    model_rates(w->m, state, w->params, w->rates);
+    for(j=0; j< nreactions; j++) K[j] = stream_poisson(s, tau * w->rates[j]);
+    /* Species update */
+    for(i=0; i<nspecies; i++){
+        for(k=sptr[i]; k<sptr[i+1]; k++) {
+            state[i] += K[sreaction[k]] * sdelta[k];
         }
     }
-    prop = m->prop;
-    params = m->params;
-    state = dzeros(nspecies);
-    for(i=0; i<nspecies; i++) state[i] = (double) m->istate[i];
-    as = m->acting_species;
+}
 
-    gsl_rng_env_setup();
-    r = gsl_rng_alloc (type);
-    seed = time(NULL) * getpid();
-    gsl_rng_set (r, seed);                  // set seed
+void tleap_batch_step(Batch_t * b, double * x, double tau){
+    /* tleap_step across the lanes of b, the counts are kept in b->L */
+    int i, j, k, l, c;
+    double *K, *rates;
+    double acc[BATCH_LANES];
 
-    K = ivector(nreactions);
+    K = b->L;
+    rates = b->rates;
+    batch_propensities(b, x);
+    for(j=0; j<b->m->Nreactions; j++){
+        for(l=0; l<b->nlanes; l++) K[j*BATCH_LANES + l] = stream_poisson(b->s + l, tau * rates[j*BATCH_LANES + l]);
+        for(; l<BATCH_LANES; l++) K[j*BATCH_LANES + l] = 0;
+    }
+    /* Species update */
+    for(i=0; i<b->m->nspecies; i++){
+        for(l=0; l<BATCH_LANES; l++) acc[l] = x[i*BATCH_LANES + l];
+        for(k=b->m->sptr[i]; k<b->m->sptr[i+1]; k++){
+            j = b->m->sreaction[k];
+            c = b->m->sdelta[k];
+            for(l=0; l<BATCH_LANES; l++) acc[l] += K[j*BATCH_LANES + l] * c;
+        }
+        for(l=0; l<BATCH_LANES; l++) x[i*BATCH_LANES + l] = acc[l];
+    }
+}
+
+void tleap_batch_step_compact(Batch_t * b, double tau){
+    /* tleap_batch_step on the 32 bit counts and float propensities of a
+     * compact batch. The update is done in 64 bits and, if some count leaves
+     * the int32 range, the batch is promoted and updated in double precision
+     * with the same Poisson counts. */
+    int i, j, k, l, c, over;
+    int64_t acc[BATCH_LANES];
+    unsigned int * K;
+
+    K = b->k;
+    batch_propensities_compact(b);
+    for(j=0; j<b->m->Nreactions; j++){
+        for(l=0; l<b->nlanes; l++) K[j*BATCH_LANES + l] = stream_poisson(b->s + l, tau * b->fr[j*BATCH_LANES + l]);
+        for(; l<BATCH_LANES; l++) K[j*BATCH_LANES + l] = 0;
+    }
+    over = 0;
+    for(i=0; i<b->m->nspecies; i++){
+        for(l=0; l<BATCH_LANES; l++) acc[l] = b->xc[i*BATCH_LANES + l];
+        for(k=b->m->sptr[i]; k<b->m->sptr[i+1]; k++){
+            j = b->m->sreaction[k];
+            c = b->m->sdelta[k];
+            for(l=0; l<BATCH_LANES; l++) acc[l] += (int64_t) K[j*BATCH_LANES + l] * c;
+        }
+        for(l=0; l<BATCH_LANES; l++){
+            over |= (acc[l] > INT32_MAX) | (acc[l] < INT32_MIN);
+            b->acc[i*BATCH_LANES + l] = acc[l];
+        }
+    }
+    if(over){
+        batch_promote(b);
+        for(i=0; i<b->m->nspecies; i++){
+            for(k=b->m->sptr[i]; k<b->m->sptr[i+1]; k++){
+                j = b->m->sreaction[k];
+                c = b->m->sdelta[k];
+                for(l=0; l<BATCH_LANES; l++) b->x[i*BATCH_LANES + l] += (double) K[j*BATCH_LANES + l] * c;
+            }
+        }
+        return;
+    }
+    for(i=0; i<b->m->nspecies * BATCH_LANES; i++) b->xc[i] = (int32_t) b->acc[i];
+}
+
+void sim_tleap(Model_t * m, double tt, double tau, Stop_t * stop){
+    sim_leap(m, tt, tau, tleap_step, stop, 1);
+}
+
+void sim_leap(Model_t * m, double tt, double tau, leapStepFunc step, Stop_t * stop, int nthreads){
+    /* Single trajectory of a leap method with constant step tau, taken by a
+     * team of nthreads threads if nthreads > 1 */
+    teamStepFunc tstep;
+    int step_n;
+    #ifdef OUTPUT_SPECIES
+    int i;
+    #endif
+    int nspecies;
+    double *state;
+    int nsteps;
+    Leap_t * w;
+    Stream_t s;
+    stop_reason reason;
+    gsl_rng * r;
+    #ifdef PRINT_RUNTIME
+    clock_t start, end;
+    #endif
+
+    nspecies = m->nspecies;
+    state = dzeros(nspecies);
+    w = leap_new(m);
+    if(nthreads > 1){
+        tstep = team_method(step);
+        if(tstep == NULL) report_warning("This leap method has no threaded version\n");
+        else w->team = team_new(w, tstep, nthreads);
+        /* Each thread of the team calls the rate laws of its own reactions */
+        if(w->team != NULL && m->rates != NULL) report_warning("Threaded leap steps ignore the compiled model\n");
+    }
+    leap_start(w, state);
+    if(stop != NULL) stop_reset(stop);
+
+    r = rng_new(0);
+    s.r = r;
+    s.inverse = 0;
+    s.antithetic = 0;
+    s.u = NULL;
 
     #ifdef OUTPUT_SPECIES
     /* Header: column names */
@@ -79,34 +249,39 @@ void sim_tleap(Model_t * m, double tt, double tau){
         start = clock();
         #endif
         nsteps = (int) ceil(tt / tau);
-        for(step=0; step < nsteps; step++) {
-            for(j=0; j< nreactions; j++){
-                rate = prop[j](state, nspecies, rs[j], params[j], as[j]);
-                K[j] = gsl_ran_poisson (r, tau * rate);
-            }
-            /* Species update */
-            for(i=0; i<nspecies; i++){
-                for(j=0; j<nreactions; j++) {
-                    state[i] += K[j] * stoich[i][j];
-                }
-            }
+        reason = STOP_NONE;
+        for(step_n=0; step_n < nsteps && reason == STOP_NONE; step_n++) {
+            leap_advance(w, step, state, tau * step_n, tau * (step_n+1), &s);
             #ifdef OUTPUT_SPECIES
-            printf("%g ", tau * (step+1));
+            printf("%g ", tau * (step_n+1));
             for(i=0; i<nspecies; i++) printf("%ld ", (long) state[i]);
             printf("\n");
             #endif
+            reason = stop_check(stop, state, w->params, w->armed);
         }
+        #ifdef OUTPUT_SPECIES
+        /* The remaining output points keep the state at the stop */
+        if(reason != STOP_NONE){
+            printf("# %s at t=%g\n", stop_name(reason), tau * step_n);
+            for(; step_n < nsteps; step_n++) {
+                printf("%g ", tau * (step_n+1));
+                for(i=0; i<nspecies; i++) printf("%ld ", (long) state[i]);
+                printf("\n");
+            }
+        }
+        #endif
         #ifdef PRINT_RUNTIME
         end = clock();
         printf("%g ", (double) (end - start)/CLOCKS_PER_SEC);
         #endif
         #ifdef OUTPUT_SPECIES
-        printf("%g ", tau * (step+1));
+        printf("%g ", tau * (step_n+1));
         for(i=0; i<nspecies; i++) printf("%ld ", (long) state[i]);
         printf("\n");
         #endif
     }
-    free_ivector(K);
+    free_leap(w);
+    free_dvector(state);
     gsl_rng_free(r);
     return;
 }
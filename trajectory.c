@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+
+/* One trajectory advanced from grid point to grid point, with the direct
+ * method if step is NULL (exact, restarting at every grid point by
+ * memorylessness) or with a leap method otherwise. It owns everything a
+ * trajectory modifies, so several of them can share the same model.
+ */
+
+Traj_t * traj_new(Model_t * m, leapStepFunc step, gsl_rng * r){
+    Traj_t * tr;
+
+    tr = (Traj_t *) malloc(sizeof(Traj_t));
+    if (!tr) {
+        report_error("allocation failure in traj_new()");
+        exit(1);
+    }
+    tr->m = m;
+    tr->step = step;
+    tr->r = r;
+    tr->state = dvector(m->nspecies);
+    tr->rates = dvector(m->Nreactions);
+    tr->w = NULL;
+    tr->params = NULL;
+    tr->armed = NULL;
+    if(step != NULL){
+        tr->w = leap_new(m);
+    } else {
+        tr->params = (m->nevents > 0) ? model_params_copy(m) : m->params;
+        tr->armed = ivector(m->nevents);
+    }
+    tr->s.r = r;
+    tr->s.inverse = 0;
+    tr->s.antithetic = 0;
+    tr->s.u = NULL;
+    return tr;
+}
+
+void free_traj(Traj_t * tr){
+    if(tr->w != NULL) free_leap(tr->w);
+    if(tr->params != NULL && tr->params != tr->m->params) free_params(tr->m, tr->params);
+    if(tr->armed != NULL) free_ivector(tr->armed);
+    free_dvector(tr->state);
+    free_dvector(tr->rates);
+    free((char *) tr);
+}
+
+void traj_start(Traj_t * tr){
+    /* Initial condition, parameters and events of a new trajectory */
+    int i;
+    Model_t * m;
+
+    m = tr->m;
+    if(tr->step != NULL){
+        leap_start(tr->w, tr->state);
+        return;
+    }
+    for(i=0; i<m->nspecies; i++) tr->state[i] = (double) m->istate[i];
+    if(tr->params != m->params) model_params_reset(m, tr->params);
+    events_reset(m, tr->armed);
+    events_fire(m, tr->armed, 0, tr->state, tr->params);
+}
+
+double traj_advance(Traj_t * tr, double t, double tend, Condition_t * stop){
+    /* Advances the state from t to tend. The direct method halts as soon as
+     * stop (if not NULL) holds and returns that time; leap methods only
+     * return tend, stop has to be checked by the caller. */
+    if(tr->step != NULL){
+        leap_advance(tr->w, tr->step, tr->state, t, tend, &tr->s);
+        return tend;
+    }
+    return ssa_advance(tr->m, tr->params, tr->armed, tr->state, tr->rates, t, tend, tr->r, stop);
+}
+
+double ** traj_own_params(Traj_t * tr){
+    /* Gives tr a private copy of the parameters, which traj_start restores to
+     * the model values, and returns it so that they can be changed after */
+    if(tr->step != NULL){
+        if(tr->w->params == tr->m->params) tr->w->params = model_params_copy(tr->m);
+        return tr->w->params;
+    }
+    if(tr->params == tr->m->params) tr->params = model_params_copy(tr->m);
+    return tr->params;
+}
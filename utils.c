@@ -50,28 +50,6 @@ int *ivector(long n)
 	return v;
 }
 
-int **imatrix(int nr, int nc)
-/* Allocate a int vector of size n */
-{
-    int i;
-    int **m;
-
-    m = (int **) calloc(nr, sizeof(int *));
-    if (!m) {
-        report_error("allocation failure in imatrix()");
-        exit(1);
-    }
-    for(i=0; i<nr; i++) {
-        m[i] = (int *) calloc(nc, sizeof(int));
-        if (!m[i]) {
-            report_error("allocation failure in imatrix()");
-            exit(1);
-        }
-    }
-    return m;
-}
-
-
 int *izeros(long n)
 /* Allocate a int vector of size n and set it to zero*/
 {
@@ -190,6 +168,7 @@ iList_t * ilist_new() {
 
 	l = (iList_t *) malloc(sizeof(iList_t));
 	if (!l) report_error("allocation failure in ilist_new()");
+	l->size = 0;
 	return l;
 }
 
@@ -211,6 +190,7 @@ List_t * list_new(){
 
 	l = (List_t *) malloc(sizeof(List_t));
 	if (!l) report_error("allocation failure in list()");
+	l->size = 0;
 	return l;
 }
 
@@ -53,8 +53,6 @@ double *dzeros(long n);
 
 int *ivector(long n);
 /* Allocate a int vector of size n */
-int **imatrix(int nr, int nc);
-/* Allocate a int vector of size nr x nc */
 
 int *izeros(long n);
 
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2013 Pau Rué <pau.rue@gmail.com>
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "methods.h"
+
+/* Weighted ensemble (Huber & Kim) with recycling.
+ * Walkers are propagated with the direct method for tau time units, binned
+ * along the progress coordinate and resampled so that every occupied bin holds
+ * exactly nwalkers walkers. Walkers reaching the target region are recycled to
+ * the initial state and their weight is accounted as probability flux, which
+ * at steady state is the transition rate into the target.
+ * Bin 0 collects coordinates below bmin and bin nbins+1 those above bmax.
+ */
+
+static int we_bin(double x, double bmin, double bmax, int nbins){
+    if(x < bmin) return 0;
+    if(x >= bmax) return nbins + 1;
+    return 1 + (int) (nbins * (x - bmin) / (bmax - bmin));
+}
+
+static void we_resample(int * src, double * w, int * n, int target, gsl_rng * r){
+    /* Merge the two lightest walkers until there are at most target of them,
+     * then split the heaviest one until there are target of them. Merging keeps
+     * one of the pair with probability proportional to its weight, so weights
+     * are unbiased. */
+    int k, i1, i2, tmp;
+    double wsum;
+
+    while(*n > target){
+        i1 = 0;
+        i2 = 1;
+        if(w[i2] < w[i1]) { i1 = 1; i2 = 0; }
+        for(k=2; k<*n; k++){
+            if(w[k] < w[i1]) { i2 = i1; i1 = k; }
+            else if(w[k] < w[i2]) { i2 = k; }
+        }
+        wsum = w[i1] + w[i2];
+        if(gsl_rng_uniform(r) * wsum >= w[i1]) { tmp = i1; i1 = i2; i2 = tmp; }
+        /* i1 survives, i2 is replaced by the last walker */
+        w[i1] = wsum;
+        (*n)--;
+        src[i2] = src[*n];
+        w[i2] = w[*n];
+    }
+    while(*n < target){
+        i1 = 0;
+        for(k=1; k<*n; k++){
+            if(w[k] > w[i1]) i1 = k;
+        }
+        w[i1] *= 0.5;
+        src[*n] = src[i1];
+        w[*n] = w[i1];
+        (*n)++;
+    }
+}
+
+void sim_weighted_ensemble(Model_t * m, double tt, double tau, Coordinate_t * coord,
+        double bmin, double bmax, int nbins, int nwalkers, Condition_t * target){
+    int i, k, b, n, iter, niter, first, nstat, nb, nw, nnew, maxw;
+    int nspecies;
+    int *bin, *src;
+    double *state, *newstate, *weight, *newweight, *w, *rates, *pbin, *swap;
+    double flux, fluxsum, fluxsq, mean, sem;
+    gsl_rng * r;
+
+    if(tau <= 0 || tt <= 0){
+        report_error("Weighted ensemble requires strictly positive simulation time and resampling interval\n");
+        exit(1);
+    }
+    if(nbins < 1 || nwalkers < 1 || bmax <= bmin){
+        report_error("Weighted ensemble requires at least one bin and one walker per bin\n");
+        exit(1);
+    }
+
+    nspecies = m->nspecies;
+    nb = nbins + 2;
+    maxw = nb * nwalkers;
+    state = dvector(maxw * nspecies);
+    newstate = dvector(maxw * nspecies);
+    weight = dvector(maxw);
+    newweight = dvector(maxw);
+    bin = ivector(maxw);
+    src = ivector(maxw);
+    w = dvector(maxw);
+    pbin = dzeros(nb);
+    rates = dvector(m->Nreactions);
+
+    r = rng_new(0);
+
+    /* All walkers start at the initial condition */
+    nw = nwalkers;
+    for(k=0; k<nw; k++){
+        for(i=0; i<nspecies; i++) state[k*nspecies + i] = (double) m->istate[i];
+        weight[k] = 1.0 / nwalkers;
+    }
+
+    printf("#time flux walkers\n");
+    niter = (int) ceil(tt / tau);
+    /* Steady state statistics over the second half of the iterations, or
+     * the only one */
+    first = (niter + 1) / 2;
+    if(first == niter) first = niter - 1;
+    nstat = 0;
+    fluxsum = 0;
+    fluxsq = 0;
+    for(iter=0; iter<niter; iter++){
+        /* Propagation and recycling */
+        flux = 0;
+        for(k=0; k<nw; k++){
+            ssa_advance(m, m->params, NULL, state + k*nspecies, rates, 0, tau, r, target);
+            if(target != NULL && condition_holds(target, state + k*nspecies)){
+                flux += weight[k];
+                for(i=0; i<nspecies; i++) state[k*nspecies + i] = (double) m->istate[i];
+            }
+            bin[k] = we_bin(coordinate_value(coord, state + k*nspecies), bmin, bmax, nbins);
+        }
+        flux /= tau;
+
+        /* Resampling, bin by bin */
+        nnew = 0;
+        for(b=0; b<nb; b++){
+            n = 0;
+            for(k=0; k<nw; k++){
+                if(bin[k] == b){
+                    src[n] = k;
+                    w[n] = weight[k];
+                    n++;
+                }
+            }
+            if(n == 0) continue;
+            we_resample(src, w, &n, nwalkers, r);
+            for(k=0; k<n; k++){
+                memcpy(newstate + nnew*nspecies, state + src[k]*nspecies, nspecies * sizeof(double));
+                newweight[nnew] = w[k];
+                if(iter >= first) pbin[b] += w[k];
+                nnew++;
+            }
+        }
+        swap = state; state = newstate; newstate = swap;
+        swap = weight; weight = newweight; newweight = swap;
+        nw = nnew;
+
+        if(iter >= first){
+            fluxsum += flux;
+            fluxsq += flux * flux;
+            nstat++;
+        }
+        printf("%g %g %d\n", tau * (iter+1), flux, nw);
+    }
+
+    mean = fluxsum / nstat;
+    sem = (nstat > 1) ? sqrt((fluxsq / nstat - mean * mean) / (nstat - 1)) : 0;
+    printf("# rate %g +- %g (over the last %d iterations)\n", mean, sem, nstat);
+    printf("#bin_lower bin_upper probability\n");
+    for(b=0; b<nb; b++){
+        printf("%g %g %g\n",
+                (b == 0) ? -INFINITY : bmin + (b-1) * (bmax - bmin) / nbins,
+                (b == nb-1) ? INFINITY : bmin + b * (bmax - bmin) / nbins,
+                pbin[b] / nstat);
+    }
+
+    free_dvector(state);
+    free_dvector(newstate);
+    free_dvector(weight);
+    free_dvector(newweight);
+    free_ivector(bin);
+    free_ivector(src);
+    free_dvector(w);
+    free_dvector(pbin);
+    free_dvector(rates);
+    gsl_rng_free(r);
+    return;
+}